@@ -1,15 +1,38 @@
 ﻿#include "main.hpp"
 
 #include <algorithm>
+#include <array>
 #include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <cstdarg>
+#include <csignal>
+#include <cstdio>
 #include <cstdlib>
 #include <fstream>
 #include <future>
 #include <iostream>
 #include <map>
 #include <regex>
+#include <string_view>
 #include <thread>
 
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <io.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include <bzlib.h>
 #include <curl/curl.h>
 #include <nlohmann/json.hpp>
@@ -20,15 +43,422 @@
 
 using nlohmann::json;
 
-void LiveLog::push( std::string s ) {
-    std::lock_guard lk( mtx );
-    lines.emplace_back( std::move( s ) );
-    if ( lines.size() > 800 ) lines.erase( lines.begin(), lines.begin() + 200 );
+LogRing::LogRing( size_t capacity ) {
+    size_t cap = 1;
+    while ( cap < capacity ) cap <<= 1;
+    mask_ = cap - 1;
+    slots_ = std::make_unique<Slot[]>( cap );
+}
+
+uint64_t LogRing::push( std::string_view s ) {
+    uint64_t seq = head_.fetch_add( 1, std::memory_order_acq_rel );
+    Slot &slot = slots_[ seq & mask_ ];
+    // Only another writer that lapped the ring onto this slot can hold it.
+    uint64_t v = slot.version.load( std::memory_order_relaxed );
+    while ( ( v & 1 ) || !slot.version.compare_exchange_weak( v, v + 1, std::memory_order_acquire ) ) {
+        if ( v & 1 ) std::this_thread::yield();
+        v = slot.version.load( std::memory_order_relaxed );
+    }
+    std::atomic_thread_fence( std::memory_order_release );
+    // A writer that lapped this one may already have filled the slot with a newer entry.
+    uint64_t held = slot.seq.load( std::memory_order_relaxed );
+    if ( held == UINT64_MAX || held < seq ) {
+        size_t n = std::min( s.size(), kMaxText );
+        std::memcpy( slot.text, s.data(), n );
+        slot.len.store( ( uint32_t ) n, std::memory_order_relaxed );
+        slot.seq.store( seq, std::memory_order_relaxed );
+    }
+    slot.version.store( v + 2, std::memory_order_release );
+    return seq;
+}
+
+int LogRing::copy_slot( uint64_t seq, std::string &out ) const {
+    const Slot &slot = slots_[ seq & mask_ ];
+    char text[ kMaxText ];
+    for ( ;; ) {
+        uint64_t v = slot.version.load( std::memory_order_acquire );
+        if ( v & 1 ) {
+            std::this_thread::yield();
+            continue;
+        }
+        uint64_t held = slot.seq.load( std::memory_order_relaxed );
+        size_t n = std::min<size_t>( slot.len.load( std::memory_order_relaxed ), kMaxText );
+        if ( held == seq ) std::memcpy( text, slot.text, n );
+        std::atomic_thread_fence( std::memory_order_acquire );
+        if ( slot.version.load( std::memory_order_relaxed ) != v ) continue;
+        // Allocating happens outside the slot, once the copy is known to be whole.
+        if ( held == seq ) {
+            out.assign( text, n );
+            return 0;
+        }
+        return ( held == UINT64_MAX || held < seq ) ? 1 : 2;
+    }
+}
+
+uint64_t LogRing::read_since( uint64_t from, std::vector<std::string> &out ) const {
+    uint64_t head = pushed();
+    if ( head > from + capacity() ) from = head - capacity();
+    std::string text;
+    for ( ; from < head; ++from ) {
+        int rc = copy_slot( from, text );
+        if ( rc == 1 ) break;
+        if ( rc == 0 ) out.push_back( text );
+    }
+    return from;
+}
+
+std::vector<std::string> LogRing::newest( size_t n ) const {
+    std::vector<std::string> out;
+    uint64_t head = pushed();
+    uint64_t lo = head > capacity() ? head - capacity() : 0;
+    std::string text;
+    for ( uint64_t seq = head; seq > lo && out.size() < n; --seq )
+        if ( copy_slot( seq - 1, text ) == 0 ) out.push_back( text );
+    return out;
+}
+
+LiveLog::~LiveLog() {
+    end_session();
+}
+
+void LiveLog::push( std::string_view s ) {
+    uint64_t seq = lines.push( s );
+    // Nudge the session writer well before the ring could lap it.
+    if ( ( seq & ( lines.capacity() / 4 - 1 ) ) == 0 ) session_cv_.notify_one();
+}
+
+void LiveLog::fail( std::string_view s ) {
+    uint64_t seq = failures.push( s );
+    if ( ( seq & ( failures.capacity() / 4 - 1 ) ) == 0 ) session_cv_.notify_one();
+}
+
+void LiveLog::pushf( const char *fmt, ... ) {
+    char buf[ 512 ];
+    va_list ap;
+    va_start( ap, fmt );
+    int n = std::vsnprintf( buf, sizeof( buf ), fmt, ap );
+    va_end( ap );
+    if ( n >= 0 ) push( std::string_view( buf, std::min( ( size_t ) n, sizeof( buf ) - 1 ) ) );
+}
+
+void LiveLog::failf( const char *fmt, ... ) {
+    char buf[ 512 ];
+    va_list ap;
+    va_start( ap, fmt );
+    int n = std::vsnprintf( buf, sizeof( buf ), fmt, ap );
+    va_end( ap );
+    if ( n >= 0 ) fail( std::string_view( buf, std::min( ( size_t ) n, sizeof( buf ) - 1 ) ) );
+}
+
+bool LiveLog::begin_session( const fs::path &path ) {
+    end_session();
+#ifdef _WIN32
+    FILE *f = _wfopen( path.wstring().c_str(), L"wb" );
+#else
+    FILE *f = fopen( path.string().c_str(), "wb" );
+#endif
+    if ( !f ) return false;
+
+    std::lock_guard lk( session_mtx_ );
+    session_file_ = f;
+    session_stop_ = false;
+    // Whatever was logged before the file existed (settings load, etc.) goes first.
+    line_cursor_ = lines.pushed() > lines.capacity() ? lines.pushed() - lines.capacity() : 0;
+    fail_cursor_ = failures.pushed() > failures.capacity() ? failures.pushed() - failures.capacity() : 0;
+    session_thread_ = std::thread( [ this ] { session_loop(); } );
+    return true;
+}
+
+void LiveLog::end_session() {
+    {
+        std::lock_guard lk( session_mtx_ );
+        if ( !session_thread_.joinable() ) return;
+        session_stop_ = true;
+    }
+    session_cv_.notify_one();
+    session_thread_.join();
+    fclose( session_file_ );
+    session_file_ = nullptr;
+}
+
+void LiveLog::session_drain() {
+    std::vector<std::string> batch;
+    uint64_t lost = lines.pushed() > line_cursor_ + lines.capacity() ? lines.pushed() - lines.capacity() - line_cursor_ : 0;
+    line_cursor_ = lines.read_since( line_cursor_, batch );
+    if ( lost ) std::fprintf( session_file_, "[i] (%llu log lines dropped)\n", ( unsigned long long ) lost );
+    for ( auto &l : batch ) {
+        std::fwrite( l.data(), 1, l.size(), session_file_ );
+        std::fputc( '\n', session_file_ );
+    }
+
+    batch.clear();
+    lost = failures.pushed() > fail_cursor_ + failures.capacity() ? failures.pushed() - failures.capacity() - fail_cursor_ : 0;
+    fail_cursor_ = failures.read_since( fail_cursor_, batch );
+    if ( lost ) std::fprintf( session_file_, "[FAIL] (%llu failures dropped)\n", ( unsigned long long ) lost );
+    for ( auto &l : batch ) std::fprintf( session_file_, "[FAIL] %s\n", l.c_str() );
+    std::fflush( session_file_ );
+}
+
+void LiveLog::session_loop() {
+    std::unique_lock lk( session_mtx_ );
+    while ( !session_stop_ ) {
+        session_cv_.wait_for( lk, std::chrono::milliseconds( 250 ) );
+        session_drain();
+    }
+    session_drain();
+}
+
+int RunState::add_cancel_hook( std::function<void()> f ) {
+    std::lock_guard lk( hooks_mtx_ );
+    hooks_.emplace_back( ++next_hook_, std::move( f ) );
+    return next_hook_;
+}
+
+void RunState::remove_cancel_hook( int id ) {
+    std::lock_guard lk( hooks_mtx_ );
+    std::erase_if( hooks_, [ id ]( auto &h ) { return h.first == id; } );
+}
+
+void RunState::request_cancel() {
+    cancel.store( true );
+    std::lock_guard lk( hooks_mtx_ );
+    for ( auto &[ id, f ] : hooks_ ) f();
+}
+
+// Keeps a cancel hook registered for the lifetime of a stage.
+struct ScopedCancelHook {
+    ScopedCancelHook( RunState &rs, std::function<void()> f ) : rs( rs ), id( rs.add_cancel_hook( std::move( f ) ) ) {}
+    ~ScopedCancelHook() { rs.remove_cancel_hook( id ); }
+    ScopedCancelHook( const ScopedCancelHook & ) = delete;
+    ScopedCancelHook &operator=( const ScopedCancelHook & ) = delete;
+
+    RunState &rs;
+    int id;
+};
+
+WorkerPool::WorkerPool( int threads ) {
+    reserve( threads );
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard lk( mtx_ );
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for ( auto &t : threads_ ) t.join();
+}
+
+void WorkerPool::reserve( int n ) {
+    std::lock_guard lk( mtx_ );
+    while ( ( int ) threads_.size() < n ) threads_.emplace_back( [ this ] { run(); } );
+}
+
+int WorkerPool::size() {
+    std::lock_guard lk( mtx_ );
+    return ( int ) threads_.size();
 }
-void LiveLog::fail( std::string s ) {
-    std::lock_guard lk( mtx );
-    failures.emplace_back( std::move( s ) );
-    if ( failures.size() > 200 ) failures.erase( failures.begin(), failures.begin() + 50 );
+
+bool WorkerPool::run_one( const void *batch ) {
+    std::function<void()> task;
+    {
+        std::lock_guard lk( mtx_ );
+        auto it = std::find_if( q_.begin(), q_.end(), [ batch ]( const Task &t ) { return t.batch == batch; } );
+        if ( it == q_.end() ) return false;
+        task = std::move( it->fn );
+        q_.erase( it );
+    }
+    task();
+    return true;
+}
+
+void WorkerPool::run() {
+    profiler().name_thread( "pool worker" );
+    for ( ;; ) {
+        std::function<void()> task;
+        {
+            std::unique_lock lk( mtx_ );
+            cv_.wait( lk, [ this ] { return stop_ || !q_.empty(); } );
+            if ( q_.empty() ) return;
+            task = std::move( q_.front().fn );
+            q_.pop_front();
+        }
+        task();
+    }
+}
+
+WorkerPool &shared_pool() {
+    static WorkerPool pool( std::max( 2, ( int ) std::thread::hardware_concurrency() ) );
+    return pool;
+}
+
+// The calling thread's track in the current generation, and the name it is shown under.
+struct ThreadTrace {
+    uint32_t tid = 0;
+    std::string name;
+    uint64_t gen = 0;
+    std::shared_ptr<void> track;
+};
+
+static ThreadTrace &thread_trace() {
+    static thread_local ThreadTrace t;
+    return t;
+}
+
+Profiler &profiler() {
+    static Profiler p;
+    return p;
+}
+
+void Profiler::start() {
+    on_.store( false );
+    {
+        std::lock_guard lk( mtx_ );
+        tracks_.clear();
+        epoch_ = clock::now();
+    }
+    gen_.fetch_add( 1, std::memory_order_release );
+    on_.store( true );
+}
+
+void Profiler::stop() {
+    on_.store( false );
+}
+
+void Profiler::name_thread( std::string name ) {
+    auto &t = thread_trace();
+    if ( t.track && t.gen == gen_.load( std::memory_order_acquire ) ) {
+        auto *tr = static_cast< Track * >( t.track.get() );
+        std::lock_guard lk( tr->mtx );
+        tr->name = name;
+    }
+    t.name = std::move( name );
+}
+
+void Profiler::record( Event e ) {
+    auto &t = thread_trace();
+    uint64_t gen = gen_.load( std::memory_order_acquire );
+    if ( !t.track || t.gen != gen ) {
+        if ( !t.tid ) t.tid = next_tid_.fetch_add( 1 ) + 1;
+        auto tr = std::make_shared<Track>();
+        tr->tid = t.tid;
+        tr->name = t.name.empty() ? "thread " + std::to_string( t.tid ) : t.name;
+        {
+            std::lock_guard lk( mtx_ );
+            tracks_.push_back( tr );
+        }
+        t.track = tr;
+        t.gen = gen;
+    }
+    auto *tr = static_cast< Track * >( t.track.get() );
+    // Only the exporter ever waits on this, after the run.
+    std::lock_guard lk( tr->mtx );
+    tr->events.push_back( std::move( e ) );
+}
+
+void Profiler::complete( const char *name, clock::time_point begin, clock::time_point end, Args args ) {
+    if ( !enabled() ) return;
+    record( Event{ name, Kind::Complete, 0, begin, end - begin, std::move( args ) } );
+}
+
+void Profiler::async( const char *name, uint64_t id, clock::time_point begin, clock::time_point end, Args args ) {
+    if ( !enabled() ) return;
+    record( Event{ name, Kind::Async, id, begin, end - begin, std::move( args ) } );
+}
+
+void Profiler::sample( const char *name, clock::duration d ) {
+    if ( !enabled() ) return;
+    record( Event{ name, Kind::Sample, 0, {}, d, {} } );
+}
+
+bool Profiler::write_chrome_trace( const fs::path &p ) const {
+    auto us = []( clock::duration d ) { return ( double ) std::chrono::duration_cast< std::chrono::nanoseconds >( d ).count() / 1000.0; };
+    json events = json::array();
+    std::lock_guard lk( mtx_ );
+    for ( auto &tr : tracks_ ) {
+        std::lock_guard tl( tr->mtx );
+        events.push_back( { { "ph", "M" }, { "name", "thread_name" }, { "pid", 1 }, { "tid", tr->tid },
+            { "args", { { "name", tr->name } } } } );
+        for ( auto &e : tr->events ) {
+            if ( e.kind == Kind::Sample ) continue;
+            json args = json::object();
+            if ( !e.args.detail.empty() ) args[ "detail" ] = e.args.detail;
+            for ( auto &[ k, v ] : e.args.values ) args[ k ] = v;
+            json ev = { { "name", e.name }, { "pid", 1 }, { "tid", tr->tid }, { "ts", us( e.begin - epoch_ ) } };
+            if ( e.kind == Kind::Complete ) {
+                ev[ "ph" ] = "X";
+                ev[ "cat" ] = "run";
+                ev[ "dur" ] = us( e.dur );
+                ev[ "args" ] = std::move( args );
+                events.push_back( std::move( ev ) );
+                continue;
+            }
+            // Async spans are a begin/end pair; spans sharing an id nest on one row.
+            ev[ "ph" ] = "b";
+            ev[ "cat" ] = "async";
+            ev[ "id" ] = e.id;
+            ev[ "args" ] = std::move( args );
+            json end = ev;
+            end[ "ph" ] = "e";
+            end[ "ts" ] = us( e.begin + e.dur - epoch_ );
+            end.erase( "args" );
+            events.push_back( std::move( ev ) );
+            events.push_back( std::move( end ) );
+        }
+    }
+
+    std::ofstream f( p, std::ios::binary );
+    if ( !f ) return false;
+    f << json{ { "traceEvents", std::move( events ) }, { "displayTimeUnit", "ms" } }.dump();
+    return ( bool ) f;
+}
+
+std::vector<std::string> Profiler::summary() const {
+    // Buckets by powers of four from 1ms, which spans a cached 304 to a large map.
+    static constexpr long long kBounds[] = { 1000, 4000, 16000, 64000, 256000, 1024000, 4096000 };
+    constexpr size_t kBuckets = std::size( kBounds ) + 1;
+
+    std::unordered_map<std::string_view, std::vector<long long>> by_name;
+    {
+        std::lock_guard lk( mtx_ );
+        for ( auto &tr : tracks_ ) {
+            std::lock_guard tl( tr->mtx );
+            for ( auto &e : tr->events )
+                by_name[ e.name ].push_back( std::chrono::duration_cast< std::chrono::microseconds >( e.dur ).count() );
+        }
+    }
+
+    struct Row {
+        std::string_view name;
+        std::vector<long long> us;
+        long long total = 0;
+    };
+    std::vector<Row> rows;
+    for ( auto &[ name, us ] : by_name ) {
+        Row r{ name, std::move( us ) };
+        std::sort( r.us.begin(), r.us.end() );
+        for ( long long v : r.us ) r.total += v;
+        rows.push_back( std::move( r ) );
+    }
+    std::sort( rows.begin(), rows.end(), []( const Row &a, const Row &b ) { return a.total > b.total; } );
+
+    std::vector<std::string> out;
+    if ( rows.empty() ) return out;
+    out.push_back( "[i] Profile (histogram buckets: <1ms <4 <16 <64 <256 <1s <4s >=4s):" );
+    for ( auto &r : rows ) {
+        size_t n = r.us.size();
+        auto at = [ & ]( double q ) { return ( double ) r.us[ std::min( n - 1, ( size_t ) ( q * ( double ) n ) ) ] / 1000.0; };
+        std::array<size_t, kBuckets> hist{};
+        for ( long long v : r.us ) hist[ std::upper_bound( std::begin( kBounds ), std::end( kBounds ), v ) - std::begin( kBounds ) ]++;
+        std::string h;
+        for ( size_t i = 0; i < kBuckets; ++i ) h += ( i ? " " : "" ) + std::to_string( hist[ i ] );
+        char buf[ 256 ];
+        std::snprintf( buf, sizeof( buf ), "[i]   %-18.*s n=%-6zu total %9.1fms  p50 %8.1fms  p90 %8.1fms  max %8.1fms  [%s]",
+            ( int ) r.name.size(), r.name.data(), n, ( double ) r.total / 1000.0, at( 0.5 ), at( 0.9 ), ( double ) r.us.back() / 1000.0,
+            h.c_str() );
+        out.emplace_back( buf );
+    }
+    return out;
 }
 
 static std::string trim( std::string s ) {
@@ -43,7 +473,7 @@ static std::string lower_copy( std::string s ) {
     return s;
 }
 
-static std::vector<std::string> split_csv_terms( std::string s ) {
+static std::vector<std::string> split_csv_terms( std::string s, bool lower = true ) {
     std::vector<std::string> out;
     s = trim( std::move( s ) );
     if ( s.empty() ) return out;
@@ -52,7 +482,7 @@ static std::vector<std::string> split_csv_terms( std::string s ) {
     for ( char ch : s ) {
         if ( ch == ',' ) {
             cur = trim( cur );
-            if ( !cur.empty() ) out.push_back( lower_copy( cur ) );
+            if ( !cur.empty() ) out.push_back( lower ? lower_copy( cur ) : cur );
             cur.clear();
         }
         else {
@@ -60,33 +490,189 @@ static std::vector<std::string> split_csv_terms( std::string s ) {
         }
     }
     cur = trim( cur );
-    if ( !cur.empty() ) out.push_back( lower_copy( cur ) );
+    if ( !cur.empty() ) out.push_back( lower ? lower_copy( cur ) : cur );
     return out;
 }
 
-static bool passes_filters( const std::string &filename,
-    const std::vector<std::string> &includes,
-    const std::vector<std::string> &excludes ) {
-    auto name = lower_copy( filename );
+static inline unsigned char fold( char c ) {
+    unsigned char u = ( unsigned char ) c;
+    return u >= 'A' && u <= 'Z' ? ( unsigned char ) ( u + 32 ) : u;
+}
+
+// Case-insensitive glob over the whole name: '*' any run, '?' any one character.
+static bool glob_match( std::string_view pat, std::string_view name ) {
+    size_t p = 0, n = 0, star = std::string_view::npos, mark = 0;
+    while ( n < name.size() ) {
+        if ( p < pat.size() && ( pat[ p ] == '?' || fold( pat[ p ] ) == fold( name[ n ] ) ) ) { ++p; ++n; }
+        else if ( p < pat.size() && pat[ p ] == '*' ) { star = p++; mark = n; }
+        else if ( star != std::string_view::npos ) { p = star + 1; n = ++mark; }
+        else return false;
+    }
+    while ( p < pat.size() && pat[ p ] == '*' ) ++p;
+    return p == pat.size();
+}
+
+// Any-of substring matcher: an Aho-Corasick automaton flattened into a full transition
+// table over the byte classes that occur in the patterns (everything else shares class 0).
+class SubstringMatcher {
+public:
+    void add( const std::string &lowered ) { patterns_.push_back( lowered ); }
+    bool empty() const { return patterns_.empty(); }
+
+    void build() {
+        classes_.fill( 0 );
+        int k = 1;
+        for ( auto &p : patterns_ )
+            for ( unsigned char c : p )
+                if ( !classes_[ c ] ) classes_[ c ] = ( uint8_t ) k++;
+        // Upper-case input folds onto the same class as its lower-case pattern character.
+        for ( int c = 'A'; c <= 'Z'; ++c ) classes_[ c ] = classes_[ c + 32 ];
+        k_ = k;
+
+        std::vector<std::vector<int>> go( 1, std::vector<int>( k_, -1 ) );
+        std::vector<uint8_t> out( 1, 0 );
+        for ( auto &p : patterns_ ) {
+            int s = 0;
+            for ( unsigned char c : p ) {
+                int cls = classes_[ c ];
+                if ( go[ s ][ cls ] < 0 ) {
+                    go[ s ][ cls ] = ( int ) go.size();
+                    go.emplace_back( k_, -1 );
+                    out.push_back( 0 );
+                }
+                s = go[ s ][ cls ];
+            }
+            out[ s ] = 1;
+        }
+
+        std::vector<int> fail( go.size(), 0 );
+        std::deque<int> bfs;
+        for ( int c = 0; c < k_; ++c ) {
+            if ( go[ 0 ][ c ] < 0 ) go[ 0 ][ c ] = 0;
+            else bfs.push_back( go[ 0 ][ c ] );
+        }
+        while ( !bfs.empty() ) {
+            int s = bfs.front();
+            bfs.pop_front();
+            out[ s ] |= out[ fail[ s ] ];
+            for ( int c = 0; c < k_; ++c ) {
+                int t = go[ s ][ c ];
+                if ( t < 0 ) go[ s ][ c ] = go[ fail[ s ] ][ c ];
+                else {
+                    fail[ t ] = go[ fail[ s ] ][ c ];
+                    bfs.push_back( t );
+                }
+            }
+        }
+
+        delta_.resize( go.size() * ( size_t ) k_ );
+        for ( size_t s = 0; s < go.size(); ++s )
+            for ( int c = 0; c < k_; ++c ) delta_[ s * k_ + c ] = go[ s ][ c ];
+        accept_ = std::move( out );
+    }
 
-    if ( !includes.empty() ) {
-        bool any = false;
-        for ( auto &t : includes ) {
-            if ( t.empty() ) continue;
-            if ( name.find( t ) != std::string::npos ) { any = true; break; }
+    bool any_in( std::string_view name ) const {
+        if ( patterns_.empty() ) return false;
+        int s = 0;
+        for ( char ch : name ) {
+            s = delta_[ ( size_t ) s * k_ + classes_[ ( unsigned char ) ch ] ];
+            if ( accept_[ s ] ) return true;
         }
-        if ( !any ) return false;
+        return false;
+    }
+
+private:
+    std::vector<std::string> patterns_;
+    std::array<uint8_t, 256> classes_{};
+    int k_ = 1;
+    std::vector<int> delta_;
+    std::vector<uint8_t> accept_;
+};
+
+// Include/exclude lists compiled once per run. Each comma-separated term is one of:
+//   plain text   substring anywhere in the name (the original behaviour)
+//   dm_*, *.bsp  anchored prefix / suffix; other uses of * and ? are whole-name globs
+//   re:<regex>   ECMAScript regex searched in the name
+// A leading '!' makes a term an exclusion wherever it appears, so "dm_*, !*_test.bsp" can
+// be written in the include box alone. Matching is case-insensitive and does not allocate.
+class FilterSet {
+public:
+    FilterSet( const std::string &includes, const std::string &excludes ) {
+        for ( auto &t : split_csv_terms( includes, false ) ) add( t, false );
+        for ( auto &t : split_csv_terms( excludes, false ) ) add( t, true );
+        include_.subs.build();
+        exclude_.subs.build();
+    }
+
+    bool pass( std::string_view name ) const {
+        if ( include_.any() && !include_.matches( name ) ) return false;
+        return !exclude_.matches( name );
     }
 
-    if ( !excludes.empty() ) {
-        for ( auto &t : excludes ) {
-            if ( t.empty() ) continue;
-            if ( name.find( t ) != std::string::npos ) return false;
+private:
+    struct Group {
+        SubstringMatcher subs;
+        std::vector<std::string> prefixes, suffixes, globs;
+        std::vector<std::regex> regexes;
+        size_t count = 0;
+
+        bool any() const { return count > 0; }
+
+        bool matches( std::string_view name ) const {
+            if ( subs.any_in( name ) ) return true;
+            auto ieq = []( std::string_view a, std::string_view b ) {
+                for ( size_t i = 0; i < a.size(); ++i ) if ( fold( a[ i ] ) != ( unsigned char ) b[ i ] ) return false;
+                return true;
+                };
+            for ( auto &p : prefixes ) if ( name.size() >= p.size() && ieq( name.substr( 0, p.size() ), p ) ) return true;
+            for ( auto &p : suffixes ) if ( name.size() >= p.size() && ieq( name.substr( name.size() - p.size() ), p ) ) return true;
+            for ( auto &g : globs ) if ( glob_match( g, name ) ) return true;
+            for ( auto &r : regexes ) if ( std::regex_search( name.begin(), name.end(), r ) ) return true;
+            return false;
+        }
+    };
+
+    // Terms keep their case here so regex escapes such as \D survive; the rest is lowered.
+    void add( std::string t, bool exclude ) {
+        if ( !t.empty() && t[ 0 ] == '!' ) {
+            exclude = true;
+            t = trim( t.substr( 1 ) );
+        }
+        if ( t.empty() ) return;
+        Group &g = exclude ? exclude_ : include_;
+        ++g.count;
+
+        if ( t.starts_with( "re:" ) ) {
+            try {
+                g.regexes.emplace_back( t.substr( 3 ), std::regex::icase | std::regex::optimize );
+            }
+            catch ( const std::regex_error & ) {
+                // An unusable regex falls back to matching its text literally (and, like every
+                // other literal, case-insensitively: the matcher expects lower-case patterns).
+                g.subs.add( lower_copy( t.substr( 3 ) ) );
+            }
+            return;
+        }
+
+        t = lower_copy( std::move( t ) );
+        auto wild = t.find_first_of( "*?" );
+        if ( wild == std::string::npos ) { g.subs.add( t ); return; }
+
+        std::string_view body( t );
+        bool lead = body.front() == '*', trail = body.back() == '*';
+        std::string_view core = body.substr( lead, body.size() - lead - ( trail && body.size() > 1 ) );
+        if ( core.find_first_of( "*?" ) == std::string_view::npos ) {
+            if ( core.empty() ) { g.globs.push_back( "*" ); return; }
+            if ( lead && trail ) g.subs.add( std::string( core ) );
+            else if ( trail ) g.prefixes.emplace_back( core );
+            else g.suffixes.emplace_back( core );
+            return;
         }
+        g.globs.push_back( t );
     }
 
-    return true;
-}
+    Group include_, exclude_;
+};
 
 fs::path app_dir() {
 #ifdef _WIN32
@@ -108,11 +694,8 @@ static void ensure_logs_dir( LiveLog &log ) {
     if ( ec ) log.push( std::string( "[!] Failed to create logs dir: " ) + ec.message() );
 }
 
-static void write_session_log( const LiveLog &log ) {
-    std::error_code ec;
-    fs::create_directories( logs_dir(), ec );
-    if ( ec ) return;
-
+// logs/<prefix>_<timestamp><ext>.
+static fs::path timestamped_log_path( const char *prefix, const char *ext ) {
     auto now = std::chrono::system_clock::now();
     auto t = std::chrono::system_clock::to_time_t( now );
     std::tm tm{};
@@ -122,18 +705,15 @@ static void write_session_log( const LiveLog &log ) {
     localtime_r( &t, &tm );
 #endif
     char buf[ 64 ];
-    std::snprintf( buf, sizeof( buf ), "session_%04d%02d%02d_%02d%02d%02d.log",
+    std::snprintf( buf, sizeof( buf ), "%s_%04d%02d%02d_%02d%02d%02d%s", prefix,
         tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-        tm.tm_hour, tm.tm_min, tm.tm_sec );
-
-    std::ofstream f( logs_dir() / buf, std::ios::binary );
-    if ( !f ) return;
+        tm.tm_hour, tm.tm_min, tm.tm_sec, ext );
+    return logs_dir() / buf;
+}
 
-    for ( auto &s : log.lines ) f << s << "\n";
-    if ( !log.failures.empty() ) {
-        f << "\n--- FAILURES ---\n";
-        for ( auto &s : log.failures ) f << s << "\n";
-    }
+// logs/session_<timestamp>.log; LiveLog streams into it for the life of the process.
+static fs::path session_log_path() {
+    return timestamped_log_path( "session", ".log" );
 }
 
 std::string normalize_maps_url( std::string url ) {
@@ -149,6 +729,24 @@ std::string normalize_maps_url( std::string url ) {
     return url;
 }
 
+void SourceStats::add_ttfb( int ms ) {
+    ttfb_ewma_ms = ttfb_ewma_ms < 0 ? ms : 0.8 * ttfb_ewma_ms + 0.2 * ms;
+    ttfb_ms.push_back( ms );
+    if ( ttfb_ms.size() > kTtfbSamples ) ttfb_ms.erase( ttfb_ms.begin() );
+}
+
+void SourceStats::add_throughput( double bytes_per_sec ) {
+    bps_ewma = bps_ewma < 0 ? bytes_per_sec : 0.7 * bps_ewma + 0.3 * bytes_per_sec;
+}
+
+int SourceStats::ttfb_percentile( double q ) const {
+    if ( ttfb_ms.empty() ) return -1;
+    auto v = ttfb_ms;
+    auto k = ( size_t ) std::lround( std::clamp( q, 0.0, 1.0 ) * ( double ) ( v.size() - 1 ) );
+    std::nth_element( v.begin(), v.begin() + ( std::ptrdiff_t ) k, v.end() );
+    return v[ k ];
+}
+
 std::vector<SourceEntry> load_sources( LiveLog &log ) {
     std::vector<SourceEntry> out;
     auto p = sources_path();
@@ -170,6 +768,14 @@ std::vector<SourceEntry> load_sources( LiveLog &log ) {
             s.enabled = it.value( "enabled", true );
             s.last_latency_ms = it.value( "last_latency_ms", -1 );
             s.last_ok = it.value( "last_ok", false );
+            s.peer = it.value( "peer", false );
+            if ( auto st = it.find( "stats" ); st != it.end() && st->is_object() ) {
+                s.stats.ttfb_ewma_ms = st->value( "ttfb_ewma_ms", -1.0 );
+                s.stats.bps_ewma = st->value( "bps_ewma", -1.0 );
+                s.stats.ttfb_ms = st->value( "ttfb_ms", std::vector<int>{} );
+                if ( s.stats.ttfb_ms.size() > SourceStats::kTtfbSamples )
+                    s.stats.ttfb_ms.erase( s.stats.ttfb_ms.begin(), s.stats.ttfb_ms.end() - SourceStats::kTtfbSamples );
+            }
             s.url = normalize_maps_url( s.url );
             if ( !s.url.empty() ) out.push_back( std::move( s ) );
         }
@@ -189,6 +795,9 @@ void save_sources( const std::vector<SourceEntry> &src, LiveLog &log ) {
         it[ "enabled" ] = s.enabled;
         it[ "last_latency_ms" ] = s.last_latency_ms;
         it[ "last_ok" ] = s.last_ok;
+        if ( s.peer ) it[ "peer" ] = true;
+        if ( s.stats.ttfb_ewma_ms >= 0 || s.stats.bps_ewma >= 0 )
+            it[ "stats" ] = { { "ttfb_ewma_ms", s.stats.ttfb_ewma_ms }, { "bps_ewma", s.stats.bps_ewma }, { "ttfb_ms", s.stats.ttfb_ms } };
         j[ "sources" ].push_back( it );
     }
     try {
@@ -200,6 +809,78 @@ void save_sources( const std::vector<SourceEntry> &src, LiveLog &log ) {
     }
 }
 
+static const char *write_mode_name( WriteMode m ) {
+    switch ( m ) {
+    case WriteMode::Stdio: return "stdio";
+    case WriteMode::Direct: return "direct";
+    case WriteMode::Mmap: return "mmap";
+    default: return "buffered";
+    }
+}
+
+static WriteMode parse_write_mode( const std::string &s ) {
+    if ( s == "stdio" ) return WriteMode::Stdio;
+    if ( s == "direct" ) return WriteMode::Direct;
+    if ( s == "mmap" ) return WriteMode::Mmap;
+    return WriteMode::Buffered;
+}
+
+static const char *fsync_policy_name( FsyncPolicy p ) {
+    switch ( p ) {
+    case FsyncPolicy::File: return "file";
+    case FsyncPolicy::FileAndDir: return "file+dir";
+    default: return "never";
+    }
+}
+
+static FsyncPolicy parse_fsync_policy( const std::string &s ) {
+    if ( s == "file" ) return FsyncPolicy::File;
+    if ( s == "file+dir" ) return FsyncPolicy::FileAndDir;
+    return FsyncPolicy::Never;
+}
+
+static const char *fetch_order_name( FetchOrder o ) {
+    switch ( o ) {
+    case FetchOrder::LargestFirst: return "largest";
+    case FetchOrder::SmallestFirst: return "smallest";
+    default: return "name";
+    }
+}
+
+static FetchOrder parse_fetch_order( const std::string &s ) {
+    if ( s == "largest" ) return FetchOrder::LargestFirst;
+    if ( s == "smallest" ) return FetchOrder::SmallestFirst;
+    return FetchOrder::Name;
+}
+
+static const char *prune_mode_name( PruneMode m ) {
+    switch ( m ) {
+    case PruneMode::Delete: return "delete";
+    case PruneMode::Archive: return "archive";
+    default: return "off";
+    }
+}
+
+static PruneMode parse_prune_mode( const std::string &s ) {
+    if ( s == "delete" ) return PruneMode::Delete;
+    if ( s == "archive" ) return PruneMode::Archive;
+    return PruneMode::Off;
+}
+
+OutputOptions output_options( const Settings &s ) {
+    OutputOptions o;
+    o.mode = s.write_mode;
+    o.buffer_bytes = ( size_t ) std::clamp( s.write_buffer_kb, 4, 64 * 1024 ) * 1024;
+    o.fsync = s.fsync_policy;
+    return o;
+}
+
+static std::int64_t mtime_of( const fs::path &p ) {
+    std::error_code ec;
+    auto t = fs::last_write_time( p, ec );
+    return ec ? 0 : ( std::int64_t ) t.time_since_epoch().count();
+}
+
 static int default_threads() {
     auto hc = std::thread::hardware_concurrency();
     if ( hc == 0 ) return 4;
@@ -217,12 +898,33 @@ Settings load_settings( LiveLog &log ) {
         f >> j;
         s.hl2mp_path = j.value( "hl2mp_path", "" );
         s.threads = j.value( "threads", s.threads );
+        s.decompress_threads = j.value( "decompress_threads", 0 );
         s.decompress = j.value( "decompress", false );
         s.delete_bz2 = j.value( "delete_bz2", false );
+        s.stream_decompress = j.value( "stream_decompress", false );
         s.index_timeout_ms = j.value( "index_timeout_ms", 8000 );
         s.head_timeout_ms = j.value( "head_timeout_ms", 5000 );
         s.dl_timeout_ms = j.value( "dl_timeout_ms", 30000 );
         s.retries = j.value( "retries", 3 );
+        s.per_source_connections = j.value( "per_source_connections", 4 );
+        s.crawl_depth = j.value( "crawl_depth", 0 );
+        s.crawl_max_requests = j.value( "crawl_max_requests", 64 );
+        s.rate_limit_kbps = j.value( "rate_limit_kbps", 0 );
+        s.source_rate_limit_kbps = j.value( "source_rate_limit_kbps", 0 );
+        s.rate_schedule = j.value( "rate_schedule", "" );
+        s.probe_sizes = j.value( "probe_sizes", false );
+        s.ui_refresh_hz = std::clamp( j.value( "ui_refresh_hz", 15 ), 1, 60 );
+        if ( auto st = j.find( "steam_discovery" ); st != j.end() && st->is_object() ) {
+            s.steam.hl2mp = fs::path( st->value( "hl2mp", "" ) );
+            for ( auto &v : st->value( "vdfs", json::array() ) )
+                s.steam.vdfs.emplace_back( fs::path( v.value( "path", "" ) ), v.value( "mtime", ( std::int64_t ) 0 ) );
+        }
+        s.fetch_order = parse_fetch_order( j.value( "fetch_order", "name" ) );
+        s.refetch_changed = j.value( "refetch_changed", true );
+        s.prune = parse_prune_mode( j.value( "prune", "off" ) );
+        s.write_mode = parse_write_mode( j.value( "write_mode", "buffered" ) );
+        s.write_buffer_kb = j.value( "write_buffer_kb", 1024 );
+        s.fsync_policy = parse_fsync_policy( j.value( "fsync", "never" ) );
         s.include_filters = j.value( "include_filters", "" );
         s.exclude_filters = j.value( "exclude_filters", "" );
     }
@@ -236,12 +938,33 @@ void save_settings( const Settings &s, LiveLog &log ) {
     json j;
     j[ "hl2mp_path" ] = s.hl2mp_path.string();
     j[ "threads" ] = s.threads;
+    j[ "decompress_threads" ] = s.decompress_threads;
     j[ "decompress" ] = s.decompress;
     j[ "delete_bz2" ] = s.delete_bz2;
+    j[ "stream_decompress" ] = s.stream_decompress;
     j[ "index_timeout_ms" ] = s.index_timeout_ms;
     j[ "head_timeout_ms" ] = s.head_timeout_ms;
     j[ "dl_timeout_ms" ] = s.dl_timeout_ms;
     j[ "retries" ] = s.retries;
+    j[ "per_source_connections" ] = s.per_source_connections;
+    j[ "crawl_depth" ] = s.crawl_depth;
+    j[ "crawl_max_requests" ] = s.crawl_max_requests;
+    j[ "rate_limit_kbps" ] = s.rate_limit_kbps;
+    j[ "source_rate_limit_kbps" ] = s.source_rate_limit_kbps;
+    j[ "rate_schedule" ] = s.rate_schedule;
+    j[ "probe_sizes" ] = s.probe_sizes;
+    j[ "ui_refresh_hz" ] = s.ui_refresh_hz;
+    if ( !s.steam.vdfs.empty() ) {
+        json vdfs = json::array();
+        for ( auto &[ path, mtime ] : s.steam.vdfs ) vdfs.push_back( { { "path", path.string() }, { "mtime", mtime } } );
+        j[ "steam_discovery" ] = { { "hl2mp", s.steam.hl2mp.string() }, { "vdfs", vdfs } };
+    }
+    j[ "fetch_order" ] = fetch_order_name( s.fetch_order );
+    j[ "refetch_changed" ] = s.refetch_changed;
+    j[ "prune" ] = prune_mode_name( s.prune );
+    j[ "write_mode" ] = write_mode_name( s.write_mode );
+    j[ "write_buffer_kb" ] = s.write_buffer_kb;
+    j[ "fsync" ] = fsync_policy_name( s.fsync_policy );
     j[ "include_filters" ] = s.include_filters;
     j[ "exclude_filters" ] = s.exclude_filters;
 
@@ -254,18 +977,74 @@ void save_settings( const Settings &s, LiveLog &log ) {
     }
 }
 
-static std::vector<fs::path> parse_libraryfolders_vdf( const fs::path &steamapps ) {
+// The "path" values of a libraryfolders.vdf. VDF is quoted (or bare) tokens, braces and //
+// comments: a key followed by a string is a pair, a key followed by { opens a block, and a
+// [$PLATFORM] conditional may trail either. Escapes are undone, so "C:\\Steam" is C:\Steam.
+static std::vector<std::string> vdf_library_paths( std::string_view txt ) {
+    std::vector<std::string> out;
+    std::string key, tok;
+    bool have_key = false;
+    size_t i = 0, n = txt.size();
+    while ( i < n ) {
+        char c = txt[ i ];
+        if ( std::isspace( ( unsigned char ) c ) ) { ++i; continue; }
+        if ( c == '/' && i + 1 < n && txt[ i + 1 ] == '/' ) {
+            i = txt.find( '\n', i );
+            if ( i == std::string_view::npos ) break;
+            continue;
+        }
+        if ( c == '[' ) {
+            i = txt.find( ']', i );
+            if ( i == std::string_view::npos ) break;
+            ++i;
+            continue;
+        }
+        if ( c == '{' || c == '}' ) {
+            have_key = false;
+            ++i;
+            continue;
+        }
+
+        tok.clear();
+        if ( c == '"' ) {
+            for ( ++i; i < n && txt[ i ] != '"'; ++i ) {
+                if ( txt[ i ] == '\\' && i + 1 < n ) {
+                    char e = txt[ ++i ];
+                    tok += e == 'n' ? '\n' : e == 't' ? '\t' : e;
+                }
+                else tok += txt[ i ];
+            }
+            ++i;
+        }
+        else {
+            while ( i < n && !std::isspace( ( unsigned char ) txt[ i ] ) && txt[ i ] != '"' && txt[ i ] != '{' && txt[ i ] != '}' )
+                tok += txt[ i++ ];
+        }
+
+        if ( !have_key ) {
+            key.swap( tok );
+            have_key = true;
+            continue;
+        }
+        if ( lower_copy( key ) == "path" ) out.push_back( tok );
+        have_key = false;
+    }
+    return out;
+}
+
+// Libraries listed in steamapps/libraryfolders.vdf, as their steamapps folders; mtime gets the
+// file's modification time (0 when it is missing) so the result can be cached.
+static std::vector<fs::path> parse_libraryfolders_vdf( const fs::path &steamapps, std::int64_t &mtime ) {
     std::vector<fs::path> out;
     auto vdf = steamapps / "libraryfolders.vdf";
-    if ( !fs::exists( vdf ) ) return out;
+    mtime = mtime_of( vdf );
+    if ( mtime == 0 ) return out;
 
     std::ifstream f( vdf, std::ios::binary );
     if ( !f ) return out;
     std::string txt( ( std::istreambuf_iterator<char>( f ) ), std::istreambuf_iterator<char>() );
 
-    std::regex re( R"VDF("path"\s*"([^"]+)")VDF", std::regex::icase );
-    for ( std::sregex_iterator it( txt.begin(), txt.end(), re ), end; it != end; ++it ) {
-        auto p = ( *it )[ 1 ].str();
+    for ( auto &p : vdf_library_paths( txt ) ) {
 #ifdef _WIN32
         std::replace( p.begin(), p.end(), '\\', '/' );
 #endif
@@ -274,7 +1053,10 @@ static std::vector<fs::path> parse_libraryfolders_vdf( const fs::path &steamapps
     return out;
 }
 
-std::optional<fs::path> find_hl2mp_dir() {
+// Searches the Steam roots and every library they list. Each probe can wake a sleeping drive
+// or stall on a network mount, so start-up goes through resolve_hl2mp_dir() instead; found,
+// when given, records which .vdf files the answer came from.
+std::optional<fs::path> find_hl2mp_dir( SteamDiscovery *found = nullptr ) {
     std::vector<fs::path> candidates;
 
 #ifdef _WIN32
@@ -289,252 +1071,4593 @@ std::optional<fs::path> find_hl2mp_dir() {
 #endif
 
     std::vector<fs::path> steamapps_all;
+    SteamDiscovery d;
     for ( auto &root : candidates ) {
         steamapps_all.push_back( root );
-        auto libs = parse_libraryfolders_vdf( root );
+        std::int64_t mtime = 0;
+        auto libs = parse_libraryfolders_vdf( root, mtime );
+        d.vdfs.emplace_back( root / "libraryfolders.vdf", mtime );
         steamapps_all.insert( steamapps_all.end(), libs.begin(), libs.end() );
     }
 
+    std::optional<fs::path> out;
     for ( auto &steamapps : steamapps_all ) {
         auto hl2mp = steamapps / "common" / "Half-Life 2 Deathmatch" / "hl2mp";
-        if ( fs::exists( hl2mp / "maps" ) || fs::exists( hl2mp / "download" ) ) {
-            return fs::weakly_canonical( hl2mp );
+        std::error_code ec;
+        if ( fs::exists( hl2mp / "maps", ec ) || fs::exists( hl2mp / "download", ec ) ) {
+            out = fs::weakly_canonical( hl2mp, ec );
+            if ( ec ) out = hl2mp;
+            break;
         }
     }
-    return std::nullopt;
+    if ( found ) {
+        d.hl2mp = out ? *out : fs::path();
+        *found = std::move( d );
+    }
+    return out;
 }
 
-static size_t curl_write_cb( void *contents, size_t size, size_t nmemb, void *userp ) {
-    auto *s = ( std::string * ) userp;
-    s->append( ( char * ) contents, size * nmemb );
-    return size * nmemb;
+struct Hl2mpLookup {
+    std::optional<fs::path> path;
+    SteamDiscovery steam;
+    bool cached = false;
+};
+
+// The game folder for a start-up: the configured one if it is still there, else the cached
+// discovery while the .vdf files it came from are unchanged, else a full search (which
+// refreshes steam). Only the search walks the libraries.
+static Hl2mpLookup resolve_hl2mp_dir( const fs::path &configured, const SteamDiscovery &steam ) {
+    Hl2mpLookup r;
+    r.steam = steam;
+    std::error_code ec;
+    if ( !configured.empty() && fs::exists( configured, ec ) ) {
+        r.path = configured;
+        return r;
+    }
+    bool unchanged = !steam.vdfs.empty() && std::all_of( steam.vdfs.begin(), steam.vdfs.end(),
+        []( const auto &v ) { return mtime_of( v.first ) == v.second; } );
+    if ( unchanged && !steam.hl2mp.empty() && fs::exists( steam.hl2mp, ec ) ) {
+        r.path = steam.hl2mp;
+        r.cached = true;
+        return r;
+    }
+    r.path = find_hl2mp_dir( &r.steam );
+    return r;
+}
+
+static size_t curl_write_cb( void *contents, size_t size, size_t nmemb, void *userp );
+
+static void curl_share_lock( CURL *, curl_lock_data data, curl_lock_access, void *userp ) {
+    ( ( std::mutex * ) userp )[ data ].lock();
+}
+static void curl_share_unlock( CURL *, curl_lock_data data, void *userp ) {
+    ( ( std::mutex * ) userp )[ data ].unlock();
+}
+
+// One share handle for the whole process so DNS and TLS sessions survive across engines
+// (and therefore across Index/Start runs). Connections are not shared: engines run their
+// loops on different threads at once, and libcurl's connection pool is not meant to be
+// used from several multi handles like that. Each engine keeps its own in its multi handle.
+static CURLSH *curl_share() {
+    static std::mutex locks[ CURL_LOCK_DATA_LAST ];
+    static CURLSH *sh = [] {
+        CURLSH *h = curl_share_init();
+        curl_share_setopt( h, CURLSHOPT_LOCKFUNC, curl_share_lock );
+        curl_share_setopt( h, CURLSHOPT_UNLOCKFUNC, curl_share_unlock );
+        curl_share_setopt( h, CURLSHOPT_USERDATA, locks );
+        curl_share_setopt( h, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS );
+        curl_share_setopt( h, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION );
+        return h;
+    }( );
+    return sh;
 }
 
-static CURL *curl_easy() {
-    CURL *c = curl_easy_init();
+static void curl_defaults( CURL *c ) {
     curl_easy_setopt( c, CURLOPT_FOLLOWLOCATION, 1L );
     curl_easy_setopt( c, CURLOPT_NOSIGNAL, 1L );
     curl_easy_setopt( c, CURLOPT_USERAGENT, "hl2mp-maps-downloader/0.1" );
-    return c;
+    curl_easy_setopt( c, CURLOPT_SHARE, curl_share() );
 }
 
-HttpResult http_get_text( const std::string &url, int timeout_ms ) {
-    HttpResult r;
-    CURL *c = curl_easy();
-    std::string body;
-
-    curl_easy_setopt( c, CURLOPT_URL, url.c_str() );
-    curl_easy_setopt( c, CURLOPT_TIMEOUT_MS, ( long ) timeout_ms );
-    curl_easy_setopt( c, CURLOPT_WRITEFUNCTION, curl_write_cb );
-    curl_easy_setopt( c, CURLOPT_WRITEDATA, &body );
+struct TransferEngine::Job {
+    Transfer t;
+    CURL *easy = nullptr;
+    curl_slist *req_headers = nullptr;
+    HttpResult res;
+    bool headers_delivered = false;
+    std::chrono::steady_clock::time_point started;
+    std::atomic<bool> *cancel = nullptr;
+    // Body bytes already added to the transfer's rx counters.
+    long long rx_reported = 0;
+    // Buckets the body draws from while limits are set, and whether curl holds it paused.
+    TokenBucket *global_bucket = nullptr;
+    TokenBucket *group_bucket = nullptr;
+    bool paused = false;
+};
 
-    auto t0 = std::chrono::steady_clock::now();
-    auto code = curl_easy_perform( c );
-    auto t1 = std::chrono::steady_clock::now();
-    r.latency_ms = ( int ) std::chrono::duration_cast< std::chrono::milliseconds >( t1 - t0 ).count();
+static void report_rx( TransferEngine::Job *job, long long now ) {
+    long long delta = now - job->rx_reported;
+    if ( delta <= 0 ) return;
+    job->rx_reported = now;
+    if ( job->t.rx_bytes ) job->t.rx_bytes->fetch_add( delta, std::memory_order_relaxed );
+    if ( job->t.rx_source_bytes ) job->t.rx_source_bytes->fetch_add( delta, std::memory_order_relaxed );
+}
 
-    if ( code != CURLE_OK ) {
-        r.err = curl_easy_strerror( code );
+static size_t curl_write_cb( void *contents, size_t size, size_t nmemb, void *userp ) {
+    auto *job = ( TransferEngine::Job * ) userp;
+    size_t n = size * nmemb;
+    if ( !job->headers_delivered ) {
+        job->headers_delivered = true;
+        curl_easy_getinfo( job->easy, CURLINFO_RESPONSE_CODE, &job->res.status );
+        if ( job->t.on_headers && !job->t.on_headers( job->res ) ) return 0;
     }
-    else {
-        long status = 0;
-        curl_easy_getinfo( c, CURLINFO_RESPONSE_CODE, &status );
-        r.status = status;
-        r.body = std::move( body );
+    // Out of tokens: curl keeps this chunk and delivers it again once the loop resumes us.
+    if ( job->global_bucket && !( job->cancel && job->cancel->load() ) ) {
+        auto now = std::chrono::steady_clock::now();
+        job->global_bucket->refill( now );
+        if ( job->group_bucket ) job->group_bucket->refill( now );
+        if ( !job->global_bucket->has_tokens() || ( job->group_bucket && !job->group_bucket->has_tokens() ) ) {
+            job->paused = true;
+            return CURL_WRITEFUNC_PAUSE;
+        }
+        job->global_bucket->take( n );
+        if ( job->group_bucket ) job->group_bucket->take( n );
     }
-    curl_easy_cleanup( c );
-    return r;
+    if ( job->t.on_data ) return job->t.on_data( ( const char * ) contents, n ) ? n : 0;
+    if ( job->res.body.empty() ) {
+        // One allocation for the announced size (manifests can be large) instead of regrowth.
+        curl_off_t cl = -1;
+        if ( curl_easy_getinfo( job->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &cl ) == CURLE_OK && cl > 0 )
+            job->res.body.reserve( ( size_t ) std::min<curl_off_t>( cl, 256LL << 20 ) );
+    }
+    job->res.body.append( ( const char * ) contents, n );
+    return n;
 }
 
-HttpResult http_head( const std::string &url, int timeout_ms ) {
-    HttpResult r;
-    CURL *c = curl_easy();
-    curl_easy_setopt( c, CURLOPT_URL, url.c_str() );
-    curl_easy_setopt( c, CURLOPT_TIMEOUT_MS, ( long ) timeout_ms );
-    curl_easy_setopt( c, CURLOPT_NOBODY, 1L );
-
-    auto t0 = std::chrono::steady_clock::now();
-    auto code = curl_easy_perform( c );
-    auto t1 = std::chrono::steady_clock::now();
-    r.latency_ms = ( int ) std::chrono::duration_cast< std::chrono::milliseconds >( t1 - t0 ).count();
+// Matches "Name: value" case-insensitively and returns the trimmed value.
+static bool header_value( std::string_view line, std::string_view name, std::string &out ) {
+    if ( line.size() <= name.size() || line[ name.size() ] != ':' ) return false;
+    for ( size_t i = 0; i < name.size(); ++i )
+        if ( std::tolower( ( unsigned char ) line[ i ] ) != std::tolower( ( unsigned char ) name[ i ] ) ) return false;
+    auto v = line.substr( name.size() + 1 );
+    while ( !v.empty() && ( v.front() == ' ' || v.front() == '\t' ) ) v.remove_prefix( 1 );
+    while ( !v.empty() && ( v.back() == '\r' || v.back() == '\n' || v.back() == ' ' ) ) v.remove_suffix( 1 );
+    out.assign( v );
+    return true;
+}
 
-    if ( code != CURLE_OK ) {
-        r.err = curl_easy_strerror( code );
+static size_t curl_header_cb( char *buffer, size_t size, size_t nitems, void *userp ) {
+    auto *job = ( TransferEngine::Job * ) userp;
+    size_t n = size * nitems;
+    std::string_view line( buffer, n );
+    // A new status line means a redirect hop; only the final response's headers count.
+    if ( line.starts_with( "HTTP/" ) ) {
+        job->res.etag.clear();
+        job->res.last_modified.clear();
+        job->res.content_length = -1;
+        job->res.range_start = -1;
+        job->res.range_total = -1;
+        return n;
     }
-    else {
-        long status = 0;
-        curl_easy_getinfo( c, CURLINFO_RESPONSE_CODE, &status );
-        r.status = status;
+    std::string v;
+    if ( header_value( line, "ETag", job->res.etag ) ) return n;
+    if ( header_value( line, "Last-Modified", job->res.last_modified ) ) return n;
+    if ( header_value( line, "Content-Length", v ) ) {
+        job->res.content_length = std::strtoll( v.c_str(), nullptr, 10 );
     }
-    curl_easy_cleanup( c );
-    return r;
+    else if ( header_value( line, "Content-Range", v ) ) {
+        // "bytes 100-199/1234" (total may be "*").
+        long long a = -1, b = -1, total = -1;
+        if ( std::sscanf( v.c_str(), "bytes %lld-%lld/%lld", &a, &b, &total ) >= 2 ) {
+            job->res.range_start = a;
+            job->res.range_total = total;
+        }
+    }
+    return n;
 }
 
-static std::string url_join( const std::string &base, const std::string &rel ) {
-    if ( rel.find( "http://" ) == 0 || rel.find( "https://" ) == 0 ) return rel;
-    if ( base.empty() ) return rel;
-    if ( !base.empty() && base.back() == '/' && !rel.empty() && rel.front() == '/' ) return base + rel.substr( 1 );
-    if ( !base.empty() && base.back() != '/' && !rel.empty() && rel.front() != '/' ) return base + "/" + rel;
-    return base + rel;
+static int curl_xferinfo_cb( void *userp, curl_off_t, curl_off_t dlnow, curl_off_t, curl_off_t ) {
+    auto *job = ( TransferEngine::Job * ) userp;
+    report_rx( job, ( long long ) dlnow );
+    return ( job->cancel && job->cancel->load() ) ? 1 : 0;
 }
 
-std::vector<std::string> extract_map_links_from_index_html( const std::string &base_url, const std::string &html ) {
-    std::vector<std::string> out;
-    std::regex href_re( R"(href\s*=\s*["']([^"']+)["'])", std::regex::icase );
-    for ( std::sregex_iterator it( html.begin(), html.end(), href_re ), end; it != end; ++it ) {
-        auto href = ( *it )[ 1 ].str();
-        href = trim( href );
-        if ( href.empty() ) continue;
-        if ( href.back() == '/' ) continue;
-        auto low = lower_copy( href );
-        if ( !( low.ends_with( ".bsp" ) || low.ends_with( ".bz2" ) ) ) continue;
-        out.push_back( url_join( base_url, href ) );
+long long RateLimits::global_at( int minute_of_day ) const {
+    for ( auto &w : windows ) {
+        bool inside = w.from_min <= w.to_min ? minute_of_day >= w.from_min && minute_of_day < w.to_min
+            : minute_of_day >= w.from_min || minute_of_day < w.to_min;
+        if ( inside ) return w.bytes_per_sec;
+    }
+    return global;
+}
+
+void TokenBucket::set_rate( long long bytes_per_sec, std::chrono::steady_clock::time_point now ) {
+    if ( bytes_per_sec == rate_ ) return;
+    // Coming from no cap the bucket starts full; a changed cap keeps what is left of it.
+    tokens_ = rate_ <= 0 ? ( double ) bytes_per_sec / 4 : std::min( tokens_, ( double ) bytes_per_sec / 4 );
+    rate_ = bytes_per_sec;
+    last_ = now;
+}
+
+void TokenBucket::refill( std::chrono::steady_clock::time_point now ) {
+    if ( rate_ <= 0 ) return;
+    double dt = std::chrono::duration<double>( now - last_ ).count();
+    last_ = now;
+    if ( dt > 0 ) tokens_ = std::min( tokens_ + dt * ( double ) rate_, ( double ) rate_ / 4 );
+}
+
+int TokenBucket::wait_ms() const {
+    if ( has_tokens() ) return 0;
+    return ( int ) ( -tokens_ * 1000.0 / ( double ) rate_ ) + 1;
+}
+
+static int local_minute_of_day() {
+    auto t = std::chrono::system_clock::to_time_t( std::chrono::system_clock::now() );
+    std::tm tm{};
+#ifdef _WIN32
+    localtime_s( &tm, &t );
+#else
+    localtime_r( &t, &tm );
+#endif
+    return tm.tm_hour * 60 + tm.tm_min;
+}
+
+TransferEngine::TransferEngine( int max_in_flight, std::atomic<bool> *cancel )
+    : max_in_flight_( std::max( 1, max_in_flight ) ), cancel_( cancel ) {
+    multi_ = curl_multi_init();
+    curl_multi_setopt( multi_, CURLMOPT_MAXCONNECTS, ( long ) max_in_flight_ * 2 );
+    loop_ = std::thread( [ this ] { loop(); } );
+}
+
+TransferEngine::~TransferEngine() {
+    {
+        std::lock_guard lk( mtx_ );
+        stop_ = true;
+    }
+    curl_multi_wakeup( multi_ );
+    loop_.join();
+    for ( auto *c : idle_easies_ ) curl_easy_cleanup( c );
+    curl_multi_cleanup( multi_ );
+}
+
+void TransferEngine::submit( Transfer t ) {
+    auto job = std::make_unique<Job>();
+    job->t = std::move( t );
+    job->cancel = cancel_;
+    {
+        std::lock_guard lk( mtx_ );
+        pending_.push_back( std::move( job ) );
+    }
+    curl_multi_wakeup( multi_ );
+}
+
+void TransferEngine::set_rate_limits( RateLimits limits ) {
+    {
+        std::lock_guard lk( mtx_ );
+        limits_ = std::move( limits );
+        limits_changed_ = true;
+    }
+    curl_multi_wakeup( multi_ );
+}
+
+void TransferEngine::wake() {
+    curl_multi_wakeup( multi_ );
+}
+
+void TransferEngine::wait_idle() {
+    std::unique_lock lk( mtx_ );
+    idle_cv_.wait( lk, [ this ] { return pending_.empty() && active_.empty(); } );
+}
+
+void TransferEngine::finish( Job *job, HttpResult r ) {
+    if ( job->easy ) {
+        curl_multi_remove_handle( multi_, job->easy );
+        curl_easy_reset( job->easy );
+        idle_easies_.push_back( job->easy );
+        job->easy = nullptr;
+    }
+    if ( job->req_headers ) {
+        curl_slist_free_all( job->req_headers );
+        job->req_headers = nullptr;
+    }
+
+    // on_done may submit follow-up work (retries); it lands in pending_ before this job
+    // leaves active_, so wait_idle() never observes a false idle state.
+    if ( job->t.on_done ) job->t.on_done( std::move( r ) );
+
+    std::lock_guard lk( mtx_ );
+    active_.erase( job );
+    if ( pending_.empty() && active_.empty() ) idle_cv_.notify_all();
+}
+
+void TransferEngine::start( Job *job ) {
+    bool cancelled = cancel_ && cancel_->load();
+    if ( cancelled || ( job->t.on_start && !job->t.on_start( job->t ) ) ) {
+        HttpResult r;
+        r.err = cancelled ? "cancelled" : "start failed";
+        finish( job, std::move( r ) );
+        return;
+    }
+
+    CURL *c = nullptr;
+    if ( !idle_easies_.empty() ) {
+        c = idle_easies_.back();
+        idle_easies_.pop_back();
+    }
+    else {
+        c = curl_easy_init();
+    }
+    curl_defaults( c );
+    curl_easy_setopt( c, CURLOPT_URL, job->t.url.c_str() );
+    if ( limiting_ ) {
+        // A capped transfer is meant to take long; only give up on one that has stalled.
+        // Paused time does not count towards curl's low-speed check.
+        long secs = std::max( 1L, ( long ) job->t.timeout_ms / 1000 );
+        curl_easy_setopt( c, CURLOPT_CONNECTTIMEOUT_MS, ( long ) job->t.timeout_ms );
+        curl_easy_setopt( c, CURLOPT_LOW_SPEED_LIMIT, 1L );
+        curl_easy_setopt( c, CURLOPT_LOW_SPEED_TIME, secs );
+        job->global_bucket = &global_bucket_;
+        if ( applied_.per_group > 0 && !job->t.rate_group.empty() ) {
+            auto [ it, added ] = group_buckets_.try_emplace( job->t.rate_group );
+            if ( added ) it->second.set_rate( applied_.per_group, std::chrono::steady_clock::now() );
+            job->group_bucket = &it->second;
+        }
+    }
+    else {
+        curl_easy_setopt( c, CURLOPT_TIMEOUT_MS, ( long ) job->t.timeout_ms );
+    }
+    curl_easy_setopt( c, CURLOPT_WRITEFUNCTION, curl_write_cb );
+    curl_easy_setopt( c, CURLOPT_WRITEDATA, job );
+    curl_easy_setopt( c, CURLOPT_NOPROGRESS, 0L );
+    curl_easy_setopt( c, CURLOPT_XFERINFOFUNCTION, curl_xferinfo_cb );
+    curl_easy_setopt( c, CURLOPT_XFERINFODATA, job );
+    curl_easy_setopt( c, CURLOPT_HEADERFUNCTION, curl_header_cb );
+    curl_easy_setopt( c, CURLOPT_HEADERDATA, job );
+    curl_easy_setopt( c, CURLOPT_PRIVATE, job );
+    if ( job->t.head_only ) curl_easy_setopt( c, CURLOPT_NOBODY, 1L );
+    for ( auto &h : job->t.headers ) job->req_headers = curl_slist_append( job->req_headers, h.c_str() );
+    if ( job->req_headers ) curl_easy_setopt( c, CURLOPT_HTTPHEADER, job->req_headers );
+
+    job->easy = c;
+    job->started = std::chrono::steady_clock::now();
+    curl_multi_add_handle( multi_, c );
+}
+
+TransferEngine::Job *TransferEngine::next_ready( std::chrono::steady_clock::time_point now, int &wait_ms ) {
+    std::lock_guard lk( mtx_ );
+    if ( ( int ) active_.size() >= max_in_flight_ ) return nullptr;
+    bool cancelled = cancel_ && cancel_->load();
+    for ( auto it = pending_.begin(); it != pending_.end(); ++it ) {
+        auto due = ( *it )->t.not_before;
+        if ( !cancelled && due > now ) {
+            int ms = ( int ) std::chrono::duration_cast< std::chrono::milliseconds >( due - now ).count() + 1;
+            wait_ms = std::min( wait_ms, ms );
+            continue;
+        }
+        auto job = std::move( *it );
+        pending_.erase( it );
+        auto *raw = job.get();
+        active_.emplace( raw, std::move( job ) );
+        return raw;
+    }
+    return nullptr;
+}
+
+// Refills the buckets and resumes paused transfers that may go on, starting one further along
+// each pass so that every transfer gets its turn at a scarce bucket.
+void TransferEngine::throttle( std::chrono::steady_clock::time_point now, int &wait_ms ) {
+    {
+        std::lock_guard lk( mtx_ );
+        if ( limits_changed_ ) {
+            limits_changed_ = false;
+            applied_ = limits_;
+            limiting_ = applied_.any();
+            for ( auto &[ group, b ] : group_buckets_ ) b.set_rate( applied_.per_group, now );
+            schedule_checked_ = {};
+        }
+    }
+    if ( !limiting_ ) return;
+
+    // Windows are in whole minutes, so the clock is read once a second.
+    if ( now - schedule_checked_ >= std::chrono::seconds( 1 ) ) {
+        schedule_checked_ = now;
+        global_bucket_.set_rate( applied_.global_at( local_minute_of_day() ), now );
+    }
+    global_bucket_.refill( now );
+    for ( auto &[ group, b ] : group_buckets_ ) b.refill( now );
+
+    paused_.clear();
+    for ( auto &[ job, owned ] : active_ )
+        if ( job->paused ) paused_.push_back( job );
+    if ( paused_.empty() ) return;
+
+    bool cancelled = cancel_ && cancel_->load();
+    size_t first = resume_turn_++ % paused_.size();
+    for ( size_t k = 0; k < paused_.size(); ++k ) {
+        Job *job = paused_[ ( first + k ) % paused_.size() ];
+        auto *group = job->group_bucket;
+        if ( !cancelled && ( !global_bucket_.has_tokens() || ( group && !group->has_tokens() ) ) ) {
+            wait_ms = std::min( wait_ms, std::max( global_bucket_.wait_ms(), group ? group->wait_ms() : 0 ) );
+            continue;
+        }
+        // May deliver the held chunk right here, which can pause the transfer again.
+        job->paused = false;
+        curl_easy_pause( job->easy, CURLPAUSE_CONT );
+    }
+}
+
+// Records a finished transfer as an async span split into the phases curl timed: DNS, TCP
+// connect, TLS, waiting for the first byte and the body. Setup phases of a reused connection
+// are zero and left out. Transfers overlap on the engine thread, hence async spans.
+static void trace_transfer( TransferEngine::Job *job, const HttpResult &r ) {
+    curl_off_t dns = 0, conn = 0, tls = 0, pre = 0, first = 0, total = 0;
+    curl_easy_getinfo( job->easy, CURLINFO_NAMELOOKUP_TIME_T, &dns );
+    curl_easy_getinfo( job->easy, CURLINFO_CONNECT_TIME_T, &conn );
+    curl_easy_getinfo( job->easy, CURLINFO_APPCONNECT_TIME_T, &tls );
+    curl_easy_getinfo( job->easy, CURLINFO_PRETRANSFER_TIME_T, &pre );
+    curl_easy_getinfo( job->easy, CURLINFO_STARTTRANSFER_TIME_T, &first );
+    curl_easy_getinfo( job->easy, CURLINFO_TOTAL_TIME_T, &total );
+    auto at = [ job ]( curl_off_t us ) { return job->started + std::chrono::microseconds( us ); };
+
+    auto &p = profiler();
+    uint64_t id = p.next_id();
+    Profiler::Args a;
+    a.detail = job->t.url;
+    a.values = { { "status", r.status }, { "bytes", r.bytes }, { "dns_us", dns }, { "connect_us", conn }, { "tls_us", tls },
+        { "ttfb_us", first }, { "total_us", total } };
+    p.async( job->t.trace_name, id, job->started, at( total ), std::move( a ) );
+    if ( dns > 0 ) p.async( "dns", id, at( 0 ), at( dns ) );
+    if ( conn > dns ) p.async( "connect", id, at( dns ), at( conn ) );
+    if ( tls > conn ) p.async( "tls", id, at( conn ), at( tls ) );
+    if ( first > pre ) p.async( "wait", id, at( pre ), at( first ) );
+    if ( first > 0 && total > first ) p.async( "body", id, at( first ), at( total ) );
+}
+
+void TransferEngine::loop() {
+    profiler().name_thread( "curl engine" );
+    for ( ;; ) {
+        {
+            std::lock_guard lk( mtx_ );
+            if ( stop_ && active_.empty() && pending_.empty() ) break;
+        }
+
+        int wait_ms = 100;
+        auto now = std::chrono::steady_clock::now();
+        // Picks up new limits before anything starts, so no transfer begins uncapped; also
+        // resumes transfers paused on the last pass, or shortens the wait to their refill.
+        throttle( now, wait_ms );
+        while ( Job *j = next_ready( now, wait_ms ) ) start( j );
+
+        int running = 0;
+        curl_multi_perform( multi_, &running );
+
+        int left = 0;
+        bool finished_any = false;
+        while ( CURLMsg *m = curl_multi_info_read( multi_, &left ) ) {
+            if ( m->msg != CURLMSG_DONE ) continue;
+            finished_any = true;
+            Job *job = nullptr;
+            curl_easy_getinfo( m->easy_handle, CURLINFO_PRIVATE, ( char ** ) &job );
+            auto code = m->data.result;
+
+            HttpResult r = std::move( job->res );
+            r.latency_ms = ( int ) std::chrono::duration_cast< std::chrono::milliseconds >(
+                std::chrono::steady_clock::now() - job->started ).count();
+            curl_off_t dl_bytes = 0, dl_us = 0;
+            curl_easy_getinfo( job->easy, CURLINFO_SIZE_DOWNLOAD_T, &dl_bytes );
+            curl_easy_getinfo( job->easy, CURLINFO_TOTAL_TIME_T, &dl_us );
+            r.bytes = ( long long ) dl_bytes;
+            r.seconds = ( double ) dl_us / 1e6;
+            curl_off_t ttfb_us = 0;
+            if ( curl_easy_getinfo( job->easy, CURLINFO_STARTTRANSFER_TIME_T, &ttfb_us ) == CURLE_OK && ttfb_us > 0 )
+                r.ttfb_ms = ( int ) ( ttfb_us / 1000 );
+            report_rx( job, r.bytes );
+            if ( profiler().enabled() ) trace_transfer( job, r );
+            if ( code != CURLE_OK ) {
+                r.err = curl_easy_strerror( code );
+                r.body.clear();
+            }
+            else {
+                curl_easy_getinfo( job->easy, CURLINFO_RESPONSE_CODE, &r.status );
+                // Empty bodies never reach the write callback.
+                if ( !job->headers_delivered && job->t.on_headers ) {
+                    job->headers_delivered = true;
+                    job->t.on_headers( r );
+                }
+            }
+            finish( job, std::move( r ) );
+        }
+
+        // Freed slots are refilled on the next pass without waiting on the sockets.
+        if ( !finished_any ) curl_multi_poll( multi_, nullptr, 0, wait_ms, nullptr );
+    }
+}
+
+std::future<HttpResult> http_get_text( TransferEngine &eng, const std::string &url, int timeout_ms,
+    std::vector<std::string> headers = {} ) {
+    auto p = std::make_shared<std::promise<HttpResult>>();
+    auto f = p->get_future();
+    Transfer t;
+    t.url = url;
+    t.timeout_ms = timeout_ms;
+    t.headers = std::move( headers );
+    t.trace_name = "http_get";
+    t.on_done = [ p ]( HttpResult r ) { p->set_value( std::move( r ) ); };
+    eng.submit( std::move( t ) );
+    return f;
+}
+
+std::future<HttpResult> http_head( TransferEngine &eng, const std::string &url, int timeout_ms ) {
+    auto p = std::make_shared<std::promise<HttpResult>>();
+    auto f = p->get_future();
+    Transfer t;
+    t.url = url;
+    t.timeout_ms = timeout_ms;
+    t.head_only = true;
+    t.trace_name = "head";
+    t.on_done = [ p ]( HttpResult r ) { p->set_value( std::move( r ) ); };
+    eng.submit( std::move( t ) );
+    return f;
+}
+
+static std::string url_join( const std::string &base, std::string_view rel ) {
+    if ( rel.starts_with( "http://" ) || rel.starts_with( "https://" ) || base.empty() ) return std::string( rel );
+    std::string out;
+    out.reserve( base.size() + rel.size() + 1 );
+    out += base;
+    if ( base.back() == '/' && !rel.empty() && rel.front() == '/' ) rel.remove_prefix( 1 );
+    else if ( base.back() != '/' && !rel.empty() && rel.front() != '/' ) out += '/';
+    out += rel;
+    return out;
+}
+
+static uint64_t fnv1a( std::string_view s ) {
+    uint64_t h = 1469598103934665603ull;
+    for ( unsigned char c : s ) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static bool is_space( char c ) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static std::string_view trim_view( std::string_view v ) {
+    while ( !v.empty() && is_space( v.front() ) ) v.remove_prefix( 1 );
+    while ( !v.empty() && is_space( v.back() ) ) v.remove_suffix( 1 );
+    return v;
+}
+
+static bool ends_with_icase( std::string_view s, std::string_view suffix ) {
+    if ( s.size() < suffix.size() ) return false;
+    auto tail = s.substr( s.size() - suffix.size() );
+    for ( size_t i = 0; i < suffix.size(); ++i )
+        if ( std::tolower( ( unsigned char ) tail[ i ] ) != suffix[ i ] ) return false;
+    return true;
+}
+
+// A map's identity is its .bsp name: "dm_x.bsp.bz2" and "dm_x.bsp" are the same map, so
+// local files, listings and the plan all key on the name with any .bz2 removed.
+static std::string_view map_key( std::string_view name ) {
+    if ( ends_with_icase( name, ".bz2" ) ) name.remove_suffix( 4 );
+    return name;
+}
+
+static bool is_map_href( std::string_view href ) {
+    if ( href.empty() || href.back() == '/' ) return false;
+    return ends_with_icase( href, ".bsp" ) || ends_with_icase( href, ".bz2" );
+}
+
+// Subdirectories the crawl finds also hold other game content (.nav.bz2, material packs),
+// so only map names proper count there.
+static bool is_bsp_href( std::string_view href ) {
+    return ends_with_icase( href, ".bsp" ) || ends_with_icase( href, ".bsp.bz2" );
+}
+
+// Single pass over the listing, equivalent to searching for href\s*=\s*["']([^"']+)["']
+// (case-insensitive) and resuming after each match. f receives the trimmed attribute value
+// as a view into html for every href; nothing is allocated here.
+template <typename F>
+static void for_each_href( std::string_view html, F &&f ) {
+    const char *p = html.data();
+    size_t n = html.size();
+    size_t i = 0;
+    while ( i + 4 < n ) {
+        if ( ( p[ i ] | 0x20 ) != 'h' || ( p[ i + 1 ] | 0x20 ) != 'r' || ( p[ i + 2 ] | 0x20 ) != 'e' ||
+            ( p[ i + 3 ] | 0x20 ) != 'f' ) {
+            ++i;
+            continue;
+        }
+        size_t j = i + 4;
+        while ( j < n && is_space( p[ j ] ) ) ++j;
+        if ( j >= n || p[ j ] != '=' ) { ++i; continue; }
+        ++j;
+        while ( j < n && is_space( p[ j ] ) ) ++j;
+        if ( j >= n || ( p[ j ] != '"' && p[ j ] != '\'' ) ) { ++i; continue; }
+        size_t v = ++j;
+        while ( j < n && p[ j ] != '"' && p[ j ] != '\'' ) ++j;
+        if ( j >= n || j == v ) { ++i; continue; }
+
+        f( trim_view( html.substr( v, j - v ) ) );
+        i = j + 1;
+    }
+}
+
+// for_each_href for a body that arrives in chunks: the same matches, found as each chunk is
+// fed, with only a partial href carried across a chunk boundary. f gets each value (a view
+// into the chunk when it fits in one; values over kMaxValue bytes are dropped) and the offset
+// in the chunk just past its closing quote.
+class HrefScanner {
+public:
+    static constexpr size_t kMaxValue = 64 * 1024;
+
+    template <typename F>
+    void feed( std::string_view chunk, F &&f ) {
+        const char *p = chunk.data();
+        size_t n = chunk.size();
+        size_t v = 0;  // start of the value within this chunk
+        for ( size_t i = 0; i < n; ) {
+            char c = p[ i ];
+            switch ( state_ ) {
+            case State::Text:
+                while ( i < n && ( p[ i ] | 0x20 ) != 'h' ) ++i;
+                if ( i < n ) { state_ = State::H; ++i; }
+                continue;
+            case State::H:
+            case State::R:
+            case State::E: {
+                static constexpr char next[] = { 'r', 'e', 'f' };
+                // A mismatch may itself start "href" (an 'h'), so it is looked at again as text.
+                if ( ( c | 0x20 ) != next[ ( int ) state_ - ( int ) State::H ] ) { state_ = State::Text; continue; }
+                state_ = ( State ) ( ( int ) state_ + 1 );
+                ++i;
+                continue;
+            }
+            case State::Name:
+                if ( is_space( c ) ) { ++i; continue; }
+                if ( c != '=' ) { state_ = State::Text; continue; }
+                state_ = State::Eq;
+                ++i;
+                continue;
+            case State::Eq:
+                if ( is_space( c ) ) { ++i; continue; }
+                if ( c != '"' && c != '\'' ) { state_ = State::Text; continue; }
+                state_ = State::Value;
+                v = ++i;
+                value_.clear();
+                overlong_ = false;
+                continue;
+            case State::Value: {
+                size_t j = i;
+                while ( j < n && p[ j ] != '"' && p[ j ] != '\'' ) ++j;
+                if ( j == n ) {
+                    keep( p + v, n - v );
+                    i = n;
+                    continue;
+                }
+                state_ = State::Text;
+                i = j + 1;
+                if ( value_.empty() ) {
+                    if ( j > v ) f( trim_view( std::string_view( p + v, j - v ) ), i );
+                }
+                else {
+                    keep( p + v, j - v );
+                    if ( !overlong_ ) f( trim_view( value_ ), i );
+                    value_.clear();
+                }
+                continue;
+            }
+            }
+        }
+    }
+
+private:
+    // H, R, E and Name must stay consecutive: a matched letter advances to the next state.
+    enum class State { Text, H, R, E, Name, Eq, Value };
+
+    void keep( const char *p, size_t n ) {
+        if ( overlong_ ) return;
+        if ( value_.size() + n > kMaxValue ) {
+            overlong_ = true;
+            value_.assign( 1, ' ' );  // non-empty until the closing quote, then dropped
+            return;
+        }
+        value_.append( p, n );
+    }
+
+    State state_ = State::Text;
+    std::string value_;
+    bool overlong_ = false;
+};
+
+// Same href twice in a row (icon + name columns) resolves to the same URL; skipped early.
+static void add_map_link( const std::string &base_url, std::string_view href, std::string &prev, std::vector<std::string> &out ) {
+    if ( !is_map_href( href ) || href == prev ) return;
+    prev.assign( href );
+    auto url = url_join( base_url, href );
+    if ( out.empty() || out.back() != url ) out.push_back( std::move( url ) );
+}
+
+static std::string_view url_path( const std::string &url ) {
+    auto scheme = url.find( "://" );
+    auto path_at = scheme == std::string::npos ? std::string::npos : url.find( '/', scheme + 3 );
+    return path_at == std::string::npos ? std::string_view( "/" ) : std::string_view( url ).substr( path_at );
+}
+
+// Child directories linked from a listing at base_url (which ends in '/'), as full URLs.
+// Only links that stay below base_url count: parent links, sort-order queries, other hosts
+// and absolute paths elsewhere on the server are what autoindex pages are full of.
+static void add_subdir_link( const std::string &base_url, std::string_view base_path, std::string_view href, std::vector<std::string> &out ) {
+    if ( href.size() < 2 || href.back() != '/' ) return;
+    if ( href.find_first_of( "?#" ) != std::string_view::npos ) return;
+    std::string_view rel;
+    if ( href.starts_with( "http://" ) || href.starts_with( "https://" ) ) {
+        if ( !href.starts_with( base_url ) ) return;
+        rel = href.substr( base_url.size() );
+    }
+    else if ( href.front() == '/' ) {
+        if ( !href.starts_with( base_path ) ) return;
+        rel = href.substr( base_path.size() );
+    }
+    else {
+        rel = href.starts_with( "./" ) ? href.substr( 2 ) : href;
+    }
+    if ( rel.empty() || rel.front() == '/' || rel.starts_with( "../" ) || rel.find( "/../" ) != std::string_view::npos ) return;
+    auto url = url_join( base_url, rel );
+    if ( std::find( out.begin(), out.end(), url ) == out.end() ) out.push_back( std::move( url ) );
+}
+
+std::vector<std::string> extract_map_links_from_index_html( const std::string &base_url, const std::string &html ) {
+    std::vector<std::string> out;
+    std::string prev;
+    for_each_href( html, [ & ]( std::string_view href ) { add_map_link( base_url, href, prev, out ); } );
+    return out;
+}
+
+std::vector<std::string> extract_subdirs_from_index_html( const std::string &base_url, const std::string &html ) {
+    std::vector<std::string> out;
+    auto base_path = url_path( base_url );
+    for_each_href( html, [ & ]( std::string_view href ) { add_subdir_link( base_url, base_path, href, out ); } );
+    return out;
+}
+
+// Parses a directory listing while it downloads: map links and, when crawling, child
+// directories come out of one pass over each chunk, and the body itself is never kept,
+// so memory follows the number of links rather than the size of the page.
+//
+// Each link also gets a fingerprint of its row: the text outside tags from the link up to
+// the end of the row, which on autoindex pages is the name, date and size columns. A row
+// ends at the next unrelated href, at <tr> or </tr> on table pages, at a newline on <pre>
+// pages, and at </table>, </pre> or </body>, so the last row never takes in the page footer
+// (Apache's <address>, lighttpd's version line). A map whose fingerprint moves between runs
+// was replaced upstream under the same name.
+class ListingParser {
+public:
+    // bsp_only: a crawled subdirectory, where only .bsp and .bsp.bz2 links are maps.
+    ListingParser( std::string base_url, bool subdirs, bool bsp_only = false )
+        : base_( std::move( base_url ) ), subdirs_( subdirs ), bsp_only_( bsp_only ) {}
+
+    void feed( std::string_view chunk ) {
+        size_t hashed = 0;
+        scan_.feed( chunk, [ & ]( std::string_view href, size_t end ) {
+            // A carried value ends inside its tag near the chunk start, so the row text so far is done.
+            row_text( chunk.substr( hashed, end - hashed ) );
+            hashed = end;
+            on_href( href );
+            } );
+        row_text( chunk.substr( hashed ) );
+    }
+
+    // Closes the last row; sigs lines up with links afterwards.
+    void finish() { close_row(); }
+
+    std::vector<std::string> links;
+    std::vector<uint64_t> sigs;
+    std::vector<std::string> dirs;
+    // Time spent in feed(), summed while the profiler is recording.
+    std::chrono::steady_clock::duration parse_time{};
+
+private:
+    void on_href( std::string_view href ) {
+        size_t before = links.size();
+        bool candidate = !bsp_only_ || is_bsp_href( href );
+        if ( candidate ) add_map_link( base_, href, prev_, links );
+        // The icon and name columns link the same file; both belong to one row.
+        bool same_row = open_ && links.size() == before && candidate && is_map_href( href );
+        if ( !same_row ) close_row();
+        if ( links.size() > before ) {
+            open_ = true;
+            row_ = fnv1a( {} );
+            blank_ = false;
+        }
+        if ( subdirs_ ) add_subdir_link( base_, url_path( base_ ), href, dirs );
+    }
+
+    void close_row() {
+        if ( !open_ ) return;
+        sigs.push_back( row_ );
+        open_ = false;
+    }
+
+    // Tags are skipped and whitespace runs count as one space, so only the visible text counts.
+    void row_text( std::string_view s ) {
+        for ( char c : s ) {
+            if ( in_tag_ ) {
+                if ( c == '>' || ( naming_ && is_space( c ) ) ) end_tag_name();
+                else if ( naming_ && tag_.size() < 8 ) tag_ += ( char ) std::tolower( ( unsigned char ) c );
+                in_tag_ = c != '>';
+                continue;
+            }
+            if ( c == '<' ) { in_tag_ = naming_ = blank_ = true; tag_.clear(); continue; }
+            if ( c == '\n' && !table_ ) close_row();
+            if ( !open_ ) continue;
+            if ( is_space( c ) ) { blank_ = true; continue; }
+            if ( blank_ ) row_ = ( row_ ^ ' ' ) * 1099511628211ull;
+            blank_ = false;
+            row_ = ( row_ ^ ( unsigned char ) c ) * 1099511628211ull;
+        }
+    }
+
+    // Row boundaries by tag name; the first <tr> switches from newline rows to table rows.
+    void end_tag_name() {
+        if ( !naming_ ) return;
+        naming_ = false;
+        if ( tag_ == "tr" || tag_ == "/tr" ) {
+            table_ = true;
+            close_row();
+        }
+        else if ( tag_ == "/table" || tag_ == "/pre" || tag_ == "/body" ) close_row();
+    }
+
+    std::string base_;
+    bool subdirs_;
+    bool bsp_only_;
+    HrefScanner scan_;
+    std::string prev_;
+    bool open_ = false;
+    bool in_tag_ = false;
+    bool blank_ = false;
+    bool naming_ = false;
+    bool table_ = false;
+    std::string tag_;
+    uint64_t row_ = 0;
+};
+
+struct InventoryFile {
+    std::string name;
+    std::uintmax_t size = 0;
+    std::int64_t mtime = 0;
+};
+
+struct InventoryDir {
+    std::int64_t mtime = 0;
+    std::vector<InventoryFile> files;
+    std::vector<std::string> subdirs;
+    bool seen = false;
+};
+
+// Last known contents of every directory under maps/ and download/maps/, keyed by path.
+// A directory is only re-listed when its own mtime moved.
+struct MapInventory {
+    std::unordered_map<std::string, InventoryDir> dirs;
+    bool dirty = false;
+};
+
+fs::path inventory_path( const fs::path &data ) { return data / "inventory.cbor"; }
+
+static MapInventory load_inventory( const fs::path &data, LiveLog &log ) {
+    MapInventory inv;
+    auto p = inventory_path( data );
+    if ( !fs::exists( p ) ) return inv;
+    try {
+        std::ifstream f( p, std::ios::binary );
+        std::vector<std::uint8_t> bytes( ( std::istreambuf_iterator<char>( f ) ), std::istreambuf_iterator<char>() );
+        auto j = json::from_cbor( bytes );
+        auto dirs = j.value( "dirs", json::object() );
+        for ( auto &[path, it] : dirs.items() ) {
+            InventoryDir d;
+            d.mtime = it.value( "mtime", ( std::int64_t ) 0 );
+            d.subdirs = it.value( "subdirs", std::vector<std::string>{} );
+            for ( auto &fj : it.value( "files", json::array() ) ) {
+                // Compact rows: [name, size, mtime].
+                d.files.push_back( InventoryFile{ fj.at( 0 ).get<std::string>(), fj.at( 1 ).get<std::uintmax_t>(),
+                    fj.at( 2 ).get<std::int64_t>() } );
+            }
+            inv.dirs.emplace( path, std::move( d ) );
+        }
+    }
+    catch ( ... ) {
+        log.push( "[!] Failed to parse inventory.cbor (full rescan)." );
+        inv.dirs.clear();
+    }
+    return inv;
+}
+
+static void save_inventory( const MapInventory &inv, const fs::path &data, LiveLog &log ) {
+    json j;
+    j[ "dirs" ] = json::object();
+    for ( auto &[path, d] : inv.dirs ) {
+        json it;
+        it[ "mtime" ] = d.mtime;
+        it[ "subdirs" ] = d.subdirs;
+        it[ "files" ] = json::array();
+        for ( auto &f : d.files ) it[ "files" ].push_back( json::array( { f.name, f.size, f.mtime } ) );
+        j[ "dirs" ][ path ] = std::move( it );
+    }
+    try {
+        auto bytes = json::to_cbor( j );
+        std::ofstream f( inventory_path( data ), std::ios::binary );
+        f.write( ( const char * ) bytes.data(), ( std::streamsize ) bytes.size() );
+    }
+    catch ( ... ) {
+        log.push( "[!] Failed to write inventory.cbor" );
+    }
+}
+
+static void list_inventory_dir( const fs::path &dir, std::int64_t mtime, InventoryDir &d ) {
+    d.mtime = mtime;
+    d.files.clear();
+    d.subdirs.clear();
+    std::error_code ec;
+    for ( fs::directory_iterator it( dir, ec ), end; !ec && it != end; it.increment( ec ) ) {
+        auto &e = *it;
+        std::error_code fec;
+        if ( e.is_directory( fec ) && !e.is_symlink( fec ) ) {
+            d.subdirs.push_back( e.path().filename().string() );
+            continue;
+        }
+        if ( !e.is_regular_file( fec ) ) continue;
+        auto ext = lower_copy( e.path().extension().string() );
+        if ( ext != ".bsp" && ext != ".bz2" ) continue;
+        InventoryFile f;
+        f.name = e.path().filename().string();
+        f.size = e.file_size( fec );
+        f.mtime = ( std::int64_t ) e.last_write_time( fec ).time_since_epoch().count();
+        d.files.push_back( std::move( f ) );
+    }
+}
+
+static void inventory_walk( MapInventory &inv, const fs::path &dir, StringSet &out,
+    int &relisted ) {
+    auto mtime = mtime_of( dir );
+    auto &d = inv.dirs[ dir.string() ];
+    if ( !d.seen && ( d.mtime != mtime || mtime == 0 ) ) {
+        list_inventory_dir( dir, mtime, d );
+        inv.dirty = true;
+        relisted++;
+    }
+    d.seen = true;
+    for ( auto &f : d.files ) {
+        auto key = map_key( f.name );
+        if ( !out.contains( key ) ) out.emplace( key );
+    }
+    auto subdirs = d.subdirs;
+    for ( auto &sub : subdirs ) inventory_walk( inv, dir / sub, out, relisted );
+}
+
+void scan_existing_maps( const fs::path &hl2mp, const fs::path &data, RunState &rs, LiveLog &log ) {
+    TraceScope trace( "scan_existing_maps" );
+    rs.existing_files.clear();
+    std::vector<fs::path> roots = {
+        hl2mp / "maps",
+        hl2mp / "download" / "maps"
+    };
+    auto inv = load_inventory( data, log );
+    int relisted = 0;
+    for ( auto &root : roots ) {
+        if ( !fs::exists( root ) ) continue;
+        inventory_walk( inv, root, rs.existing_files, relisted );
+    }
+    for ( auto it = inv.dirs.begin(); it != inv.dirs.end(); ) {
+        if ( it->second.seen ) { ++it; continue; }
+        it = inv.dirs.erase( it );
+        inv.dirty = true;
+    }
+    if ( inv.dirty ) save_inventory( inv, data, log );
+    if ( trace.active() ) trace.args().values = { { "files", ( long long ) rs.existing_files.size() }, { "relisted", relisted } };
+    log.push( "[i] Existing map files found: " + std::to_string( rs.existing_files.size() ) + " (" +
+        std::to_string( relisted ) + "/" + std::to_string( inv.dirs.size() ) + " dirs re-listed)" );
+}
+
+// Re-lists one directory we just wrote into, so the next run's scan finds a matching mtime
+// instead of walking it again.
+static void refresh_inventory_dir( const fs::path &dir, const fs::path &data, LiveLog &log ) {
+    auto inv = load_inventory( data, log );
+    auto it = inv.dirs.find( dir.string() );
+    if ( it == inv.dirs.end() ) return;
+    list_inventory_dir( dir, mtime_of( dir ), it->second );
+    save_inventory( inv, data, log );
+}
+
+// Byte table for the reflected IEEE CRC32 (polynomial 0xEDB88320), built once.
+static const std::array<uint32_t, 256> &crc32_table() {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for ( uint32_t i = 0; i < 256; ++i ) {
+            uint32_t c = i;
+            for ( int k = 0; k < 8; ++k ) c = ( c & 1 ) ? 0xEDB88320u ^ ( c >> 1 ) : c >> 1;
+            t[ i ] = c;
+        }
+        return t;
+        }();
+    return table;
+}
+
+static constexpr uint32_t SHA256_K[ 64 ] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+void ContentHasher::reset() {
+    crc_ = 0xFFFFFFFFu;
+    state_ = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    block_len_ = 0;
+    total_ = 0;
+}
+
+void ContentHasher::compress( const unsigned char *p ) {
+    uint32_t w[ 64 ];
+    for ( int i = 0; i < 16; ++i )
+        w[ i ] = ( uint32_t ) p[ 4 * i ] << 24 | ( uint32_t ) p[ 4 * i + 1 ] << 16 | ( uint32_t ) p[ 4 * i + 2 ] << 8 | p[ 4 * i + 3 ];
+    for ( int i = 16; i < 64; ++i ) {
+        uint32_t s0 = std::rotr( w[ i - 15 ], 7 ) ^ std::rotr( w[ i - 15 ], 18 ) ^ ( w[ i - 15 ] >> 3 );
+        uint32_t s1 = std::rotr( w[ i - 2 ], 17 ) ^ std::rotr( w[ i - 2 ], 19 ) ^ ( w[ i - 2 ] >> 10 );
+        w[ i ] = w[ i - 16 ] + s0 + w[ i - 7 ] + s1;
+    }
+    uint32_t a = state_[ 0 ], b = state_[ 1 ], c = state_[ 2 ], d = state_[ 3 ];
+    uint32_t e = state_[ 4 ], f = state_[ 5 ], g = state_[ 6 ], h = state_[ 7 ];
+    for ( int i = 0; i < 64; ++i ) {
+        uint32_t t1 = h + ( std::rotr( e, 6 ) ^ std::rotr( e, 11 ) ^ std::rotr( e, 25 ) ) + ( ( e & f ) ^ ( ~e & g ) ) + SHA256_K[ i ] + w[ i ];
+        uint32_t t2 = ( std::rotr( a, 2 ) ^ std::rotr( a, 13 ) ^ std::rotr( a, 22 ) ) + ( ( a & b ) ^ ( a & c ) ^ ( b & c ) );
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state_[ 0 ] += a;
+    state_[ 1 ] += b;
+    state_[ 2 ] += c;
+    state_[ 3 ] += d;
+    state_[ 4 ] += e;
+    state_[ 5 ] += f;
+    state_[ 6 ] += g;
+    state_[ 7 ] += h;
+}
+
+void ContentHasher::update( const void *data, size_t n ) {
+    auto *p = static_cast<const unsigned char *>( data );
+    auto &table = crc32_table();
+    uint32_t crc = crc_;
+    for ( size_t i = 0; i < n; ++i ) crc = table[ ( crc ^ p[ i ] ) & 0xFF ] ^ ( crc >> 8 );
+    crc_ = crc;
+    total_ += n;
+
+    if ( block_len_ ) {
+        size_t take = std::min( n, sizeof( block_ ) - block_len_ );
+        std::memcpy( block_ + block_len_, p, take );
+        block_len_ += take;
+        p += take;
+        n -= take;
+        if ( block_len_ < sizeof( block_ ) ) return;
+        compress( block_ );
+        block_len_ = 0;
+    }
+    for ( ; n >= 64; p += 64, n -= 64 ) compress( p );
+    std::memcpy( block_, p, n );
+    block_len_ = n;
+}
+
+MapDigest ContentHasher::finish() {
+    MapDigest d;
+    d.size = ( long long ) total_;
+    d.crc32 = crc_ ^ 0xFFFFFFFFu;
+
+    uint64_t bits = total_ * 8;
+    unsigned char pad[ 72 ] = { 0x80 };
+    size_t pad_len = ( block_len_ < 56 ? 56 : 120 ) - block_len_;
+    for ( int i = 0; i < 8; ++i ) pad[ pad_len + i ] = ( unsigned char ) ( bits >> ( 56 - 8 * i ) );
+    // Padding is not content: keep total_ and the CRC as they were.
+    uint32_t crc = crc_;
+    update( pad, pad_len + 8 );
+    crc_ = crc;
+    total_ = ( uint64_t ) d.size;
+
+    static const char *hex = "0123456789abcdef";
+    d.sha256.reserve( 64 );
+    for ( uint32_t v : state_ )
+        for ( int s = 28; s >= 0; s -= 4 ) d.sha256.push_back( hex[ ( v >> s ) & 0xF ] );
+    return d;
+}
+
+static bool digest_matches( const MapDigest &want, const MapDigest &got ) {
+    if ( want.size >= 0 && want.size != got.size ) return false;
+    if ( want.crc32 && got.crc32 && *want.crc32 != *got.crc32 ) return false;
+    if ( !want.sha256.empty() && !got.sha256.empty() && want.sha256 != got.sha256 ) return false;
+    return true;
+}
+
+// Upstream manifests may disagree (mirrors lag each other), so any listed digest will do;
+// a map no manifest mentions is accepted unchecked.
+static bool digest_accepted( const std::vector<MapDigest> *expect, const MapDigest &got ) {
+    if ( !expect || expect->empty() ) return true;
+    for ( auto &want : *expect )
+        if ( digest_matches( want, got ) ) return true;
+    return false;
+}
+
+// Alignment O_DIRECT needs for buffer address, length and file offset on common file systems.
+static constexpr size_t OUTPUT_ALIGN = 4096;
+
+OutputFile::~OutputFile() {
+    release();
+}
+
+// Hands back the blocks reserved past EOF that the file did not grow into, e.g. when a
+// transfer failed or came up short of its hinted size.
+void OutputFile::trim_reserve() {
+#ifndef _WIN32
+    // Truncating to the current size frees blocks past EOF; punching a hole there does not
+    // on ext4, which clamps the range to the file size.
+    struct stat st{};
+    if ( reserved_end_ > 0 && fd_ >= 0 && fstat( fd_, &st ) == 0 && reserved_end_ > ( long long ) st.st_size &&
+        ftruncate( fd_, st.st_size ) != 0 )
+        failed_ = true;
+#endif
+    reserved_end_ = 0;
+}
+
+void OutputFile::release() {
+#ifndef _WIN32
+    if ( map_ ) {
+        // An abandoned mapping must not leave the zero-filled reserve behind as file content.
+        munmap( map_, map_cap_ );
+        if ( ftruncate( fd_, pos_ ) != 0 ) failed_ = true;
+    }
+    trim_reserve();
+    if ( fd_ >= 0 ) ::close( fd_ );
+#endif
+    if ( fp_ ) fclose( fp_ );
+    if ( buf_ ) ::operator delete( buf_, std::align_val_t( OUTPUT_ALIGN ) );
+    map_ = nullptr;
+    fd_ = -1;
+    fp_ = nullptr;
+    buf_ = nullptr;
+    open_ = false;
+}
+
+bool OutputFile::open( const fs::path &p, bool append, const OutputOptions &o, long long size_hint ) {
+    release();
+    opt_ = o;
+    mode_ = o.mode;
+    failed_ = false;
+    buf_len_ = 0;
+    map_cap_ = 0;
+    pos_ = 0;
+    reserved_end_ = 0;
+
+#ifdef _WIN32
+    if ( mode_ == WriteMode::Direct || mode_ == WriteMode::Mmap ) mode_ = WriteMode::Buffered;
+    fp_ = _wfopen( p.wstring().c_str(), append ? L"ab" : L"wb" );
+    if ( !fp_ ) return false;
+    if ( mode_ == WriteMode::Buffered ) setvbuf( fp_, nullptr, _IOFBF, opt_.buffer_bytes );
+    ( void ) size_hint;
+#else
+    if ( mode_ == WriteMode::Stdio ) {
+        fp_ = fopen( p.string().c_str(), append ? "ab" : "wb" );
+        if ( !fp_ ) return false;
+        open_ = true;
+        return true;
+    }
+
+    int flags = ( mode_ == WriteMode::Mmap ? O_RDWR : O_WRONLY ) | O_CREAT | ( append ? 0 : O_TRUNC );
+    fd_ = ::open( p.string().c_str(), flags, 0644 );
+    if ( fd_ < 0 ) return false;
+    struct stat st{};
+    if ( fstat( fd_, &st ) == 0 ) pos_ = ( long long ) st.st_size;
+
+    if ( mode_ == WriteMode::Mmap ) {
+        size_t want = ( size_t ) std::max<long long>( size_hint > 0 ? size_hint : 0, 8ll << 20 );
+        // Some file systems cannot map or reserve; carry on with plain buffered writes.
+        if ( !grow_map( ( size_t ) pos_ + want ) && !drop_map() ) return false;
+    }
+
+    if ( mode_ != WriteMode::Mmap ) {
+        lseek( fd_, 0, SEEK_END );
+#if defined( O_DIRECT )
+        // Direct I/O needs an aligned starting offset; a resumed .part rarely has one.
+        if ( mode_ == WriteMode::Direct && pos_ % ( long long ) OUTPUT_ALIGN == 0 ) {
+            int fl = fcntl( fd_, F_GETFL );
+            if ( fl < 0 || fcntl( fd_, F_SETFL, fl | O_DIRECT ) != 0 ) mode_ = WriteMode::Buffered;
+        }
+        else if ( mode_ == WriteMode::Direct ) mode_ = WriteMode::Buffered;
+#else
+        if ( mode_ == WriteMode::Direct ) mode_ = WriteMode::Buffered;
+#endif
+#if defined( __linux__ )
+        if ( size_hint > 0 && fallocate( fd_, FALLOC_FL_KEEP_SIZE, pos_, size_hint ) == 0 ) reserved_end_ = pos_ + size_hint;
+#endif
+        if ( !buf_ ) {
+            buf_cap_ = std::max( OUTPUT_ALIGN, opt_.buffer_bytes / OUTPUT_ALIGN * OUTPUT_ALIGN );
+            buf_ = static_cast<char *>( ::operator new( buf_cap_, std::align_val_t( OUTPUT_ALIGN ) ) );
+        }
+    }
+#endif
+    open_ = true;
+    return true;
+}
+
+// Leaves Mmap mode for buffered writes at pos_: the mapping goes and the file is cut back to
+// the bytes written.
+bool OutputFile::drop_map() {
+#ifdef _WIN32
+    return false;
+#else
+    if ( map_ ) munmap( map_, map_cap_ );
+    map_ = nullptr;
+    map_cap_ = 0;
+    mode_ = WriteMode::Buffered;
+    if ( ftruncate( fd_, pos_ ) != 0 || lseek( fd_, 0, SEEK_END ) < 0 ) return false;
+    if ( !buf_ ) {
+        buf_cap_ = std::max( OUTPUT_ALIGN, opt_.buffer_bytes / OUTPUT_ALIGN * OUTPUT_ALIGN );
+        buf_ = static_cast<char *>( ::operator new( buf_cap_, std::align_val_t( OUTPUT_ALIGN ) ) );
+    }
+    return true;
+#endif
+}
+
+bool OutputFile::grow_map( size_t need ) {
+#ifdef _WIN32
+    ( void ) need;
+    return false;
+#else
+    size_t cap = std::max( need, map_cap_ * 2 );
+    cap = ( cap + OUTPUT_ALIGN - 1 ) / OUTPUT_ALIGN * OUTPUT_ALIGN;
+    // The blocks are reserved up front: a store into a sparse page that finds the disk full
+    // raises SIGBUS instead of failing the write.
+#if defined( __linux__ )
+    if ( posix_fallocate( fd_, ( off_t ) map_cap_, ( off_t ) ( cap - map_cap_ ) ) != 0 ) return false;
+#else
+    if ( ftruncate( fd_, ( off_t ) cap ) != 0 ) return false;
+#endif
+    if ( map_ ) munmap( map_, map_cap_ );
+    void *m = mmap( nullptr, cap, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0 );
+    if ( m == MAP_FAILED ) {
+        map_ = nullptr;
+        return false;
+    }
+    map_ = static_cast<char *>( m );
+    map_cap_ = cap;
+    return true;
+#endif
+}
+
+bool OutputFile::flush_buffer( bool final ) {
+#ifdef _WIN32
+    ( void ) final;
+    return true;
+#else
+    size_t n = buf_len_;
+    if ( mode_ == WriteMode::Direct && final && n % OUTPUT_ALIGN ) {
+        // The unaligned tail cannot go through O_DIRECT; finish it with a normal write.
+        int fl = fcntl( fd_, F_GETFL );
+        if ( fl >= 0 ) fcntl( fd_, F_SETFL, fl & ~O_DIRECT );
+        mode_ = WriteMode::Buffered;
+    }
+    const char *p = buf_;
+    while ( n > 0 ) {
+        ssize_t w = ::write( fd_, p, n );
+        if ( w < 0 && errno == EINTR ) continue;
+        if ( w < 0 && errno == EINVAL && mode_ == WriteMode::Direct ) {
+            // The file system accepted O_DIRECT at open but not for this write.
+            int fl = fcntl( fd_, F_GETFL );
+            if ( fl >= 0 ) fcntl( fd_, F_SETFL, fl & ~O_DIRECT );
+            mode_ = WriteMode::Buffered;
+            continue;
+        }
+        if ( w <= 0 ) return false;
+        p += w;
+        n -= ( size_t ) w;
+    }
+    buf_len_ = 0;
+    return true;
+#endif
+}
+
+bool OutputFile::write( const void *data, size_t n ) {
+    if ( !open_ || failed_ ) return false;
+    if ( hasher_ ) hasher_->update( data, n );
+    const char *p = static_cast<const char *>( data );
+    if ( fp_ ) {
+        failed_ = fwrite( p, 1, n, fp_ ) != n;
+        pos_ += ( long long ) n;
+        return !failed_;
+    }
+    if ( mode_ == WriteMode::Mmap && ( size_t ) pos_ + n > map_cap_ && !grow_map( ( size_t ) pos_ + n ) && !drop_map() )
+        return !( failed_ = true );
+    if ( mode_ == WriteMode::Mmap ) {
+        std::memcpy( map_ + pos_, p, n );
+        pos_ += ( long long ) n;
+        return true;
+    }
+    while ( n > 0 ) {
+        size_t take = std::min( n, buf_cap_ - buf_len_ );
+        std::memcpy( buf_ + buf_len_, p, take );
+        buf_len_ += take;
+        p += take;
+        n -= take;
+        pos_ += ( long long ) take;
+        if ( buf_len_ == buf_cap_ && !flush_buffer( false ) ) return !( failed_ = true );
+    }
+    return true;
+}
+
+bool OutputFile::close() {
+    if ( !open_ ) return false;
+    // Flushing the buffer and any fsync happen here, so this is where the disk shows up.
+    TraceScope trace( "file_close" );
+    bool ok = !failed_;
+    bool sync = opt_.fsync != FsyncPolicy::Never;
+    if ( fp_ ) {
+        ok = fflush( fp_ ) == 0 && ok;
+#ifdef _WIN32
+        if ( sync && ok ) ok = _commit( _fileno( fp_ ) ) == 0;
+#else
+        if ( sync && ok ) ok = fsync( fileno( fp_ ) ) == 0;
+#endif
+        ok = fclose( fp_ ) == 0 && ok;
+        fp_ = nullptr;
+    }
+#ifndef _WIN32
+    else {
+        if ( mode_ == WriteMode::Mmap ) {
+            if ( sync && ok ) ok = msync( map_, ( size_t ) pos_, MS_SYNC ) == 0;
+            munmap( map_, map_cap_ );
+            map_ = nullptr;
+            ok = ftruncate( fd_, pos_ ) == 0 && ok;
+        }
+        else if ( ok ) {
+            ok = flush_buffer( true );
+        }
+        trim_reserve();
+        if ( sync && ok ) ok = fsync( fd_ ) == 0;
+        ok = ::close( fd_ ) == 0 && ok;
+        fd_ = -1;
+    }
+#endif
+    release();
+    return ok;
+}
+
+// Makes a rename into dir durable (FsyncPolicy::FileAndDir); a no-op where directories
+// cannot be opened for syncing.
+static void sync_dir( const fs::path &dir ) {
+#ifndef _WIN32
+    int fd = ::open( dir.string().c_str(), O_RDONLY | O_DIRECTORY );
+    if ( fd < 0 ) return;
+    fsync( fd );
+    ::close( fd );
+#else
+    ( void ) dir;
+#endif
+}
+
+// Incremental bz2 -> file decoder fed straight from the curl write callback.
+// Concatenated streams (as produced by pbzip2/lbzip2) are decoded back to back.
+struct Bz2StreamWriter {
+    bz_stream strm{};
+    bool initialised = false;
+    bool at_stream_end = false;
+    bool trailing = false;
+    bool failed = false;
+    OutputFile out;
+    PhaseProgress *progress = nullptr;
+
+    // A decoder dropped without close() (the server ignored a planned resume) still frees its libbz2 state.
+    ~Bz2StreamWriter() {
+        if ( initialised ) BZ2_bzDecompressEnd( &strm );
+    }
+
+    bool open( const fs::path &p, const OutputOptions &o ) {
+        if ( !out.open( p, false, o ) ) return false;
+        strm = bz_stream{};
+        initialised = BZ2_bzDecompressInit( &strm, 0, 0 ) == BZ_OK;
+        at_stream_end = false;
+        trailing = false;
+        failed = false;
+        return initialised;
+    }
+
+    bool feed( const char *data, size_t n ) {
+        if ( trailing ) return true;
+        if ( progress ) progress->bytes.fetch_add( ( long long ) n, std::memory_order_relaxed );
+        failed = !decode( data, n );
+        return !failed;
+    }
+
+    bool decode( const char *data, size_t n ) {
+        char buf[ 1 << 16 ];
+        strm.next_in = const_cast< char * >( data );
+        strm.avail_in = ( unsigned ) n;
+        for ( ;; ) {
+            bool fresh = false;
+            if ( at_stream_end ) {
+                if ( strm.avail_in == 0 ) break;
+                char *rest = strm.next_in;
+                unsigned left = strm.avail_in;
+                BZ2_bzDecompressEnd( &strm );
+                strm = bz_stream{};
+                initialised = BZ2_bzDecompressInit( &strm, 0, 0 ) == BZ_OK;
+                if ( !initialised ) return false;
+                strm.next_in = rest;
+                strm.avail_in = left;
+                at_stream_end = false;
+                fresh = true;
+            }
+            strm.next_out = buf;
+            strm.avail_out = sizeof( buf );
+            int rc = BZ2_bzDecompress( &strm );
+            if ( rc == BZ_DATA_ERROR_MAGIC && fresh ) {
+                // Junk after a complete stream; bzip2(1) ignores it too.
+                trailing = true;
+                at_stream_end = true;
+                return true;
+            }
+            if ( rc != BZ_OK && rc != BZ_STREAM_END ) return false;
+            size_t produced = sizeof( buf ) - strm.avail_out;
+            if ( produced && !out.write( buf, produced ) ) return false;
+            if ( progress ) progress->bytes_out.fetch_add( ( long long ) produced, std::memory_order_relaxed );
+            if ( rc == BZ_STREAM_END ) { at_stream_end = true; continue; }
+            if ( strm.avail_in == 0 && strm.avail_out != 0 ) break;
+        }
+        return true;
+    }
+
+    // True only when the last stream was terminated properly (no truncated tail).
+    bool close() {
+        if ( initialised ) BZ2_bzDecompressEnd( &strm );
+        initialised = false;
+        bool ok = out.is_open() && at_stream_end;
+        if ( out.is_open() && !out.close() ) ok = false;
+        return ok;
+    }
+};
+
+static void commit_part( const fs::path &tmp, const fs::path &final_path, FsyncPolicy fsync_policy ) {
+    TraceScope trace( "commit" );
+    std::error_code ec;
+    fs::rename( tmp, final_path, ec );
+    if ( ec ) {
+        fs::copy_file( tmp, final_path, fs::copy_options::overwrite_existing, ec );
+        fs::remove( tmp, ec );
+    }
+    if ( fsync_policy == FsyncPolicy::FileAndDir ) sync_dir( final_path.parent_path() );
+}
+
+// Validators of the response a .part file was started from, kept next to it as
+// <file>.part.meta so a later attempt (or run) can ask for just the missing bytes.
+struct PartMeta {
+    std::string url;
+    std::string etag;
+    std::string last_modified;
+    long long total = -1;
+    // Bytes of the .part known to hold data while it may be longer than that (an mmap
+    // reserve, if the process dies before close() trims it); -1 = the file size is right.
+    long long valid = -1;
+};
+
+static fs::path part_meta_path( const fs::path &tmp ) {
+    auto p = tmp;
+    p += ".meta";
+    return p;
+}
+
+static std::optional<PartMeta> load_part_meta( const fs::path &tmp ) {
+    try {
+        std::ifstream f( part_meta_path( tmp ) );
+        if ( !f ) return std::nullopt;
+        json j;
+        f >> j;
+        PartMeta m;
+        m.url = j.value( "url", "" );
+        m.etag = j.value( "etag", "" );
+        m.last_modified = j.value( "last_modified", "" );
+        m.total = j.value( "total", -1LL );
+        m.valid = j.value( "valid", -1LL );
+        return m;
+    }
+    catch ( ... ) {
+        return std::nullopt;
+    }
+}
+
+static void save_part_meta( const fs::path &tmp, const PartMeta &m ) {
+    json j;
+    j[ "url" ] = m.url;
+    j[ "etag" ] = m.etag;
+    j[ "last_modified" ] = m.last_modified;
+    j[ "total" ] = m.total;
+    if ( m.valid >= 0 ) j[ "valid" ] = m.valid;
+    std::ofstream f( part_meta_path( tmp ) );
+    f << j.dump();
+}
+
+static void remove_part( const fs::path &tmp ) {
+    std::error_code ec;
+    fs::remove( tmp, ec );
+    fs::remove( part_meta_path( tmp ), ec );
+}
+
+// Outcome of one download attempt. Retrying (and on which mirror) is the caller's call.
+struct DownloadResult {
+    bool ok = false;
+    bool cancelled = false;
+    long long bytes = 0;
+    double seconds = 0;
+    // Resumable prefix left in the .part; only reused if the same URL is tried again.
+    long long kept = 0;
+    // Hashes of the .bsp this download put in place (plain or streamed), if it did.
+    std::optional<MapDigest> digest;
+};
+
+// Where a download reports its bytes; any of these may be null.
+struct DownloadCounters {
+    PhaseProgress *phase = nullptr;
+    std::atomic<long long> *source = nullptr;
+    // Streamed .bz2 decoding reports its input/output here.
+    PhaseProgress *decode = nullptr;
+    // Size the probe already put into phase->bytes_total (and sized) for this file, or -1.
+    // The attempt takes it over: the response's own size replaces it, a failure removes it.
+    long long presized = -1;
+    // Transfer::rate_group for the per-mirror bandwidth cap.
+    std::string rate_group;
+};
+
+// How much a mapped .part may run ahead of the valid length recorded in its .meta.
+static constexpr long long kPartCheckpoint = 8ll << 20;
+
+struct DownloadJob {
+    std::string url;
+    fs::path out_file;
+    fs::path tmp;
+    int timeout_ms = 0;
+    OutputOptions output;
+    OutputFile out;
+
+    // Resume state for the current attempt: bytes already in tmp that were requested via
+    // Range, and the size the finished file must have (-1 if the server did not say).
+    long long offset = 0;
+    long long expected = -1;
+    bool open_failed = false;
+    // What tmp's .meta says; while tmp is mapped, valid is moved forward every
+    // kPartCheckpoint bytes so a crash loses at most that much of the prefix.
+    PartMeta meta;
+
+    // Streaming mode: bytes are decoded into bsp_tmp as they arrive; tmp (the .bz2) is
+    // only written when keep_bz2 is set.
+    bool stream_bz2 = false;
+    bool keep_bz2 = true;
+    fs::path bsp_file;
+    fs::path bsp_tmp;
+    std::unique_ptr<Bz2StreamWriter> bz;
+
+    // Set when this job produces a .bsp: its bytes are hashed as they are written and checked
+    // against expect (digests from the sources' manifests, may be null) before the commit.
+    bool hash_output = false;
+    ContentHasher hash;
+    const std::vector<MapDigest> *expect = nullptr;
+
+    std::atomic<bool> *cancel = nullptr;
+    LiveLog *log = nullptr;
+    DownloadCounters counters;
+    // Announced size this attempt added to counters.phase->bytes_total, or -1.
+    long long sized_added = -1;
+    std::function<void( const DownloadResult & )> done;
+};
+
+// A failed attempt takes its bytes back out of the phase totals so the retry is not counted
+// twice; a file that never announced its size contributes its real size once it is done.
+static void settle_counters( DownloadJob &job, const DownloadResult &res ) {
+    auto *p = job.counters.phase;
+    if ( !p ) return;
+    if ( res.ok ) {
+        if ( job.sized_added < 0 ) {
+            p->bytes_total.fetch_add( res.bytes, std::memory_order_relaxed );
+            p->sized.fetch_add( 1, std::memory_order_relaxed );
+        }
+        return;
+    }
+    p->bytes.fetch_sub( res.bytes, std::memory_order_relaxed );
+    if ( job.sized_added >= 0 ) {
+        p->bytes_total.fetch_sub( job.sized_added, std::memory_order_relaxed );
+        p->sized.fetch_sub( 1, std::memory_order_relaxed );
+    }
+}
+
+// Feeds the first n bytes of p to f in chunks; false if the file is shorter or f refuses.
+static bool replay_prefix( const fs::path &p, long long n, const std::function<bool( const char *, size_t )> &f ) {
+    FILE *in = nullptr;
+#ifdef _WIN32
+    in = _wfopen( p.wstring().c_str(), L"rb" );
+#else
+    in = fopen( p.string().c_str(), "rb" );
+#endif
+    bool ok = in != nullptr;
+    char buf[ 1 << 16 ];
+    while ( ok && n > 0 ) {
+        size_t got = fread( buf, 1, ( size_t ) std::min<long long>( n, sizeof( buf ) ), in );
+        if ( got == 0 ) { ok = false; break; }
+        ok = f( buf, got );
+        n -= ( long long ) got;
+    }
+    if ( in ) fclose( in );
+    return ok;
+}
+
+static bool open_stream_decoder( DownloadJob &job ) {
+    job.bz = std::make_unique<Bz2StreamWriter>();
+    job.bz->progress = job.counters.decode;
+    job.bz->out.set_hasher( &job.hash );
+    return job.bz->open( job.bsp_tmp, job.output );
+}
+
+// Brings the hasher (and, when streaming, the decoder) up to the kept prefix of tmp.
+static bool replay_kept_prefix( DownloadJob &job ) {
+    if ( job.stream_bz2 )
+        return open_stream_decoder( job ) &&
+            replay_prefix( job.tmp, job.offset, [ &job ]( const char *p, size_t n ) { return job.bz->feed( p, n ); } );
+    if ( !job.hash_output ) return true;
+    return replay_prefix( job.tmp, job.offset, [ &job ]( const char *p, size_t n ) { job.hash.update( p, n ); return true; } );
+}
+
+// Decide whether tmp can be continued and add Range/If-Range if so. Weak ETags are not
+// valid in If-Range, so those fall back to Last-Modified or a full fetch. Runs on the pool
+// before the attempt is queued, so the kept prefix is read back here and the engine thread
+// only ever sees new bytes.
+static void plan_resume( DownloadJob &job, Transfer &t ) {
+    job.offset = 0;
+    job.expected = -1;
+    job.hash.reset();
+    job.bz.reset();
+    bool raw_on_disk = !job.stream_bz2 || job.keep_bz2;
+    std::error_code ec;
+    auto have = raw_on_disk ? fs::file_size( job.tmp, ec ) : 0;
+    if ( !raw_on_disk || ec || have == 0 ) return;
+
+    auto meta = load_part_meta( job.tmp );
+    if ( !meta || meta->url != job.url ) return;
+    // Left mapped by a run that died: everything past the last checkpoint may be zero fill.
+    if ( meta->valid >= 0 && ( long long ) have > meta->valid ) {
+        fs::resize_file( job.tmp, ( uintmax_t ) meta->valid, ec );
+        if ( ec ) return;
+        have = ( uintmax_t ) meta->valid;
+        if ( have == 0 ) return;
+    }
+    std::string validator;
+    if ( !meta->etag.empty() && !meta->etag.starts_with( "W/" ) ) validator = meta->etag;
+    else validator = meta->last_modified;
+    if ( validator.empty() ) return;
+    if ( meta->total >= 0 && ( long long ) have >= meta->total ) return;
+
+    job.offset = ( long long ) have;
+    if ( !replay_kept_prefix( job ) ) {
+        job.offset = 0;
+        job.hash.reset();
+        job.bz.reset();
+        return;
+    }
+    t.headers.push_back( "Range: bytes=" + std::to_string( job.offset ) + "-" );
+    t.headers.push_back( "If-Range: " + validator );
+}
+
+// Opens the outputs once the response status is known: 206 continues the .part, with the
+// hasher and decoder plan_resume already replayed it through; anything else 2xx starts over.
+static bool open_download_outputs( DownloadJob &job, const HttpResult &r ) {
+    bool resumed = job.offset > 0 && r.status == 206 && r.range_start == job.offset;
+    if ( !resumed ) {
+        job.offset = 0;
+        job.hash.reset();
+        job.bz.reset();
+    }
+
+    if ( resumed ) job.expected = r.range_total >= 0 ? r.range_total :
+        ( r.content_length >= 0 ? job.offset + r.content_length : -1 );
+    else job.expected = r.content_length;
+
+    if ( job.counters.phase && r.content_length >= 0 ) {
+        auto *p = job.counters.phase;
+        // A probed size is corrected rather than counted twice; a resume only has the rest to go.
+        if ( job.sized_added >= 0 ) p->bytes_total.fetch_add( r.content_length - job.sized_added, std::memory_order_relaxed );
+        else {
+            p->bytes_total.fetch_add( r.content_length, std::memory_order_relaxed );
+            p->sized.fetch_add( 1, std::memory_order_relaxed );
+        }
+        job.sized_added = r.content_length;
+    }
+
+    bool write_raw = !job.stream_bz2 || job.keep_bz2;
+    if ( write_raw ) {
+        bool hash_raw = job.hash_output && !job.stream_bz2;
+        job.out.set_hasher( hash_raw ? &job.hash : nullptr );
+        long long hint = r.content_length >= 0 ? r.content_length : -1;
+        if ( !job.out.open( job.tmp, resumed, job.output, hint ) ) {
+            job.log->failf( "[DL] Failed to open for writing: %s", job.tmp.string().c_str() );
+            return false;
+        }
+        job.meta = PartMeta{ job.url, r.etag, r.last_modified, job.expected };
+        if ( job.out.mode() == WriteMode::Mmap ) job.meta.valid = job.out.size();
+        save_part_meta( job.tmp, job.meta );
+    }
+    if ( job.stream_bz2 && !job.bz && !open_stream_decoder( job ) ) {
+        job.log->failf( "[DL] Failed to open for writing: %s", job.bsp_tmp.string().c_str() );
+        return false;
+    }
+    return true;
+}
+
+// Settles one attempt once its transfer has ended: closes the outputs, checks size and
+// content, and commits or keeps the .part for a resume. Runs on the pool, because closing
+// may fsync the file and committing may sync the directory.
+static void finish_download( const std::shared_ptr<DownloadJob> &job, HttpResult r ) {
+    DownloadResult res;
+    res.bytes = r.bytes;
+    res.seconds = r.seconds;
+
+    bool opened = job->out.is_open() || job->bz != nullptr;
+    bool written = !job->out.is_open() || job->out.close();
+    // close() trimmed the reserve, so the file size is right again for a later resume.
+    if ( job->meta.valid >= 0 ) {
+        job->meta.valid = -1;
+        save_part_meta( job->tmp, job->meta );
+    }
+    // decoded: the stream was complete; intact: no corrupt data seen (a clean prefix).
+    bool decoded = true;
+    bool intact = true;
+    if ( job->bz ) {
+        intact = !job->bz->failed;
+        decoded = job->bz->close();
+        job->bz.reset();
+    }
+
+    std::error_code ec;
+
+    // Keep the .part on cancel so the next run only fetches what is missing.
+    if ( job->cancel->load() || job->open_failed ) {
+        if ( job->stream_bz2 ) fs::remove( job->bsp_tmp, ec );
+        if ( job->open_failed ) remove_part( job->tmp );
+        res.cancelled = !job->open_failed;
+        job->done( res );
+        return;
+    }
+
+    bool http_ok = r.err.empty() && r.status >= 200 && r.status < 300 && opened && written;
+    long long got = opened && ( !job->stream_bz2 || job->keep_bz2 ) ? ( long long ) fs::file_size( job->tmp, ec ) : -1;
+    bool size_ok = job->expected < 0 || got < 0 || got == job->expected;
+    bool complete = http_ok && decoded && size_ok;
+    bool content_ok = true;
+    if ( complete && job->hash_output ) {
+        auto digest = job->hash.finish();
+        content_ok = digest_accepted( job->expect, digest );
+        if ( content_ok ) res.digest = std::move( digest );
+    }
+
+    if ( complete && content_ok ) {
+        if ( !job->stream_bz2 || job->keep_bz2 ) {
+            commit_part( job->tmp, job->out_file, job->output.fsync );
+            fs::remove( part_meta_path( job->tmp ), ec );
+        }
+        if ( job->stream_bz2 ) commit_part( job->bsp_tmp, job->bsp_file, job->output.fsync );
+        res.ok = true;
+        job->done( res );
+        return;
+    }
+    if ( !written ) job->log->failf( "[DL] Write failed: %s", job->tmp.string().c_str() );
+    if ( http_ok && !decoded ) job->log->failf( "[BZ2] Stream decode failed: %s", job->out_file.filename().string().c_str() );
+    if ( http_ok && decoded && !size_ok )
+        job->log->failf( "[DL] Size mismatch: %s (%lld of %lld bytes)", job->out_file.filename().string().c_str(), got,
+            job->expected );
+    if ( complete && !content_ok )
+        job->log->failf( "[DL] Content does not match the source manifest: %s", job->out_file.filename().string().c_str() );
+
+    // The decoded .bsp is always rebuilt from scratch; the raw .part is what we resume.
+    if ( job->stream_bz2 ) fs::remove( job->bsp_tmp, ec );
+
+    // A short body on a network error is a valid prefix worth resuming; bad content,
+    // oversized files and 4xx answers (gone, or an unsatisfiable range) start over.
+    bool keep_prefix = !r.err.empty() && intact && ( job->expected < 0 || got < job->expected );
+    if ( !keep_prefix ) remove_part( job->tmp );
+    else if ( got > 0 ) res.kept = got;
+    job->done( res );
+}
+
+static void download_attempt( TransferEngine &eng, std::shared_ptr<DownloadJob> job ) {
+    Transfer t;
+    t.url = job->url;
+    t.timeout_ms = job->timeout_ms;
+    t.rx_bytes = job->counters.phase ? &job->counters.phase->bytes : nullptr;
+    t.rx_source_bytes = job->counters.source;
+    t.rate_group = job->counters.rate_group;
+    t.trace_name = "download";
+    plan_resume( *job, t );
+    t.on_headers = [ job ]( const HttpResult &r ) {
+        if ( r.status < 200 || r.status >= 300 ) return true;
+        if ( !open_download_outputs( *job, r ) ) {
+            job->open_failed = true;
+            return false;
+        }
+        return true;
+        };
+    t.on_data = [ job ]( const char *p, size_t n ) {
+        if ( job->out.is_open() && !job->out.write( p, n ) ) return false;
+        if ( job->meta.valid >= 0 && job->out.size() - job->meta.valid >= kPartCheckpoint ) {
+            // A few bytes of JSON per kPartCheckpoint of body; the mapped pages are already
+            // the kernel's, so this is what a crash of this process needs to resume.
+            job->meta.valid = job->out.size();
+            save_part_meta( job->tmp, job->meta );
+        }
+        // A decode error aborts the transfer early instead of pulling the rest of a bad file.
+        if ( job->bz && !job->bz->feed( p, n ) ) return false;
+        return true;
+        };
+    t.on_done = [ job ]( HttpResult r ) {
+        shared_pool().submit( [ job, r = std::move( r ) ]() mutable { finish_download( job, std::move( r ) ); } );
+        };
+    eng.submit( std::move( t ) );
+}
+
+// Queues one attempt at url -> out_file (via the pool, which reads back a kept .part first)
+// and returns immediately; done fires on a pool worker once the file is in place or the
+// attempt has failed.
+void download_file( TransferEngine &eng, const std::string &url, const fs::path &out_file, const Settings &s,
+    std::atomic<bool> &cancel, LiveLog &log, const DownloadCounters &counters,
+    std::function<void( const DownloadResult & )> done, const std::vector<MapDigest> *expect = nullptr ) {
+    std::error_code ec;
+    fs::create_directories( out_file.parent_path(), ec );
+
+    auto job = std::make_shared<DownloadJob>();
+    job->url = url;
+    job->out_file = out_file;
+    job->tmp = out_file;
+    job->tmp += ".part";
+    job->timeout_ms = s.dl_timeout_ms;
+    job->output = output_options( s );
+    job->cancel = &cancel;
+    job->log = &log;
+    job->counters = counters;
+    job->sized_added = counters.presized;
+    job->expect = expect;
+    // The job owns this callback, so the raw pointer cannot outlive it.
+    job->done = [ self = job.get(), done = std::move( done ) ]( const DownloadResult &res ) {
+        settle_counters( *self, res );
+        done( res );
+        };
+
+    if ( s.decompress && s.stream_decompress && lower_copy( out_file.extension().string() ) == ".bz2" ) {
+        job->stream_bz2 = true;
+        job->keep_bz2 = !s.delete_bz2;
+        job->bsp_file = out_file;
+        job->bsp_file.replace_extension( "" );
+        // Distinct from the plain .bsp download's .part in case both variants are queued.
+        job->bsp_tmp = job->bsp_file;
+        job->bsp_tmp += ".unbz2.part";
+    }
+    // A .bz2 kept for the decompress stage is checked once it is extracted instead.
+    job->hash_output = job->stream_bz2 || lower_copy( out_file.extension().string() ) != ".bz2";
+
+    if ( cancel.load() ) {
+        DownloadResult res;
+        res.cancelled = true;
+        job->done( res );
+        return;
+    }
+    shared_pool().submit( [ &eng, job = std::move( job ) ]() mutable { download_attempt( eng, std::move( job ) ); } );
+}
+
+// Concatenated streams (pbzip2/lbzip2 output) are decoded back to back: BZ2_bzRead stops at
+// the first stream end, so the reader is reopened on the bytes it had read ahead. Junk after
+// a complete stream is ignored, as bzip2(1) does.
+static bool decompress_bz2_serial( const fs::path &bz2_file, const fs::path &out_file, int retries,
+    std::atomic<bool> &cancel, LiveLog &log, PhaseProgress *progress, const OutputOptions &output,
+    ContentHasher *hash = nullptr ) {
+    for ( int attempt = 1; attempt <= retries && !cancel.load(); ++attempt ) {
+        FILE *in = nullptr;
+        OutputFile out;
+        if ( hash ) hash->reset();
+        out.set_hasher( hash );
+#ifdef _WIN32
+        in = _wfopen( bz2_file.wstring().c_str(), L"rb" );
+#else
+        in = fopen( bz2_file.string().c_str(), "rb" );
+#endif
+        if ( !in || !out.open( out_file, false, output ) ) {
+            if ( in ) fclose( in );
+            log.failf( "[BZ2] Open failed: %s", bz2_file.filename().string().c_str() );
+            return false;
+        }
+
+        char unused[ BZ_MAX_UNUSED ];
+        int n_unused = 0;
+        int streams = 0;
+        bool ended = false;
+        bool write_failed = false;
+        char buf[ 1 << 16 ];
+        long long consumed = 0;
+        while ( !cancel.load() && !write_failed ) {
+            int bzerr = BZ_OK;
+            BZFILE *bz = BZ2_bzReadOpen( &bzerr, in, 0, 0, n_unused ? unused : nullptr, n_unused );
+            if ( !bz || bzerr != BZ_OK ) {
+                if ( bz ) BZ2_bzReadClose( &bzerr, bz );
+                if ( !streams ) log.failf( "[BZ2] ReadOpen failed: %s", bz2_file.filename().string().c_str() );
+                ended = false;
+                break;
+            }
+
+            long long produced = 0;
+            while ( !cancel.load() ) {
+                int n = BZ2_bzRead( &bzerr, bz, buf, ( int ) sizeof( buf ) );
+                if ( progress ) {
+                    // long is 32 bits on Windows; maps past 2 GiB would stop counting.
+#ifdef _WIN32
+                    long long pos = _ftelli64( in );
+#else
+                    long long pos = ( long long ) ftello( in );
+#endif
+                    if ( pos > consumed ) progress->bytes.fetch_add( pos - consumed, std::memory_order_relaxed );
+                    consumed = std::max( consumed, pos );
+                    if ( n > 0 ) progress->bytes_out.fetch_add( n, std::memory_order_relaxed );
+                }
+                if ( bzerr != BZ_OK && bzerr != BZ_STREAM_END ) break;
+                produced += n > 0 ? n : 0;
+                if ( n > 0 && !out.write( buf, ( size_t ) n ) ) {
+                    log.failf( "[BZ2] Write failed: %s", out_file.string().c_str() );
+                    write_failed = true;
+                    break;
+                }
+                if ( bzerr == BZ_STREAM_END ) break;
+            }
+
+            // A later "stream" that is not bz2 at all is trailing junk after a complete file.
+            bool junk = streams > 0 && produced == 0 && bzerr == BZ_DATA_ERROR_MAGIC;
+            bool stream_end = bzerr == BZ_STREAM_END && !write_failed;
+            if ( stream_end ) {
+                void *rest = nullptr;
+                BZ2_bzReadGetUnused( &bzerr, bz, &rest, &n_unused );
+                if ( bzerr == BZ_OK && n_unused > 0 ) std::memcpy( unused, rest, ( size_t ) n_unused );
+                else n_unused = 0;
+            }
+            BZ2_bzReadClose( &bzerr, bz );
+            if ( junk ) break;
+            ended = stream_end;
+            if ( !ended ) break;
+            streams++;
+
+            if ( n_unused == 0 ) {
+                int c = fgetc( in );
+                if ( c == EOF ) break;
+                ungetc( c, in );
+            }
+        }
+
+        fclose( in );
+        if ( !out.close() ) ended = false;
+
+        // bzlib stops reading a little short of EOF; count the whole file once it decoded, and
+        // take a failed attempt's input back out before the retry reads it again.
+        if ( progress ) {
+            std::error_code sec;
+            auto sz = fs::file_size( bz2_file, sec );
+            if ( ended && !sec && ( long long ) sz > consumed )
+                progress->bytes.fetch_add( ( long long ) sz - consumed, std::memory_order_relaxed );
+            else if ( !ended && !cancel.load() )
+                progress->bytes.fetch_sub( consumed, std::memory_order_relaxed );
+        }
+
+        if ( cancel.load() ) return false;
+
+        // Success is every stream ending properly; a truncated tail never reaches BZ_STREAM_END.
+        if ( ended ) return true;
+
+        std::error_code ec;
+        fs::remove( out_file, ec );
+
+        if ( attempt == retries ) {
+            log.failf( "[BZ2] Failed: %s", bz2_file.filename().string().c_str() );
+            return false;
+        }
+    }
+    return false;
+}
+
+// Block-parallel decoding for large .bz2 files. Every bzip2 block starts with the 48-bit magic
+// 0x314159265359 at an arbitrary bit offset and carries its own CRC, so once the block and
+// end-of-stream magics are located each block can be re-aligned into a one-block stream and
+// decoded on its own, lbzip2-style. Outputs are written back in order.
+static constexpr uint64_t BZ2_BLOCK_MAGIC = 0x314159265359ull;
+static constexpr uint64_t BZ2_EOS_MAGIC = 0x177245385090ull;
+static constexpr long long BZ2_PARALLEL_MIN_BYTES = 16ll << 20;
+
+struct Bz2Mark {
+    uint64_t bit;
+    bool eos;
+};
+
+// Byte value expected at offset 1 of an 8-byte window for a magic starting at bit s of the
+// window: bit s of the byte table is the block magic, bit 8 + s the end-of-stream one.
+static const std::array<uint16_t, 256> &bz2_mark_prefilter() {
+    static const std::array<uint16_t, 256> table = [] {
+        std::array<uint16_t, 256> t{};
+        for ( int s = 0; s < 8; ++s ) {
+            t[ ( BZ2_BLOCK_MAGIC >> ( 32 + s ) ) & 0xFF ] |= ( uint16_t ) ( 1u << s );
+            t[ ( BZ2_EOS_MAGIC >> ( 32 + s ) ) & 0xFF ] |= ( uint16_t ) ( 1u << ( 8 + s ) );
+        }
+        return t;
+        }();
+    return table;
+}
+
+// Appends the magics starting in bytes [from, to) of d (which must have 8 readable bytes past
+// each position); base is the absolute bit offset of d[0].
+static void scan_bz2_marks( const unsigned char *d, size_t from, size_t to, uint64_t base, std::vector<Bz2Mark> &out ) {
+    const auto &pre = bz2_mark_prefilter();
+    for ( size_t i = from; i < to; ++i ) {
+        uint16_t m = pre[ d[ i + 1 ] ];
+        if ( !m ) continue;
+        uint64_t w = 0;
+        for ( int k = 0; k < 8; ++k ) w = ( w << 8 ) | d[ i + k ];
+        for ( int s = 0; s < 8; ++s ) {
+            uint64_t v = ( w >> ( 16 - s ) ) & 0xFFFFFFFFFFFFull;
+            if ( ( m >> s ) & 1 && v == BZ2_BLOCK_MAGIC ) out.push_back( { base + i * 8 + ( uint64_t ) s, false } );
+            else if ( ( m >> ( 8 + s ) ) & 1 && v == BZ2_EOS_MAGIC ) out.push_back( { base + i * 8 + ( uint64_t ) s, true } );
+        }
+    }
+}
+
+struct BitWriter {
+    std::string out;
+    uint64_t acc = 0;
+    int n = 0;
+
+    void put( uint64_t v, int bits ) {
+        while ( bits > 0 ) {
+            int take = std::min( bits, 32 );
+            bits -= take;
+            acc = ( acc << take ) | ( ( v >> bits ) & ( ( 1ull << take ) - 1 ) );
+            n += take;
+            while ( n >= 8 ) {
+                n -= 8;
+                out.push_back( ( char ) ( ( acc >> n ) & 0xFF ) );
+            }
+        }
+    }
+
+    void flush() {
+        if ( n ) out.push_back( ( char ) ( ( acc << ( 8 - n ) ) & 0xFF ) );
+        n = 0;
+    }
+};
+
+// Bits [b0, b1) of d (absolute offsets minus base) wrapped as a complete one-block stream:
+// header, the block as found, an end-of-stream marker, and the block CRC as the stream CRC.
+static std::string bz2_block_stream( const unsigned char *d, uint64_t base, uint64_t b0, uint64_t b1 ) {
+    auto bit_at = [ & ]( uint64_t p ) { p -= base; return ( d[ p >> 3 ] >> ( 7 - ( p & 7 ) ) ) & 1u; };
+    auto byte_at = [ & ]( uint64_t p ) {
+        p -= base;
+        unsigned sh = ( unsigned ) ( p & 7 );
+        unsigned v = ( unsigned ) d[ p >> 3 ] << sh;
+        if ( sh ) v |= d[ ( p >> 3 ) + 1 ] >> ( 8 - sh );
+        return v & 0xFFu;
+        };
+
+    BitWriter w;
+    w.out.reserve( ( size_t ) ( ( b1 - b0 ) / 8 + 32 ) );
+    w.out.append( "BZh9", 4 );
+    uint32_t crc = 0;
+    for ( int k = 0; k < 32; ++k ) crc = ( crc << 1 ) | bit_at( b0 + 48 + ( uint64_t ) k );
+
+    uint64_t p = b0;
+    for ( ; p + 8 <= b1; p += 8 ) w.put( byte_at( p ), 8 );
+    for ( ; p < b1; ++p ) w.put( bit_at( p ), 1 );
+    w.put( BZ2_EOS_MAGIC, 48 );
+    w.put( crc, 32 );
+    w.flush();
+    return w.out;
+}
+
+static std::optional<std::string> bz2_decode_stream( std::string &in ) {
+    bz_stream strm{};
+    if ( BZ2_bzDecompressInit( &strm, 0, 0 ) != BZ_OK ) return std::nullopt;
+    std::string out;
+    out.resize( in.size() * 4 + ( 1 << 16 ) );
+    strm.next_in = in.data();
+    strm.avail_in = ( unsigned ) in.size();
+    size_t have = 0;
+    int rc = BZ_OK;
+    while ( rc == BZ_OK ) {
+        if ( have == out.size() ) out.resize( out.size() * 2 );
+        strm.next_out = out.data() + have;
+        strm.avail_out = ( unsigned ) std::min<size_t>( out.size() - have, 1u << 30 );
+        unsigned before = strm.avail_out;
+        rc = BZ2_bzDecompress( &strm );
+        have += before - strm.avail_out;
+        if ( rc == BZ_OK && strm.avail_in == 0 && before == strm.avail_out ) rc = BZ_UNEXPECTED_EOF;
+    }
+    BZ2_bzDecompressEnd( &strm );
+    if ( rc != BZ_STREAM_END ) return std::nullopt;
+    out.resize( have );
+    return out;
+}
+
+// 1 = decoded, 0 = not decodable this way (caller falls back to the serial decoder),
+// -1 = cancelled. Reads the input in slices, so memory stays at a slice plus the blocks in
+// flight rather than the whole file.
+static int decompress_bz2_parallel( const fs::path &bz2_file, const fs::path &out_file, std::atomic<bool> &cancel,
+    PhaseProgress *progress, const OutputOptions &output, ContentHasher *hash = nullptr ) {
+#ifdef _WIN32
+    FILE *in = _wfopen( bz2_file.wstring().c_str(), L"rb" );
+#else
+    FILE *in = fopen( bz2_file.string().c_str(), "rb" );
+#endif
+    if ( !in ) return 0;
+    OutputFile out;
+    if ( hash ) hash->reset();
+    out.set_hasher( hash );
+    if ( !out.open( out_file, false, output ) ) {
+        fclose( in );
+        return 0;
+    }
+
+    auto &pool = shared_pool();
+    const size_t max_in_flight = ( size_t ) std::max( 2, pool.size() * 2 );
+    const size_t slice = 8u << 20;
+
+    std::vector<unsigned char> win;
+    uint64_t win_base = 0;  // absolute byte offset of win[0]
+    size_t scanned = 0;     // bytes of win already scanned for magics
+    std::vector<Bz2Mark> marks;
+    std::deque<std::future<std::optional<std::string>>> in_flight;
+    long long counted_in = 0, counted_out = 0;
+    bool ok = true, eof = false, header_checked = false;
+
+    auto write_front = [ & ] {
+        auto f = std::move( in_flight.front() );
+        in_flight.pop_front();
+        pool.wait_helping( f, &in_flight );
+        auto block = f.get();
+        if ( !block ) return false;
+        if ( !out.write( block->data(), block->size() ) ) return false;
+        counted_out += ( long long ) block->size();
+        if ( progress ) progress->bytes_out.fetch_add( ( long long ) block->size(), std::memory_order_relaxed );
+        return true;
+        };
+
+    while ( ok && !eof && !cancel.load() ) {
+        size_t old = win.size();
+        win.resize( old + slice );
+        size_t n = fread( win.data() + old, 1, slice, in );
+        win.resize( old + n );
+        counted_in += ( long long ) n;
+        if ( progress ) progress->bytes.fetch_add( ( long long ) n, std::memory_order_relaxed );
+        if ( n < slice ) eof = true;
+
+        if ( !header_checked ) {
+            if ( win.size() < 4 || win[ 0 ] != 'B' || win[ 1 ] != 'Z' || win[ 2 ] != 'h' || win[ 3 ] < '1' || win[ 3 ] > '9' ) ok = false;
+            header_checked = true;
+        }
+
+        // A magic may straddle the slice end: keep the last 7 bytes for the next pass, and pad
+        // with zeros at EOF so they can be scanned too.
+        size_t data_end = win.size();
+        if ( eof ) win.resize( data_end + 8, 0 );
+        size_t scan_to = eof ? data_end : ( data_end >= 7 ? data_end - 7 : 0 );
+        if ( scan_to > scanned ) {
+            scan_bz2_marks( win.data(), scanned, scan_to, win_base * 8, marks );
+            scanned = scan_to;
+        }
+        win.resize( data_end );
+
+        // Every block whose end is known is ready; the last mark stays as the next block's start.
+        size_t used = 0;
+        while ( ok && used + 1 < marks.size() ) {
+            const Bz2Mark a = marks[ used ], b = marks[ used + 1 ];
+            ++used;
+            if ( a.eos ) continue;
+            std::string stream = bz2_block_stream( win.data(), win_base * 8, a.bit, b.bit );
+            in_flight.push_back( pool.submit( [ s = std::move( stream ) ]() mutable { return bz2_decode_stream( s ); }, &in_flight ) );
+            while ( ok && in_flight.size() >= max_in_flight ) ok = write_front();
+        }
+        marks.erase( marks.begin(), marks.begin() + ( std::ptrdiff_t ) used );
+
+        // Drop input nobody refers to any more.
+        uint64_t keep_from = marks.empty() ? win_base + scanned : marks.front().bit / 8;
+        if ( keep_from > win_base ) {
+            size_t drop = ( size_t ) std::min<uint64_t>( keep_from - win_base, win.size() );
+            win.erase( win.begin(), win.begin() + ( std::ptrdiff_t ) drop );
+            win_base += drop;
+            scanned -= std::min( scanned, drop );
+        }
+    }
+
+    // A complete file ends with its end-of-stream marker; anything else (truncation, a magic
+    // pattern inside block data) is left to the serial decoder to diagnose.
+    if ( ok && !cancel.load() && ( marks.size() != 1 || !marks.front().eos ) ) ok = false;
+    while ( !in_flight.empty() ) {
+        if ( ok && !cancel.load() ) {
+            ok = write_front();
+            continue;
+        }
+        pool.wait_helping( in_flight.front(), &in_flight );
+        in_flight.pop_front();
+    }
+
+    fclose( in );
+    bool closed = out.close();
+    bool cancelled = cancel.load();
+    if ( !ok || !closed || cancelled ) {
+        std::error_code ec;
+        fs::remove( out_file, ec );
+        if ( progress ) {
+            progress->bytes.fetch_sub( counted_in, std::memory_order_relaxed );
+            progress->bytes_out.fetch_sub( counted_out, std::memory_order_relaxed );
+        }
+    }
+    if ( cancelled ) return -1;
+    return ok && closed ? 1 : 0;
+}
+
+// Extracts bz2_file to out_file, splitting large files across the shared pool. On a single
+// core the interleaved decoders only evict each other's tables, so that stays serial.
+// The output is written next to out_file and only renamed into place once it decoded
+// completely and matches one of the expected digests (if any); digest receives its hashes.
+bool decompress_bz2_to_file( const fs::path &bz2_file, const fs::path &out_file, int retries,
+    std::atomic<bool> &cancel, LiveLog &log, PhaseProgress *progress = nullptr, const OutputOptions &output = {},
+    const std::vector<MapDigest> *expect = nullptr, MapDigest *digest = nullptr ) {
+    TraceScope trace( "decompress_bz2" );
+    if ( trace.active() ) trace.args().detail = bz2_file.filename().string();
+    auto tmp = out_file;
+    tmp += ".unbz2.part";
+    ContentHasher hash;
+    bool ok = false;
+    std::error_code ec;
+    auto size = fs::file_size( bz2_file, ec );
+    if ( !ec && ( long long ) size >= BZ2_PARALLEL_MIN_BYTES && std::thread::hardware_concurrency() > 1 ) {
+        int rc = decompress_bz2_parallel( bz2_file, tmp, cancel, progress, output, &hash );
+        if ( rc < 0 ) return false;
+        ok = rc == 1;
+        if ( !ok ) log.pushf( "[BZ2] Block-parallel decode not possible for %s, using the serial decoder.", bz2_file.filename().string().c_str() );
+    }
+    if ( !ok ) ok = decompress_bz2_serial( bz2_file, tmp, retries, cancel, log, progress, output, &hash );
+    if ( !ok ) return false;
+
+    auto got = hash.finish();
+    if ( !digest_accepted( expect, got ) ) {
+        // Decoding the same .bz2 again gives the same bytes, so this is not retried here.
+        log.failf( "[BZ2] Content does not match the source manifest: %s (%lld bytes, sha256 %.12s...)",
+            out_file.filename().string().c_str(), got.size, got.sha256.c_str() );
+        fs::remove( tmp, ec );
+        return false;
+    }
+    commit_part( tmp, out_file, output.fsync );
+    if ( digest ) *digest = std::move( got );
+    return true;
+}
+
+static void reset_phase( PhaseProgress &p ) {
+    p.running.store( false );
+    p.done.store( 0 );
+    p.total.store( 0 );
+    p.bytes.store( 0, std::memory_order_relaxed );
+    p.bytes_total.store( 0, std::memory_order_relaxed );
+    p.bytes_out.store( 0, std::memory_order_relaxed );
+    p.sized.store( 0, std::memory_order_relaxed );
+}
+
+static void reset_phases( RunState &rs ) {
+    reset_phase( rs.indexing );
+    reset_phase( rs.downloading );
+    reset_phase( rs.decompressing );
+    reset_phase( rs.deleting );
+}
+
+void MapIndex::reset( size_t sources ) {
+    words_ = std::max<size_t>( 1, ( sources + 63 ) / 64 );
+    for ( auto &sh : shards_ ) {
+        std::lock_guard lk( sh.mtx );
+        sh.arena.clear();
+        sh.entries.clear();
+        sh.bits.clear();
+        sh.slots.assign( 256, 0 );
+        sh.placed.clear();
+    }
+    dirs_.clear();
+    names_.clear();
+    entries_.clear();
+    bits_.clear();
+    slots_.clear();
+}
+
+uint32_t MapIndex::intern( std::string &arena, std::vector<Entry> &entries, std::vector<uint32_t> &slots,
+    std::vector<uint64_t> &bits, size_t words, std::string_view name, uint64_t hash ) {
+    if ( slots.empty() || ( entries.size() + 1 ) * 4 > slots.size() * 3 ) {
+        slots.assign( std::max<size_t>( 256, slots.size() * 2 ), 0 );
+        size_t mask = slots.size() - 1;
+        for ( size_t i = 0; i < entries.size(); ++i ) {
+            size_t j = entries[ i ].hash & mask;
+            while ( slots[ j ] ) j = ( j + 1 ) & mask;
+            slots[ j ] = ( uint32_t ) i + 1;
+        }
+    }
+
+    size_t mask = slots.size() - 1;
+    for ( size_t j = hash & mask;; j = ( j + 1 ) & mask ) {
+        uint32_t s = slots[ j ];
+        if ( !s ) {
+            entries.push_back( { ( uint32_t ) arena.size(), ( uint32_t ) name.size(), hash } );
+            arena.append( name );
+            bits.resize( bits.size() + words, 0 );
+            slots[ j ] = ( uint32_t ) entries.size();
+            return ( uint32_t ) entries.size() - 1;
+        }
+        const Entry &e = entries[ s - 1 ];
+        if ( e.hash == hash && std::string_view( arena.data() + e.off, e.len ) == name ) return s - 1;
+    }
+}
+
+void MapIndex::add( int source, const std::vector<std::string> &links, std::string_view base ) {
+    struct Pending {
+        std::string_view key;
+        uint64_t hash;
+        MapVariant variant;
+        std::string_view dir;
+    };
+    // Group by shard first so each shard lock is taken once per listing, not once per link.
+    std::array<std::vector<Pending>, SHARDS> batches;
+    for ( auto &u : links ) {
+        std::string_view name( u );
+        std::string_view dir;
+        if ( auto slash = name.find_last_of( '/' ); slash != std::string_view::npos ) {
+            if ( !base.empty() && name.starts_with( base ) && slash + 1 > base.size() )
+                dir = name.substr( base.size(), slash + 1 - base.size() );
+            name.remove_prefix( slash + 1 );
+        }
+        auto key = map_key( name );
+        if ( key.empty() ) continue;
+        uint64_t h = fnv1a( key );
+        batches[ h >> 60 ].push_back( { key, h, key.size() < name.size() ? MapVariant::Bz2 : MapVariant::Plain, dir } );
+    }
+
+    uint64_t bit = 1ull << ( source % 64 );
+    size_t word = ( size_t ) source / 64;
+    for ( int k = 0; k < SHARDS; ++k ) {
+        if ( batches[ k ].empty() ) continue;
+        Shard &sh = shards_[ k ];
+        std::lock_guard lk( sh.mtx );
+        for ( auto &p : batches[ k ] ) {
+            uint32_t i = intern( sh.arena, sh.entries, sh.slots, sh.bits, stride(), p.key, p.hash );
+            sh.bits[ ( size_t ) i * stride() + ( size_t ) p.variant * words_ + word ] |= bit;
+            if ( !p.dir.empty() ) {
+                sh.placed.push_back( { i, ( uint32_t ) source * 2 + ( uint32_t ) p.variant, ( uint32_t ) sh.arena.size(), ( uint32_t ) p.dir.size() } );
+                sh.arena.append( p.dir );
+            }
+        }
+    }
+}
+
+void MapIndex::finalize() {
+    std::vector<std::pair<int, uint32_t>> order;
+    size_t arena_bytes = 0;
+    for ( int k = 0; k < SHARDS; ++k ) {
+        for ( uint32_t i = 0; i < ( uint32_t ) shards_[ k ].entries.size(); ++i ) order.emplace_back( k, i );
+        arena_bytes += shards_[ k ].arena.size();
+    }
+    auto view = [ this ]( const std::pair<int, uint32_t> &r ) {
+        const Shard &sh = shards_[ r.first ];
+        const Entry &e = sh.entries[ r.second ];
+        return std::string_view( sh.arena.data() + e.off, e.len );
+        };
+    std::sort( order.begin(), order.end(), [ & ]( auto &a, auto &b ) { return view( a ) < view( b ); } );
+
+    names_.clear();
+    names_.reserve( arena_bytes );
+    entries_.clear();
+    entries_.reserve( order.size() );
+    bits_.assign( order.size() * stride(), 0 );
+    std::array<std::vector<uint32_t>, SHARDS> ids;
+    for ( int k = 0; k < SHARDS; ++k ) ids[ k ].resize( shards_[ k ].entries.size() );
+    for ( auto &r : order ) {
+        const Shard &sh = shards_[ r.first ];
+        const Entry &e = sh.entries[ r.second ];
+        ids[ r.first ][ r.second ] = ( uint32_t ) entries_.size();
+        std::copy_n( sh.bits.data() + ( size_t ) r.second * stride(), stride(), bits_.data() + entries_.size() * stride() );
+        entries_.push_back( { ( uint32_t ) names_.size(), e.len, e.hash } );
+        names_.append( sh.arena, e.off, e.len );
+    }
+
+    dirs_.clear();
+    for ( int k = 0; k < SHARDS; ++k ) {
+        for ( auto &p : shards_[ k ].placed ) {
+            uint64_t key = ( uint64_t ) ids[ k ][ p.entry ] << 32 | p.slot;
+            dirs_[ key ] = { ( uint32_t ) names_.size(), p.len };
+            names_.append( shards_[ k ].arena, p.off, p.len );
+        }
+    }
+
+    size_t cap = 256;
+    while ( cap * 3 < entries_.size() * 4 + 4 ) cap *= 2;
+    slots_.assign( cap, 0 );
+    for ( size_t i = 0; i < entries_.size(); ++i ) {
+        size_t j = entries_[ i ].hash & ( cap - 1 );
+        while ( slots_[ j ] ) j = ( j + 1 ) & ( cap - 1 );
+        slots_[ j ] = ( uint32_t ) i + 1;
+    }
+
+    for ( auto &sh : shards_ ) {
+        std::lock_guard lk( sh.mtx );
+        sh.arena = {};
+        sh.entries = {};
+        sh.bits = {};
+        sh.slots = {};
+        sh.placed = {};
+    }
+}
+
+std::string_view MapIndex::dir( uint32_t id, int source, MapVariant v ) const {
+    if ( dirs_.empty() ) return {};
+    auto it = dirs_.find( ( uint64_t ) id << 32 | ( ( uint32_t ) source * 2 + ( uint32_t ) v ) );
+    if ( it == dirs_.end() ) return {};
+    return { names_.data() + it->second.first, it->second.second };
+}
+
+std::optional<uint32_t> MapIndex::find( std::string_view name ) const {
+    if ( slots_.empty() ) return std::nullopt;
+    uint64_t h = fnv1a( name );
+    size_t mask = slots_.size() - 1;
+    for ( size_t j = h & mask;; j = ( j + 1 ) & mask ) {
+        uint32_t s = slots_[ j ];
+        if ( !s ) return std::nullopt;
+        const Entry &e = entries_[ s - 1 ];
+        if ( e.hash == h && std::string_view( names_.data() + e.off, e.len ) == name ) return s - 1;
+    }
+}
+
+// "scheme://host[:port]" of a source URL; mirrors on one host share its connection cap.
+static std::string url_host( const std::string &url ) {
+    auto p = url.find( "://" );
+    size_t from = p == std::string::npos ? 0 : p + 3;
+    auto slash = url.find( '/', from );
+    return lower_copy( url.substr( 0, slash ) );
+}
+
+// Chooses the mirror for each download from what the run has observed so far: a rolling
+// per-transfer throughput, a decaying error rate and the current load of each host. Hosts
+// start at the configured cap, lose a slot on every failure (or all but one when they fall
+// far behind the fastest host) and win slots back after a run of clean transfers. Until a
+// host has been measured in this run, the throughput and TTFB saved in sources.json stand in.
+class SourceScheduler {
+public:
+    // The sources' persisted stats are read here, once, as priors; the scheduler never reads
+    // or writes a SourceEntry's stats while downloads run (see flush_stats).
+    SourceScheduler( int per_host_limit, const std::vector<SourceEntry *> &sources ) : limit_( std::max( 1, per_host_limit ) ) {
+        for ( auto *src : sources ) {
+            auto [ h, fresh ] = hosts_.try_emplace( url_host( src->url ), limit_ );
+            if ( fresh ) {
+                h->second.prior_bps = src->stats.bps_ewma;
+                h->second.ttfb_ms = std::max( 0.0, src->stats.ttfb_ewma_ms );
+            }
+            by_source_.emplace( src, &h->second );
+        }
+    }
+
+    // Reserves a slot on the candidate host expected to finish a file of size_hint bytes
+    // first (TTFB plus the transfer at its throughput, shared with what it already runs),
+    // skipping already-tried sources while an untried one exists. Returns nullptr if every
+    // usable host is at its cap right now.
+    SourceEntry *acquire( const std::vector<SourceEntry *> &candidates, const std::vector<SourceEntry *> &tried, long long size_hint = -1 ) {
+        std::lock_guard lk( mtx_ );
+        bool any_untried = false, peer_untried = false;
+        for ( auto *c : candidates ) {
+            if ( std::find( tried.begin(), tried.end(), c ) != tried.end() ) continue;
+            any_untried = true;
+            peer_untried |= c->peer;
+        }
+
+        double fastest = fastest_bps( true );
+        double bytes = size_hint >= 0 ? ( double ) size_hint : typical_file_bytes();
+        SourceEntry *best = nullptr;
+        double best_cost = 0;
+        for ( auto *c : candidates ) {
+            if ( any_untried && std::find( tried.begin(), tried.end(), c ) != tried.end() ) continue;
+            // A LAN peer that has the map gets it even if that means waiting for a slot there.
+            if ( peer_untried && !c->peer ) continue;
+            auto &h = host( c );
+            if ( h.in_flight >= h.cap ) continue;
+            // Hosts with no history at all are assumed as fast as the best one so they get sampled early.
+            double bps = h.samples ? h.bps : h.prior_bps > 0 ? h.prior_bps : ( fastest > 0 ? fastest : 1e6 );
+            double seconds = h.ttfb_ms / 1000.0 + ( h.in_flight + 1 ) * bytes / std::max( bps, 1.0 );
+            double cost = ( 1.0 + 4.0 * h.err ) * seconds;
+            if ( !best || cost < best_cost ) { best = c; best_cost = cost; }
+        }
+        if ( best ) host( best ).in_flight++;
+        return best;
+    }
+
+    void release( SourceEntry *src, const DownloadResult &r ) {
+        std::lock_guard lk( mtx_ );
+        auto &h = host( src );
+        h.in_flight--;
+        if ( r.cancelled ) return;
+
+        h.bytes += r.bytes;
+        if ( r.ok ) {
+            h.files++;
+            if ( r.bytes > 0 && r.seconds > 0 ) {
+                double sample = ( double ) r.bytes / r.seconds;
+                h.bps = h.samples ? 0.7 * h.bps + 0.3 * sample : sample;
+                h.samples++;
+                throughput_.emplace_back( src, sample );
+            }
+            h.err *= 0.8;
+            if ( ++h.streak >= 4 && h.cap < limit_ ) { h.cap++; h.streak = 0; }
+        }
+        else {
+            h.errors++;
+            h.err = 0.8 * h.err + 0.2;
+            h.streak = 0;
+            h.cap = std::max( 1, h.cap - 1 );
+        }
+
+        double fastest = fastest_bps( false );
+        if ( h.samples >= 3 && fastest > 0 && h.bps < 0.25 * fastest ) h.cap = 1;
+    }
+
+    bool saturated( const std::vector<SourceEntry *> &all ) {
+        std::lock_guard lk( mtx_ );
+        for ( auto *c : all ) {
+            auto &h = host( c );
+            if ( h.in_flight < h.cap ) return false;
+        }
+        return true;
+    }
+
+    // Hands this run's throughput samples to the sources' stats; call once the downloads are done.
+    void flush_stats() {
+        std::lock_guard lk( mtx_ );
+        for ( auto &[ src, sample ] : throughput_ ) src->stats.add_throughput( sample );
+        throughput_.clear();
+    }
+
+    std::vector<std::string> summary() {
+        std::lock_guard lk( mtx_ );
+        std::vector<std::string> out;
+        for ( auto &[ name, h ] : hosts_ ) {
+            if ( !h.files && !h.errors ) continue;
+            char buf[ 512 ];
+            std::snprintf( buf, sizeof( buf ), "[i] %s: %d files, %.1f MB, %.2f MB/s per transfer, %d errors, cap %d/%d",
+                name.c_str(), h.files, h.bytes / 1048576.0, h.bps / 1048576.0, h.errors, h.cap, limit_ );
+            out.push_back( buf );
+        }
+        return out;
+    }
+
+private:
+    struct HostStats {
+        explicit HostStats( int limit ) : cap( limit ) {}
+        int in_flight = 0;
+        int cap = 1;
+        double bps = 0;
+        int samples = 0;
+        double prior_bps = -1;  // from sources.json, used until samples > 0
+        double ttfb_ms = 0;
+        double err = 0;
+        int streak = 0;
+        int files = 0;
+        int errors = 0;
+        long long bytes = 0;
+    };
+
+    HostStats &host( SourceEntry *src ) {
+        auto it = by_source_.find( src );
+        if ( it != by_source_.end() ) return *it->second;
+        // A source the constructor was not given runs without priors.
+        auto h = hosts_.try_emplace( url_host( src->url ), limit_ ).first;
+        by_source_.emplace( src, &h->second );
+        return h->second;
+    }
+
+    double fastest_bps( bool with_priors ) const {
+        double best = 0;
+        for ( auto &[ name, h ] : hosts_ ) {
+            if ( h.samples ) best = std::max( best, h.bps );
+            else if ( with_priors ) best = std::max( best, h.prior_bps );
+        }
+        return best;
+    }
+
+    // Mean size of the files finished so far; 1 MiB before the first one.
+    double typical_file_bytes() const {
+        long long bytes = 0;
+        int files = 0;
+        for ( auto &[ name, h ] : hosts_ ) {
+            bytes += h.bytes;
+            files += h.files;
+        }
+        return files ? ( double ) bytes / files : 1048576.0;
+    }
+
+    std::mutex mtx_;
+    int limit_;
+    std::map<std::string, HostStats> hosts_;
+    std::unordered_map<SourceEntry *, HostStats *> by_source_;
+    std::vector<std::pair<SourceEntry *, double>> throughput_;
+};
+
+// The last successful response of every listing URL: its validators for a conditional
+// request, and its links as the snapshot the next run's listing is diffed against.
+struct IndexCacheEntry {
+    std::string etag;
+    std::string last_modified;
+    std::vector<std::string> links;
+    // Row fingerprints, parallel to links (see ListingParser); empty in older caches.
+    std::vector<uint64_t> sigs;
+    // Child listings found by the crawl, so a 304 can still fan out.
+    std::vector<std::string> subdirs;
+    // manifest.json entries only: the body, parsed again on a 304.
+    std::string body;
+};
+
+using IndexCache = std::unordered_map<std::string, IndexCacheEntry>;
+
+// Bumped when ListingParser fingerprints rows differently; older sigs are dropped rather than
+// read as every map having changed.
+static constexpr int kRowSigVersion = 2;
+
+// Maps a source replaced that are still to be fetched again, with the listing URLs of the
+// sources that have the new copy. Kept in the index cache until a download succeeds, so an
+// index-only, cancelled or failed run does not lose the change.
+using PendingRefetch = std::map<std::string, std::vector<std::string>, std::less<>>;
+
+fs::path index_cache_path( const fs::path &data ) { return data / "index_cache.cbor"; }
+
+static IndexCache load_index_cache( const fs::path &data, PendingRefetch &refetch, LiveLog &log ) {
+    IndexCache cache;
+    refetch.clear();
+    auto p = index_cache_path( data );
+    if ( !fs::exists( p ) ) return cache;
+    try {
+        std::ifstream f( p, std::ios::binary );
+        std::vector<std::uint8_t> bytes( ( std::istreambuf_iterator<char>( f ) ), std::istreambuf_iterator<char>() );
+        auto j = json::from_cbor( bytes );
+        auto srcs = j.value( "sources", json::object() );
+        bool sigs_current = j.value( "sig_version", 1 ) == kRowSigVersion;
+        for ( auto &[url, it] : srcs.items() ) {
+            IndexCacheEntry e;
+            e.etag = it.value( "etag", "" );
+            e.last_modified = it.value( "last_modified", "" );
+            e.links = it.value( "links", std::vector<std::string>{} );
+            e.sigs = it.value( "sigs", std::vector<uint64_t>{} );
+            if ( !sigs_current || e.sigs.size() != e.links.size() ) e.sigs.clear();
+            e.subdirs = it.value( "subdirs", std::vector<std::string>{} );
+            e.body = it.value( "body", "" );
+            cache.emplace( url, std::move( e ) );
+        }
+        auto pending = j.value( "refetch", json::object() );
+        for ( auto &[name, urls] : pending.items() )
+            refetch.emplace( name, urls.get<std::vector<std::string>>() );
+    }
+    catch ( ... ) {
+        log.push( "[!] Failed to parse index_cache.cbor (full re-index)." );
+        cache.clear();
+        refetch.clear();
+    }
+    return cache;
+}
+
+static void save_index_cache( const fs::path &data, const IndexCache &cache, const PendingRefetch &refetch, LiveLog &log ) {
+    json j;
+    j[ "sig_version" ] = kRowSigVersion;
+    j[ "sources" ] = json::object();
+    for ( auto &[url, e] : cache ) {
+        json it;
+        it[ "etag" ] = e.etag;
+        it[ "last_modified" ] = e.last_modified;
+        it[ "links" ] = e.links;
+        if ( !e.sigs.empty() ) it[ "sigs" ] = e.sigs;
+        if ( !e.subdirs.empty() ) it[ "subdirs" ] = e.subdirs;
+        if ( !e.body.empty() ) it[ "body" ] = e.body;
+        j[ "sources" ][ url ] = std::move( it );
+    }
+    if ( !refetch.empty() ) j[ "refetch" ] = refetch;
+    try {
+        auto bytes = json::to_cbor( j );
+        std::ofstream f( index_cache_path( data ), std::ios::binary );
+        f.write( ( const char * ) bytes.data(), ( std::streamsize ) bytes.size() );
+    }
+    catch ( ... ) {
+        log.push( "[!] Failed to write index_cache.cbor" );
+    }
+}
+
+// Digests of the maps this tool wrote into download/maps, keyed by map name, so a later run
+// can tell a map that changed on disk from one that is as it was downloaded. Sources may
+// publish the same format as manifest.json next to their maps; downloads from a source are
+// then checked against it.
+struct ManifestEntry {
+    MapDigest digest;
+    std::int64_t mtime = 0;
+};
+
+using Manifest = std::unordered_map<std::string, ManifestEntry>;
+
+fs::path manifest_path( const fs::path &data ) { return data / "manifest.json"; }
+
+static json digest_json( const ManifestEntry &e ) {
+    char crc[ 9 ] = "";
+    if ( e.digest.crc32 ) std::snprintf( crc, sizeof( crc ), "%08x", *e.digest.crc32 );
+    return { { "size", e.digest.size }, { "crc32", crc }, { "sha256", e.digest.sha256 }, { "mtime", e.mtime } };
+}
+
+static ManifestEntry digest_from_json( const json &j ) {
+    ManifestEntry e;
+    e.digest.size = j.value( "size", -1LL );
+    auto crc = j.value( "crc32", std::string() );
+    if ( crc.size() == 8 ) e.digest.crc32 = ( uint32_t ) std::strtoul( crc.c_str(), nullptr, 16 );
+    e.digest.sha256 = lower_copy( j.value( "sha256", std::string() ) );
+    e.mtime = j.value( "mtime", ( std::int64_t ) 0 );
+    return e;
+}
+
+// Throws on malformed input; {"maps": {"dm_x.bsp": {"size", "crc32", "sha256", "mtime"}}}.
+static Manifest parse_manifest( std::string_view text ) {
+    Manifest m;
+    auto j = json::parse( text );
+    for ( auto &[name, it] : j.at( "maps" ).items() ) m.emplace( std::string( map_key( name ) ), digest_from_json( it ) );
+    return m;
+}
+
+static Manifest load_manifest( const fs::path &data, LiveLog &log ) {
+    auto p = manifest_path( data );
+    if ( !fs::exists( p ) ) return {};
+    try {
+        std::ifstream f( p, std::ios::binary );
+        std::string text( ( std::istreambuf_iterator<char>( f ) ), std::istreambuf_iterator<char>() );
+        return parse_manifest( text );
+    }
+    catch ( ... ) {
+        log.push( "[!] Failed to parse manifest.json (starting a new one)." );
+        return {};
+    }
+}
+
+static void save_manifest( const fs::path &data, const Manifest &m, LiveLog &log ) {
+    json j;
+    j[ "version" ] = 1;
+    j[ "maps" ] = json::object();
+    for ( auto &[name, e] : m ) j[ "maps" ][ name ] = digest_json( e );
+    // Written aside and renamed, since --serve may hand the file to a peer at any moment.
+    auto tmp = manifest_path( data );
+    tmp += ".tmp";
+    try {
+        std::ofstream f( tmp, std::ios::binary );
+        f << j.dump( 1 );
+        f.close();
+        if ( !f ) throw std::runtime_error( "write" );
+    }
+    catch ( ... ) {
+        log.push( "[!] Failed to write manifest.json" );
+        return;
+    }
+    std::error_code ec;
+    fs::rename( tmp, manifest_path( data ), ec );
+    if ( ec ) log.push( "[!] Failed to write manifest.json: " + ec.message() );
+}
+
+// Reads a whole file through the hasher; nullopt if it cannot be read.
+static std::optional<MapDigest> hash_file( const fs::path &p ) {
+    std::ifstream f( p, std::ios::binary );
+    if ( !f ) return std::nullopt;
+    ContentHasher h;
+    std::vector<char> buf( 1 << 20 );
+    while ( f ) {
+        f.read( buf.data(), ( std::streamsize ) buf.size() );
+        h.update( buf.data(), ( size_t ) f.gcount() );
+    }
+    if ( f.bad() ) return std::nullopt;
+    return h.finish();
+}
+
+// State shared by the stages of one run. Each stage reads what the earlier ones produced
+// and fills in its own part; see make_stages() for the order.
+struct PipelineRun {
+    PipelineRun( const Settings &s, RunState &rs, LiveLog &log )
+        : s( s ), rs( rs ), log( log ), data( s.data_dir.empty() ? app_dir() : s.data_dir ) {}
+
+    Settings s;
+    RunState &rs;
+    LiveLog &log;
+    // Where the inventory, index cache and manifest live.
+    fs::path data;
+    bool index_only = false;
+
+    fs::path dl_dir;
+    std::vector<SourceEntry *> enabled;
+    std::unordered_map<SourceEntry *, std::atomic<long long> *> traffic;
+    int threads = 1;
+    std::unique_ptr<TransferEngine> engine;
+
+    // index
+    IndexCache cache;
+    bool cache_dirty = false;
+    std::mutex index_mtx;
+    std::condition_variable index_cv;
+    bool index_open = false;
+    int index_pending = 0;
+    // Per enabled source: listing URLs requested so far and what they turned up.
+    struct Crawl {
+        StringSet visited;
+        int requests = 0;
+        int pending = 0;
+        size_t files = 0;
+        bool capped = false;
+    };
+    std::vector<Crawl> crawl;
+    // Per enabled source: how its listings differ from the previous run's (the cache).
+    struct Delta {
+        int added = 0;
+        int removed = 0;
+        std::vector<std::string> changed;  // map names whose listing row moved
+        bool complete = true;              // no listing failed
+    };
+    std::vector<Delta> delta;
+    // Replaced maps not fetched again yet: loaded with the cache, extended by the index stage,
+    // trimmed by the plan and by successful downloads, and saved with the cache at the end.
+    PendingRefetch refetch;
+    bool refetch_dirty = false;
+    // The refetch entries as positions in enabled, for the sources still configured.
+    std::unordered_map<std::string, std::vector<int>> changed_on;
+    // Filled by the parse tasks as listings arrive; source ids are positions in enabled.
+    MapIndex maps;
+    // Digests from the sources' manifest.json files, by map name; written under index_mtx.
+    std::unordered_map<std::string, std::vector<MapDigest>> upstream;
+
+    // Local manifest: loaded and checked by the scan, extended as maps are written.
+    std::mutex manifest_mtx;
+    Manifest manifest;
+    bool manifest_dirty = false;
+
+    // plan
+    std::vector<std::string> to_get;
+
+    // probe: sizes the HEADs announced for planned maps, by name; missing when there was none.
+    std::unordered_map<std::string, long long> sizes;
+
+    // decompress
+    std::unique_ptr<BoundedQueue<fs::path>> bz_queue;
+    std::mutex bz_mtx;
+    std::vector<fs::path> bz2s;
+    std::vector<std::future<void>> bz_workers;
+
+    // Declared last so they are unregistered before the engine and queue they poke go away.
+    std::unique_ptr<ScopedCancelHook> engine_hook;
+    std::unique_ptr<ScopedCancelHook> bz_hook;
+};
+
+struct PipelineStage {
+    const char *name;
+    // Optional. Called right before the previous stage runs, for work that overlaps it:
+    // listing requests fly while the local scan runs, and extraction drains the fetch.
+    std::function<void( PipelineRun & )> open;
+    // Runs the stage, or waits for what open() started. false ends the run early.
+    std::function<bool( PipelineRun & )> run;
+};
+
+static const std::vector<MapDigest> *expected_digests( const PipelineRun &run, const std::string &name ) {
+    auto it = run.upstream.find( name );
+    return it == run.upstream.end() ? nullptr : &it->second;
+}
+
+// Adds a map that was just put in place to the local manifest.
+static void record_map( PipelineRun &run, const fs::path &bsp, MapDigest digest ) {
+    auto mtime = mtime_of( bsp );
+    std::lock_guard lk( run.manifest_mtx );
+    run.manifest[ bsp.filename().string() ] = ManifestEntry{ std::move( digest ), mtime };
+    run.manifest_dirty = true;
+}
+
+// Compares the manifest with download/maps. A size change means the file is damaged; a new
+// mtime (or --verify) costs a re-hash. Damaged maps are dropped from the inventory so the
+// plan fetches them again. Nothing is read for files that are as they were written.
+static void check_local_maps( PipelineRun &run ) {
+    auto &rs = run.rs;
+    auto &log = run.log;
+    auto dir = run.s.hl2mp_path / "download" / "maps";
+    auto base = run.s.hl2mp_path / "maps";
+
+    std::vector<std::string> damaged;
+    std::vector<std::pair<std::string, std::future<std::optional<MapDigest>>>> rehash;
+    for ( auto it = run.manifest.begin(); it != run.manifest.end(); ) {
+        auto p = dir / it->first;
+        std::error_code ec;
+        auto size = fs::file_size( p, ec );
+        if ( ec ) {
+            // Removed by the user; nothing left to vouch for.
+            it = run.manifest.erase( it );
+            run.manifest_dirty = true;
+            continue;
+        }
+        if ( ( long long ) size != it->second.digest.size ) damaged.push_back( it->first );
+        else if ( run.s.verify_local || mtime_of( p ) != it->second.mtime )
+            rehash.emplace_back( it->first, shared_pool().submit( [ p ] { return hash_file( p ); }, &rehash ) );
+        ++it;
+    }
+
+    for ( auto &[name, f] : rehash ) {
+        shared_pool().wait_helping( f, &rehash );
+        auto got = f.get();
+        auto &e = run.manifest[ name ];
+        if ( !got || !digest_matches( e.digest, *got ) ) {
+            damaged.push_back( name );
+            continue;
+        }
+        e.mtime = mtime_of( dir / name );
+        run.manifest_dirty = true;
+    }
+
+    for ( auto &name : damaged ) {
+        log.pushf( "[!] %s differs from the manifest, fetching it again.", name.c_str() );
+        run.manifest.erase( name );
+        run.manifest_dirty = true;
+        std::error_code ec;
+        if ( !fs::exists( base / name, ec ) ) rs.existing_files.erase( name );
+    }
+    if ( !rehash.empty() || !damaged.empty() )
+        log.pushf( "[i] Manifest: %zu map(s), %zu re-hashed, %zu damaged.", run.manifest.size(), rehash.size(), damaged.size() );
+}
+
+static bool stage_scan( PipelineRun &run ) {
+    scan_existing_maps( run.s.hl2mp_path, run.data, run.rs, run.log );
+    {
+        std::lock_guard lk( run.manifest_mtx );
+        run.manifest = load_manifest( run.data, run.log );
+        check_local_maps( run );
+    }
+    return true;
+}
+
+// A listing (or manifest) request that has been submitted but whose result is not merged
+// yet. The crawl only learns how many it needs as listings come in, so stage_index waits
+// for this count to drain instead of a fixed latch.
+static void index_task_begin( PipelineRun &run ) {
+    std::lock_guard lk( run.index_mtx );
+    run.index_pending++;
+}
+
+static void index_task_end( PipelineRun &run ) {
+    std::lock_guard lk( run.index_mtx );
+    if ( --run.index_pending == 0 ) run.index_cv.notify_all();
+}
+
+static void submit_listing( PipelineRun &run, int pos, std::string url, int depth, bool conditional = true );
+static void submit_manifest( PipelineRun &run, std::string url, bool conditional = true );
+
+static std::string_view link_map_name( std::string_view link ) {
+    return map_key( link.substr( link.rfind( '/' ) + 1 ) );
+}
+
+// Compares a listing with its previous response outside index_mtx, locking only to record.
+static void diff_listing( PipelineRun &run, int pos, const IndexCacheEntry &before,
+    const std::vector<std::string> &links, const std::vector<uint64_t> &sigs ) {
+    std::unordered_map<std::string_view, uint64_t> old;
+    old.reserve( before.links.size() );
+    for ( size_t i = 0; i < before.links.size(); ++i ) old.emplace( before.links[ i ], before.sigs.empty() ? 0 : before.sigs[ i ] );
+
+    int added = 0;
+    bool known = !before.sigs.empty() && !sigs.empty();
+    std::vector<std::string> changed;
+    for ( size_t i = 0; i < links.size(); ++i ) {
+        auto it = old.find( links[ i ] );
+        if ( it == old.end() ) { added++; continue; }
+        if ( known && it->second != sigs[ i ] ) changed.emplace_back( link_map_name( links[ i ] ) );
+        old.erase( it );
+    }
+    if ( !added && changed.empty() && old.empty() ) return;
+
+    std::lock_guard lk( run.index_mtx );
+    auto &d = run.delta[ pos ];
+    d.added += added;
+    d.removed += ( int ) old.size();
+    d.changed.insert( d.changed.end(), std::make_move_iterator( changed.begin() ), std::make_move_iterator( changed.end() ) );
+}
+
+// Merges one directory listing of source pos, already parsed as it arrived: the source's own
+// URL at depth 0, or a subdirectory the crawl found below it. Subdirectories are requested
+// from here, so a sharded mirror fans out over the engine as fast as its listings arrive.
+static void index_listing( PipelineRun &run, int pos, const std::string &url, int depth, bool conditional, HttpResult r,
+    ListingParser &parsed ) {
+    if ( run.rs.cancel.load() ) return;
+    TraceScope trace( "index_listing" );
+    if ( trace.active() ) {
+        // The scan itself ran in slices on the engine thread; it is reported as one total.
+        auto parse_us = std::chrono::duration_cast< std::chrono::microseconds >( parsed.parse_time ).count();
+        trace.args().detail = url;
+        trace.args().values = { { "links", ( long long ) parsed.links.size() }, { "parse_us", parse_us } };
+        if ( parse_us > 0 ) profiler().sample( "extract_links", parsed.parse_time );
+    }
+    // A 304 with nothing cached to reuse has no links in it; the listing is asked for again
+    // without validators, and a second 304 counts as a failure.
+    if ( r.err.empty() && r.status == 304 ) {
+        bool cached;
+        {
+            std::lock_guard lk( run.index_mtx );
+            cached = run.cache.contains( url );
+        }
+        if ( !cached && conditional ) {
+            submit_listing( run, pos, url, depth, false );
+            return;
+        }
+        if ( !cached ) r.err = "304 without a cached copy";
+    }
+    SourceEntry *src = run.enabled[ pos ];
+    int ms = r.latency_ms;
+    bool ok = r.err.empty() && r.status >= 200 && r.status < 400;
+    bool crawl = depth < run.s.crawl_depth;
+
+    if ( depth == 0 ) {
+        src->last_latency_ms = r.ttfb_ms >= 0 ? r.ttfb_ms : ms;
+        src->last_ok = ok;
+    }
+
+    parsed.finish();
+    std::vector<std::string> links, subdirs;
+    std::vector<uint64_t> sigs;
+    // The previous response of this listing, taken out of the cache to diff against below.
+    std::optional<IndexCacheEntry> before;
+    {
+        std::lock_guard lk( run.index_mtx );
+        auto &cache = run.cache;
+        auto &c = run.crawl[ pos ];
+        if ( ok && r.ttfb_ms >= 0 ) src->stats.add_ttfb( r.ttfb_ms );
+        auto cached = cache.find( url );
+        if ( ok && r.status == 304 && cached != cache.end() ) {
+            links = cached->second.links;
+            subdirs = cached->second.subdirs;
+            // Cached before subdirectories were held to map names.
+            if ( depth > 0 ) std::erase_if( links, []( const std::string &l ) { return !is_bsp_href( l ); } );
+            if ( depth == 0 ) run.log.pushf( "[=] %s -> %zu file(s) (unchanged, %dms)", url.c_str(), links.size(), ms );
+        }
+        else if ( ok ) {
+            links = std::move( parsed.links );
+            subdirs = std::move( parsed.dirs );
+            if ( depth == 0 && subdirs.empty() ) run.log.pushf( "[+] %s -> %zu file(s) (%dms)", url.c_str(), links.size(), ms );
+            else if ( depth == 0 )
+                run.log.pushf( "[+] %s -> %zu file(s), %zu subdir(s) (%dms)", url.c_str(), links.size(), subdirs.size(), ms );
+            // Kept without validators too: the next run diffs against it even if it cannot ask for a 304.
+            if ( cached != cache.end() ) before = std::move( cached->second );
+            sigs = std::move( parsed.sigs );
+            cache[ url ] = IndexCacheEntry{ r.etag, r.last_modified, links, sigs, subdirs, {} };
+            run.cache_dirty = true;
+        }
+        else {
+            run.delta[ pos ].complete = false;
+            if ( r.err.empty() ) run.log.failf( "[IDX] %s failed (HTTP %ld)", url.c_str(), r.status );
+            else run.log.failf( "[IDX] %s failed (%s)", url.c_str(), r.err.c_str() );
+        }
+
+        c.files += links.size();
+        if ( !crawl ) subdirs.clear();
+        // Keep only what this source has not asked for yet and still has budget for.
+        std::erase_if( subdirs, [ & ]( const std::string &d ) {
+            if ( c.visited.contains( d ) ) return true;
+            if ( c.requests >= run.s.crawl_max_requests ) {
+                c.capped = true;
+                return true;
+            }
+            c.visited.insert( d );
+            c.requests++;
+            return false;
+            } );
+        c.pending += ( int ) subdirs.size() - 1;
+        if ( c.pending == 0 && c.requests > 1 ) {
+            run.log.pushf( "[+] %s -> %zu file(s) across %d listing(s)", src->url.c_str(), c.files, c.requests );
+            if ( c.capped ) run.log.pushf( "[!] %s: crawl stopped at %d listing(s) (crawl_max_requests).", src->url.c_str(), c.requests );
+        }
+    }
+
+    if ( before ) diff_listing( run, pos, *before, links, sigs );
+
+    // Interning only takes the shard locks, so listings from other sources merge concurrently.
+    run.maps.add( pos, links, src->url );
+    run.rs.indexing.total.fetch_add( ( int ) subdirs.size() );
+    for ( auto &d : subdirs ) submit_listing( run, pos, std::move( d ), depth + 1 );
+    run.rs.indexing.done.fetch_add( 1 );
+}
+
+// Sources with cached validators are asked conditionally; a 304 reuses the cached links
+// (and subdirectories) without re-parsing anything. Parsing runs on the shared pool.
+// Makes t conditional on the cached response of its URL, if there is one.
+static void add_cache_validators( PipelineRun &run, Transfer &t ) {
+    std::lock_guard lk( run.index_mtx );
+    if ( auto it = run.cache.find( t.url ); it != run.cache.end() ) {
+        if ( !it->second.etag.empty() ) t.headers.push_back( "If-None-Match: " + it->second.etag );
+        if ( !it->second.last_modified.empty() ) t.headers.push_back( "If-Modified-Since: " + it->second.last_modified );
+    }
+}
+
+// Unconditional requests also bypass intermediate caches, which may answer 304 on their own.
+static void submit_listing( PipelineRun &run, int pos, std::string url, int depth, bool conditional ) {
+    Transfer t;
+    t.url = url;
+    t.timeout_ms = run.s.index_timeout_ms;
+    t.rate_group = url_host( url );
+    t.trace_name = "listing";
+    if ( conditional ) add_cache_validators( run, t );
+    else t.headers.push_back( "Cache-Control: no-cache" );
+    index_task_begin( run );
+    // The listing is parsed on the engine thread as it arrives (a 304 has no body to feed),
+    // leaving only the merge for the pool.
+    auto parser = std::make_shared<ListingParser>( url, depth < run.s.crawl_depth, depth > 0 );
+    t.on_data = [ parser ]( const char *p, size_t n ) {
+        if ( !profiler().enabled() ) {
+            parser->feed( std::string_view( p, n ) );
+            return true;
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        parser->feed( std::string_view( p, n ) );
+        parser->parse_time += std::chrono::steady_clock::now() - t0;
+        return true;
+        };
+    // Every transfer ends in on_done (cancelled ones included), so the count always drains.
+    t.on_done = [ &run, pos, url = std::move( url ), depth, conditional, parser ]( HttpResult r ) {
+        shared_pool().submit( [ &run, pos, url, depth, conditional, parser, r = std::move( r ) ]() mutable {
+            index_listing( run, pos, url, depth, conditional, std::move( r ), *parser );
+            index_task_end( run );
+            } );
+        };
+    run.engine->submit( std::move( t ) );
+}
+
+// Most mirrors have no manifest.json; only one that is there but unreadable is worth a line.
+// It is cached like a listing, so an unchanged manifest costs a 304 instead of its body.
+static void upstream_manifest_one( PipelineRun &run, const std::string &url, bool conditional, HttpResult r ) {
+    if ( run.rs.cancel.load() || !r.err.empty() ) return;
+    if ( r.status == 304 ) {
+        {
+            std::lock_guard lk( run.index_mtx );
+            auto it = run.cache.find( url );
+            if ( it != run.cache.end() && !it->second.body.empty() ) r.body = it->second.body;
+        }
+        // Nothing cached to reuse: ask once more without validators.
+        if ( r.body.empty() ) {
+            if ( conditional ) submit_manifest( run, url, false );
+            return;
+        }
+    }
+    else if ( r.status != 200 ) return;
+    Manifest m;
+    try {
+        m = parse_manifest( r.body );
+    }
+    catch ( ... ) {
+        run.log.pushf( "[!] Ignoring unreadable %s", url.c_str() );
+        return;
+    }
+    std::lock_guard lk( run.index_mtx );
+    if ( r.status == 200 && ( !r.etag.empty() || !r.last_modified.empty() ) ) {
+        IndexCacheEntry e;
+        e.etag = r.etag;
+        e.last_modified = r.last_modified;
+        e.body = std::move( r.body );
+        run.cache[ url ] = std::move( e );
+        run.cache_dirty = true;
+    }
+    for ( auto &[name, e] : m ) {
+        auto &v = run.upstream[ name ];
+        bool known = std::any_of( v.begin(), v.end(), [ & ]( const MapDigest &d ) {
+            return d.size == e.digest.size && d.crc32 == e.digest.crc32 && d.sha256 == e.digest.sha256;
+            } );
+        if ( !known ) v.push_back( std::move( e.digest ) );
+    }
+    run.log.pushf( "[+] %s -> %zu digest(s)", url.c_str(), m.size() );
+}
+
+static void submit_manifest( PipelineRun &run, std::string url, bool conditional ) {
+    Transfer t;
+    t.url = std::move( url );
+    t.timeout_ms = run.s.index_timeout_ms;
+    t.trace_name = "manifest";
+    if ( conditional ) add_cache_validators( run, t );
+    else t.headers.push_back( "Cache-Control: no-cache" );
+    index_task_begin( run );
+    t.on_done = [ &run, url = t.url, conditional ]( HttpResult r ) {
+        shared_pool().submit( [ &run, url, conditional, r = std::move( r ) ]() mutable {
+            upstream_manifest_one( run, url, conditional, std::move( r ) );
+            index_task_end( run );
+            } );
+        };
+    run.engine->submit( std::move( t ) );
+}
+
+// GETs every enabled source's listing (and manifest.json) on the engine; the crawl then
+// follows subdirectories up to crawl_depth levels down, at most crawl_max_requests listings
+// per source. Listings are parsed chunk by chunk while they download and merged on the
+// shared pool once complete.
+static void open_index( PipelineRun &run ) {
+    run.rs.indexing.running.store( true );
+    run.rs.indexing.done.store( 0 );
+    run.rs.indexing.total.store( ( int ) run.enabled.size() );
+    run.log.push( "[i] Indexing sources..." );
+
+    run.cache = load_index_cache( run.data, run.refetch, run.log );
+    run.crawl.assign( run.enabled.size(), {} );
+    run.delta.assign( run.enabled.size(), {} );
+    run.index_open = true;
+    for ( int pos = 0; pos < ( int ) run.enabled.size(); ++pos ) {
+        auto *src = run.enabled[ pos ];
+        {
+            std::lock_guard lk( run.index_mtx );
+            auto &c = run.crawl[ pos ];
+            c.visited.insert( src->url );
+            c.requests = 1;
+            c.pending = 1;
+        }
+        submit_listing( run, pos, src->url, 0 );
+        submit_manifest( run, url_join( src->url, "manifest.json" ) );
+    }
+}
+
+// Reports each source's changes since the previous run and adds the replaced maps to the
+// pending refetches. When nearly every row of a source changed at once, its listing format
+// changed (new server, new date style) rather than its maps, so those rows are not taken as
+// replaced maps.
+static void merge_deltas( PipelineRun &run ) {
+    for ( size_t pos = 0; pos < run.delta.size(); ++pos ) {
+        auto &d = run.delta[ pos ];
+        if ( !d.added && !d.removed && d.changed.empty() ) continue;
+        const char *url = run.enabled[ pos ]->url.c_str();
+        size_t common = run.crawl[ pos ].files - std::min( run.crawl[ pos ].files, ( size_t ) d.added );
+        run.log.pushf( "[i] %s since the last run: %d added, %d removed, %zu changed", url, d.added, d.removed, d.changed.size() );
+        if ( d.changed.size() > 10 && d.changed.size() * 2 > common ) {
+            run.log.pushf( "[!] %s: %zu of %zu rows changed at once; taken as a new listing format, not as replaced maps.",
+                url, d.changed.size(), common );
+            d.changed.clear();
+        }
+        for ( auto &name : d.changed ) {
+            auto &urls = run.refetch[ name ];
+            if ( std::find( urls.begin(), urls.end(), run.enabled[ pos ]->url ) == urls.end() ) urls.push_back( run.enabled[ pos ]->url );
+            run.refetch_dirty = true;
+        }
+    }
+    for ( auto &[ name, urls ] : run.refetch ) {
+        std::vector<int> on;
+        for ( int pos = 0; pos < ( int ) run.enabled.size(); ++pos )
+            if ( std::find( urls.begin(), urls.end(), run.enabled[ pos ]->url ) != urls.end() ) on.push_back( pos );
+        run.changed_on.emplace( name, std::move( on ) );
+    }
+}
+
+static bool stage_index( PipelineRun &run ) {
+    if ( !run.index_open ) return false;
+    {
+        std::unique_lock lk( run.index_mtx );
+        run.index_cv.wait( lk, [ &run ] { return run.index_pending == 0; } );
+    }
+
+    run.rs.indexing.running.store( false );
+    merge_deltas( run );
+    if ( run.cache_dirty || run.refetch_dirty ) save_index_cache( run.data, run.cache, run.refetch, run.log );
+    run.refetch_dirty = false;
+    return true;
+}
+
+// Whether a local map is our own download. Maps that came with the game or a server are left
+// alone; downloads from before the manifest existed count as ours when they are only in
+// download/maps.
+static bool downloaded_by_us( PipelineRun &run, std::string_view name ) {
+    std::string key( name );
+    {
+        std::lock_guard lk( run.manifest_mtx );
+        if ( run.manifest.contains( key ) ) return true;
+    }
+    std::error_code ec;
+    return fs::exists( run.s.hl2mp_path / "download" / "maps" / key, ec ) && !fs::exists( run.s.hl2mp_path / "maps" / key, ec );
+}
+
+// A map we already have is fetched again when a source replaced it since it was downloaded.
+static bool replaced_upstream( PipelineRun &run, std::string_view name ) {
+    return run.s.refetch_changed && run.refetch.contains( name ) && downloaded_by_us( run, name );
+}
+
+// Drops pending refetches the plan will never act on: maps no source lists any more (known
+// only when every listing was read) and maps that turned out not to be ours. Maps we do not
+// have at all stay until their download succeeds.
+static void trim_refetch( PipelineRun &run ) {
+    bool complete = true;
+    for ( size_t pos = 0; pos < run.enabled.size(); ++pos )
+        complete = complete && run.delta[ pos ].complete && !run.crawl[ pos ].capped;
+    std::erase_if( run.refetch, [ & ]( const auto &kv ) {
+        const std::string &name = kv.first;
+        bool drop = run.maps.find( name ) ? run.rs.existing_files.contains( name ) && !downloaded_by_us( run, name ) : complete;
+        if ( drop ) run.changed_on.erase( name );
+        run.refetch_dirty = run.refetch_dirty || drop;
+        return drop;
+        } );
+}
+
+// Filters are written against the names mirrors list, so a map passes when one of its listed
+// names does: dm_x.bsp if any source has it plain, dm_x.bsp.bz2 if any has it compressed.
+// scratch avoids an allocation per map for the .bz2 name.
+static bool map_passes( const FilterSet &filters, const MapIndex &maps, uint32_t id, std::string &scratch ) {
+    std::string_view key = maps.name( id );
+    bool plain = false, bz2 = false;
+    maps.for_each_source( id, MapVariant::Plain, [ & ]( int ) { plain = true; } );
+    maps.for_each_source( id, MapVariant::Bz2, [ & ]( int ) { bz2 = true; } );
+    if ( plain && filters.pass( key ) ) return true;
+    if ( !bz2 ) return false;
+    scratch.assign( key );
+    scratch += ".bz2";
+    return filters.pass( scratch );
+}
+
+static bool stage_plan( PipelineRun &run ) {
+    auto &rs = run.rs;
+    auto &log = run.log;
+    FilterSet filters( run.s.include_filters, run.s.exclude_filters );
+
+    run.maps.finalize();
+    trim_refetch( run );
+
+    int remote_unique = ( int ) run.maps.size();
+    int remote_after_filters = 0;
+    int already_have = 0;
+    int to_download = 0;
+    int replaced = 0;
+
+    run.to_get.clear();
+    run.to_get.reserve( run.maps.size() );
+
+    // Ids come out in name order, so to_get keeps the sorted order the std::map used to give.
+    std::string listed;
+    for ( uint32_t id = 0; id < ( uint32_t ) run.maps.size(); ++id ) {
+        std::string_view name = run.maps.name( id );
+        if ( !map_passes( filters, run.maps, id, listed ) ) continue;
+        remote_after_filters++;
+
+        if ( rs.existing_files.contains( name ) && replaced_upstream( run, name ) ) {
+            replaced++;
+            to_download++;
+            run.to_get.emplace_back( name );
+        }
+        else if ( rs.existing_files.contains( name ) ) already_have++;
+        else {
+            to_download++;
+            run.to_get.emplace_back( name );
+        }
+    }
+
+    rs.last_remote_unique.store( remote_unique );
+    rs.last_remote_after_filters.store( remote_after_filters );
+    rs.last_already_have.store( already_have );
+    rs.last_to_download.store( to_download );
+
+    if ( run.index_only ) log.push( "[i] Index complete." );
+    log.push( "[i] Remote unique files: " + std::to_string( remote_unique ) );
+    log.push( "[i] After filters: " + std::to_string( remote_after_filters ) );
+    log.push( "[i] Already present locally: " + std::to_string( already_have ) );
+    if ( replaced ) log.push( "[i] Replaced upstream since the last run: " + std::to_string( replaced ) );
+    if ( run.index_only ) log.push( "[i] Would download: " + std::to_string( to_download ) );
+    else log.push( "[i] Unique maps to download: " + std::to_string( to_download ) );
+    return true;
+}
+
+// HEADs every planned map through the engine, so the probes reuse the connections the
+// listings opened, then orders the plan by size. The sizes also go into the download totals
+// up front, so the ETA covers the whole run and not only the transfers already started.
+static bool stage_probe( PipelineRun &run ) {
+    auto &rs = run.rs;
+    auto &log = run.log;
+    auto t0 = std::chrono::steady_clock::now();
+
+    std::vector<std::future<HttpResult>> heads( run.to_get.size() );
+    std::vector<int> have;
+    for ( size_t i = 0; i < run.to_get.size(); ++i ) {
+        const auto &name = run.to_get[ i ];
+        auto id = run.maps.find( name );
+        if ( !id ) continue;
+        // Ask for the variant the fetch starts with, spread over the mirrors that have it.
+        auto variant = MapVariant::Bz2;
+        have.clear();
+        run.maps.for_each_source( *id, MapVariant::Bz2, [ & ]( int pos ) { have.push_back( pos ); } );
+        if ( have.empty() ) {
+            variant = MapVariant::Plain;
+            run.maps.for_each_source( *id, MapVariant::Plain, [ & ]( int pos ) { have.push_back( pos ); } );
+        }
+        if ( have.empty() ) continue;
+        int pos = have[ i % have.size() ];
+        auto path = std::string( run.maps.dir( *id, pos, variant ) ) + name + ( variant == MapVariant::Bz2 ? ".bz2" : "" );
+        heads[ i ] = http_head( *run.engine, url_join( run.enabled[ pos ]->url, path ), run.s.head_timeout_ms );
+    }
+
+    long long total = 0, largest = 0;
+    for ( size_t i = 0; i < heads.size(); ++i ) {
+        if ( !heads[ i ].valid() ) continue;
+        auto r = heads[ i ].get();
+        if ( !r.err.empty() || r.status < 200 || r.status >= 300 || r.content_length < 0 ) continue;
+        run.sizes[ run.to_get[ i ] ] = r.content_length;
+        total += r.content_length;
+        largest = std::max( largest, r.content_length );
+    }
+    if ( rs.cancel.load() ) return false;
+
+    rs.downloading.bytes_total.fetch_add( total, std::memory_order_relaxed );
+    rs.downloading.sized.fetch_add( ( int ) run.sizes.size(), std::memory_order_relaxed );
+
+    // Maps without a size keep their name order behind the sized ones.
+    if ( run.s.fetch_order != FetchOrder::Name ) {
+        bool big_first = run.s.fetch_order == FetchOrder::LargestFirst;
+        auto size_of = [ &run ]( const std::string &name ) {
+            auto it = run.sizes.find( name );
+            return it == run.sizes.end() ? -1LL : it->second;
+            };
+        std::stable_sort( run.to_get.begin(), run.to_get.end(), [ & ]( const std::string &a, const std::string &b ) {
+            long long sa = size_of( a ), sb = size_of( b );
+            if ( ( sa < 0 ) != ( sb < 0 ) ) return sb < 0;
+            return big_first ? sa > sb : sa < sb;
+            } );
+    }
+
+    auto ms = std::chrono::duration_cast< std::chrono::milliseconds >( std::chrono::steady_clock::now() - t0 ).count();
+    log.pushf( "[i] Probed %zu/%zu size(s): %.1f MB, largest %.1f MB, order %s (%lld ms)", run.sizes.size(), run.to_get.size(),
+        ( double ) total / ( 1024.0 * 1024.0 ), ( double ) largest / ( 1024.0 * 1024.0 ), fetch_order_name( run.s.fetch_order ),
+        ( long long ) ms );
+    return true;
+}
+
+// Adds a .bz2 of size bytes (-1 = unknown) to the extraction totals.
+static void count_bz2( RunState &rs, long long size ) {
+    rs.decompressing.total.fetch_add( 1 );
+    if ( size < 0 ) return;
+    rs.decompressing.bytes_total.fetch_add( size, std::memory_order_relaxed );
+    rs.decompressing.sized.fetch_add( 1, std::memory_order_relaxed );
+}
+
+// Takes back count_bz2() for a .bz2 the queue refused (it was closed by a cancel).
+static void uncount_bz2( RunState &rs, long long size ) {
+    rs.decompressing.total.fetch_sub( 1 );
+    if ( size < 0 ) return;
+    rs.decompressing.bytes_total.fetch_sub( size, std::memory_order_relaxed );
+    rs.decompressing.sized.fetch_sub( 1, std::memory_order_relaxed );
+}
+
+// Sources are picked when a slot frees up rather than all up front, so the choice reflects
+// what each mirror has delivered so far. Failed attempts go back in the queue and prefer a
+// mirror they have not tried yet.
+static bool stage_fetch( PipelineRun &run ) {
+    auto &s = run.s;
+    auto &rs = run.rs;
+    auto &log = run.log;
+    auto &engine = *run.engine;
+    int threads = run.threads;
+
+    rs.downloading.running.store( true );
+    rs.downloading.done.store( 0 );
+    rs.downloading.total.store( ( int ) run.to_get.size() );
+
+    struct PendingDownload {
+        std::string name;  // map key (the .bsp name)
+        std::string file;  // what the current attempt fetches: name or name + ".bz2"
+        std::string path;  // file relative to the chosen source's URL (sharded mirrors add a dir)
+        long long presized = -1;  // probed size still counted in the totals, handed to the next attempt
+        int attempt = 0;
+        std::vector<SourceEntry *> tried;
+        std::chrono::steady_clock::time_point ready_at{};
+    };
+    std::deque<PendingDownload> pending;
+    for ( auto &name : run.to_get ) {
+        PendingDownload p;
+        p.name = name;
+        if ( auto it = run.sizes.find( name ); it != run.sizes.end() ) p.presized = it->second;
+        // A replaced map comes from a source with the new copy first; the rest count as tried.
+        if ( auto c = run.changed_on.find( name ); c != run.changed_on.end() && !c->second.empty() ) {
+            for ( int pos = 0; pos < ( int ) run.enabled.size(); ++pos )
+                if ( std::find( c->second.begin(), c->second.end(), pos ) == c->second.end() ) p.tried.push_back( run.enabled[ pos ] );
+        }
+        pending.push_back( std::move( p ) );
+    }
+    if ( s.retries <= 0 ) {
+        for ( auto &p : pending ) log.failf( "[DL] Failed: %s (retries is 0)", p.name.c_str() );
+        rs.downloading.done.store( ( int ) pending.size() );
+        pending.clear();
+    }
+
+    SourceScheduler scheduler( s.per_source_connections, run.enabled );
+    std::mutex dl_mtx;
+    std::condition_variable dl_cv;
+    int dl_in_flight = 0;
+    // .bz2s that found the extraction queue full. Completions run on the engine thread, which
+    // must never block, so they park here and this thread does the blocking push.
+    std::deque<std::pair<fs::path, long long>> bz_spill;
+    ScopedCancelHook wake_dispatch( rs, [ & ] {
+        std::lock_guard lk( dl_mtx );
+        dl_cv.notify_all();
+        } );
+
+    auto on_downloaded = [ & ]( PendingDownload item, SourceEntry *src, fs::path out, const DownloadResult &r ) {
+        scheduler.release( src, r );
+        if ( r.ok && r.digest ) {
+            auto bsp = out;
+            if ( lower_copy( bsp.extension().string() ) == ".bz2" ) bsp.replace_extension( "" );
+            record_map( run, bsp, *r.digest );
+        }
+        bool queue_bz2 = r.ok && run.bz_queue && !s.stream_decompress && lower_copy( out.extension().string() ) == ".bz2";
+        // The whole file: a resumed download only transferred its tail.
+        long long bz2_size = r.bytes;
+        if ( queue_bz2 ) {
+            std::error_code ec;
+            auto sz = fs::file_size( out, ec );
+            if ( !ec ) bz2_size = ( long long ) sz;
+            count_bz2( rs, bz2_size );
+        }
+
+        std::lock_guard lk( dl_mtx );
+        if ( r.ok && run.refetch.erase( item.name ) ) run.refetch_dirty = true;
+        if ( queue_bz2 ) {
+            // Behind earlier spills so extraction keeps download order.
+            if ( !bz_spill.empty() || !run.bz_queue->try_push( out ) ) {
+                if ( run.bz_queue->closed() ) uncount_bz2( rs, bz2_size );
+                else bz_spill.emplace_back( out, bz2_size );
+            }
+        }
+        dl_in_flight--;
+        // The attempt settled the probed size either way; a retry counts what it is told.
+        item.presized = -1;
+        if ( !r.ok && !r.cancelled && item.attempt < s.retries ) {
+            if ( r.kept > 0 ) log.pushf( "[Retry %d/%d] %s (resuming at %lld)", item.attempt, s.retries, item.file.c_str(), r.kept );
+            else log.pushf( "[Retry %d/%d] %s", item.attempt, s.retries, item.file.c_str() );
+            item.tried.push_back( src );
+            item.ready_at = std::chrono::steady_clock::now() + std::chrono::milliseconds( 250 );
+            pending.push_back( std::move( item ) );
+        }
+        else {
+            if ( !r.ok && !r.cancelled )
+                log.failf( "[DL] Failed: %s (%s)", item.name.c_str(), url_join( src->url, item.path ).c_str() );
+            rs.downloading.done.fetch_add( 1 );
+        }
+        dl_cv.notify_one();
+        };
+
+    // Pushes the spilled .bz2s with dl_mtx released, so completions are never held up by it.
+    auto drain_spill = [ & ]( std::unique_lock<std::mutex> &lk ) {
+        while ( !bz_spill.empty() ) {
+            auto [ path, size ] = std::move( bz_spill.front() );
+            bz_spill.pop_front();
+            lk.unlock();
+            if ( !run.bz_queue->push( path ) ) uncount_bz2( rs, size );
+            lk.lock();
+        }
+        };
+
+    {
+        std::unique_lock lk( dl_mtx );
+        for ( ;; ) {
+            if ( rs.cancel.load() ) pending.clear();
+            drain_spill( lk );
+            if ( pending.empty() && dl_in_flight == 0 ) break;
+
+            auto now = std::chrono::steady_clock::now();
+            auto wake = std::chrono::steady_clock::time_point::max();
+            std::vector<std::pair<PendingDownload, SourceEntry *>> starting;
+            std::vector<SourceEntry *> srcs, plain;
+            for ( auto it = pending.begin(); it != pending.end() && dl_in_flight < threads; ) {
+                if ( it->ready_at > now ) {
+                    wake = std::min( wake, it->ready_at );
+                    ++it;
+                    continue;
+                }
+                // The .bz2 is the cheaper transfer, so plain copies are only used once every
+                // mirror with a .bz2 has been tried; a bad .bz2 then falls back to the .bsp.
+                srcs.clear();
+                plain.clear();
+                auto id = run.maps.find( it->name );
+                if ( id ) {
+                    run.maps.for_each_source( *id, MapVariant::Bz2, [ & ]( int pos ) { srcs.push_back( run.enabled[ pos ] ); } );
+                    run.maps.for_each_source( *id, MapVariant::Plain, [ & ]( int pos ) { plain.push_back( run.enabled[ pos ] ); } );
+                }
+                bool bz2_untried = std::any_of( srcs.begin(), srcs.end(), [ & ]( SourceEntry *c ) {
+                    return std::find( it->tried.begin(), it->tried.end(), c ) == it->tried.end();
+                    } );
+                bool use_plain = !bz2_untried && !plain.empty();
+                if ( use_plain ) srcs.swap( plain );
+                size_t compressed = use_plain ? 0 : srcs.size();
+                if ( srcs.empty() ) {
+                    log.failf( "[DL] No source for: %s", it->name.c_str() );
+                    if ( it->presized >= 0 ) {
+                        rs.downloading.bytes_total.fetch_sub( it->presized, std::memory_order_relaxed );
+                        rs.downloading.sized.fetch_sub( 1, std::memory_order_relaxed );
+                    }
+                    rs.downloading.done.fetch_add( 1 );
+                    it = pending.erase( it );
+                    continue;
+                }
+                auto *src = scheduler.acquire( srcs, it->tried, it->presized );
+                if ( !src ) {
+                    // Every mirror is at its cap; nothing further down the queue can start either.
+                    if ( scheduler.saturated( run.enabled ) ) break;
+                    ++it;
+                    continue;
+                }
+
+                auto bz2_end = srcs.begin() + ( std::ptrdiff_t ) compressed;
+                bool bz2 = std::find( srcs.begin(), bz2_end, src ) != bz2_end;
+                it->file = bz2 ? it->name + ".bz2" : it->name;
+                int pos = ( int ) ( std::find( run.enabled.begin(), run.enabled.end(), src ) - run.enabled.begin() );
+                it->path = std::string( run.maps.dir( *id, pos, bz2 ? MapVariant::Bz2 : MapVariant::Plain ) ) + it->file;
+                it->attempt++;
+                dl_in_flight++;
+                starting.emplace_back( std::move( *it ), src );
+                it = pending.erase( it );
+            }
+
+            // Woken by a completion or a cancel; the only timed wait is for a retry's backoff.
+            if ( starting.empty() && bz_spill.empty() ) {
+                if ( wake == std::chrono::steady_clock::time_point::max() ) dl_cv.wait( lk );
+                else dl_cv.wait_until( lk, wake );
+                continue;
+            }
+            // Completions re-enter on_downloaded (and may fire inline on cancel), so submit unlocked.
+            lk.unlock();
+            for ( auto &[ item, src ] : starting ) {
+                auto url = url_join( src->url, item.path );
+                auto out = run.dl_dir / item.file;
+                DownloadCounters counters{ &rs.downloading, run.traffic[ src ], &rs.decompressing, item.presized,
+                    url_host( src->url ) };
+                auto *expect = expected_digests( run, item.name );
+                download_file( engine, url, out, s, rs.cancel, log, counters,
+                    [ &, item = std::move( item ), src, out ]( const DownloadResult &r ) { on_downloaded( item, src, out, r ); }, expect );
+            }
+            lk.lock();
+        }
+    }
+    engine.wait_idle();
+    {
+        std::unique_lock lk( dl_mtx );
+        drain_spill( lk );
+    }
+    scheduler.flush_stats();
+    for ( auto &line : scheduler.summary() ) log.push( line );
+    rs.downloading.running.store( false );
+    return !rs.cancel.load();
+}
+
+// Extraction drains run on the shared pool and are fed as downloads land, so the network
+// and bz2 work overlap instead of running back to back.
+static void open_decompress( PipelineRun &run ) {
+    auto &s = run.s;
+    auto &rs = run.rs;
+    auto &log = run.log;
+
+    run.bz_queue = std::make_unique<BoundedQueue<fs::path>>( 256 );
+    run.bz_hook = std::make_unique<ScopedCancelHook>( rs, [ &run ] { run.bz_queue->close(); } );
+
+    int n = s.decompress_threads;
+    if ( n <= 0 ) n = std::max( 1, ( int ) std::thread::hardware_concurrency() );
+
+    rs.decompressing.running.store( true );
+    rs.decompressing.done.store( 0 );
+    rs.decompressing.total.store( 0 );
+
+    // Each drain holds a worker until the queue closes. Its own block decodes are helped
+    // along by wait_helping, but downloads finish on the pool too, so one worker stays free.
+    shared_pool().reserve( n + 1 );
+    for ( int i = 0; i < n; ++i ) {
+        run.bz_workers.push_back( shared_pool().submit( [ &run ] {
+            while ( auto bz2 = run.bz_queue->pop() ) {
+                if ( !run.rs.cancel.load() ) {
+                    auto out = *bz2;
+                    out.replace_extension( "" );
+                    MapDigest digest;
+                    if ( decompress_bz2_to_file( *bz2, out, run.s.retries, run.rs.cancel, run.log, &run.rs.decompressing,
+                        output_options( run.s ), expected_digests( run, out.filename().string() ), &digest ) ) {
+                        record_map( run, out, std::move( digest ) );
+                        std::lock_guard lk( run.bz_mtx );
+                        run.bz2s.push_back( *bz2 );
+                    }
+                }
+                run.rs.decompressing.done.fetch_add( 1 );
+            }
+            } ) );
+    }
+
+    // .bz2 files left over from earlier runs go first; fresh downloads join the queue later.
+    int leftovers = 0;
+    std::error_code ec;
+    for ( auto &e : fs::directory_iterator( run.dl_dir, ec ) ) {
+        if ( !e.is_regular_file() ) continue;
+        auto ext = lower_copy( e.path().extension().string() );
+        if ( ext != ".bz2" ) continue;
+        // A .bz2 whose .bsp is already there (streamed, or extracted by an earlier run) needs
+        // no second pass; extraction goes through a temporary, so an existing .bsp is complete.
+        auto bsp = e.path();
+        bsp.replace_extension( "" );
+        if ( fs::exists( bsp ) ) {
+            if ( s.delete_bz2 ) {
+                std::lock_guard lk( run.bz_mtx );
+                run.bz2s.push_back( e.path() );
+            }
+            continue;
+        }
+        std::error_code sec;
+        auto sz = fs::file_size( e.path(), sec );
+        long long size = sec ? -1 : ( long long ) sz;
+        count_bz2( rs, size );
+        if ( !run.bz_queue->push( e.path() ) ) {
+            uncount_bz2( rs, size );
+            break;
+        }
+        leftovers++;
+    }
+    log.push( "[i] Decompress workers: " + std::to_string( n ) + " (" + std::to_string( leftovers ) +
+        " existing .bz2 queued)" );
+}
+
+static bool stage_decompress( PipelineRun &run ) {
+    if ( !run.bz_queue ) return false;
+    run.bz_queue->close();
+    for ( auto &w : run.bz_workers ) w.get();
+    run.bz_workers.clear();
+    run.rs.decompressing.running.store( false );
+    return !run.rs.cancel.load();
+}
+
+// Removes .part files (and their .meta) left by earlier runs for maps this run no longer
+// plans to fetch: they were filtered out, dropped upstream or completed some other way, so
+// nothing would ever resume them. Parts of planned maps stay for the next attempt.
+static void sweep_stale_parts( PipelineRun &run ) {
+    std::unordered_set<std::string_view> planned( run.to_get.begin(), run.to_get.end() );
+    std::vector<fs::path> stale;
+    std::error_code ec;
+    for ( fs::directory_iterator it( run.dl_dir, ec ), end; !ec && it != end; it.increment( ec ) ) {
+        auto file = it->path().filename().string();
+        std::string_view name = file;
+        if ( ends_with_icase( name, ".meta" ) ) name.remove_suffix( 5 );
+        if ( !ends_with_icase( name, ".part" ) ) continue;
+        name.remove_suffix( 5 );
+        // The streamed extraction's output is <map>.bsp.unbz2.part.
+        if ( ends_with_icase( name, ".unbz2" ) ) name.remove_suffix( 6 );
+        if ( !planned.contains( map_key( name ) ) ) stale.push_back( it->path() );
     }
-    out.erase( std::unique( out.begin(), out.end() ), out.end() );
-    return out;
+    for ( auto &p : stale ) {
+        std::error_code rec;
+        fs::remove( p, rec );
+        if ( rec ) run.log.failf( "[DEL] %s -> %s", p.filename().string().c_str(), rec.message().c_str() );
+    }
+    if ( !stale.empty() ) run.log.pushf( "[i] Removed %zu abandoned partial download file(s).", stale.size() );
 }
 
-void scan_existing_maps( const fs::path &hl2mp, RunState &rs, LiveLog &log ) {
-    rs.existing_files.clear();
-    std::vector<fs::path> roots = {
-        hl2mp / "maps",
-        hl2mp / "download" / "maps"
-    };
-    for ( auto &root : roots ) {
-        if ( !fs::exists( root ) ) continue;
-        for ( auto &e : fs::recursive_directory_iterator( root ) ) {
-            if ( !e.is_regular_file() ) continue;
-            auto name = e.path().filename().string();
-            auto ext = lower_copy( e.path().extension().string() );
-            if ( ext == ".bsp" || ext == ".bz2" ) rs.existing_files.insert( name );
+static bool stage_cleanup( PipelineRun &run ) {
+    auto &rs = run.rs;
+    auto &log = run.log;
+
+    if ( run.s.decompress && run.s.delete_bz2 ) {
+        rs.deleting.running.store( true );
+        rs.deleting.done.store( 0 );
+        rs.deleting.total.store( ( int ) run.bz2s.size() );
+        log.push( "[i] Deleting .bz2 files..." );
+
+        for ( auto &bz2 : run.bz2s ) {
+            if ( rs.cancel.load() ) break;
+            std::error_code dec;
+            fs::remove( bz2, dec );
+            if ( dec ) log.failf( "[DEL] %s -> %s", bz2.filename().string().c_str(), dec.message().c_str() );
+            rs.deleting.done.fetch_add( 1 );
+        }
+        rs.deleting.running.store( false );
+    }
+
+    if ( !rs.cancel.load() ) sweep_stale_parts( run );
+    if ( !run.to_get.empty() || !run.bz2s.empty() ) refresh_inventory_dir( run.dl_dir, run.data, log );
+
+    log.push( "[i] Done." );
+    return true;
+}
+
+// Deletes or archives our downloads that no source lists any more (an index-only run just
+// counts them). The set is the manifest minus this run's listings, so a map dropped while a
+// run failed or prune was off is still caught later. Nothing is pruned unless every listing
+// of every source was read: a failed or capped crawl looks exactly like maps that went away.
+static bool stage_prune( PipelineRun &run ) {
+    auto &log = run.log;
+    if ( run.maps.size() == 0 ) return true;
+    for ( size_t pos = 0; pos < run.enabled.size(); ++pos ) {
+        if ( run.delta[ pos ].complete && !run.crawl[ pos ].capped ) continue;
+        log.pushf( "[i] Prune skipped: not every listing of %s was read.", run.enabled[ pos ]->url.c_str() );
+        return true;
+    }
+
+    std::vector<std::string> gone;
+    {
+        std::lock_guard lk( run.manifest_mtx );
+        for ( auto &[ name, entry ] : run.manifest )
+            if ( !run.maps.find( name ) ) gone.push_back( name );
+    }
+    std::sort( gone.begin(), gone.end() );
+    if ( gone.empty() ) return true;
+    if ( run.index_only ) {
+        log.pushf( "[i] Would prune: %zu map(s) no source lists any more.", gone.size() );
+        return true;
+    }
+
+    bool archive = run.s.prune == PruneMode::Archive;
+    auto archive_dir = run.s.hl2mp_path / "download" / "maps_pruned";
+    size_t pruned = 0;
+    for ( auto &name : gone ) {
+        if ( run.rs.cancel.load() ) break;
+        auto p = run.dl_dir / name;
+        std::error_code ec;
+        if ( archive ) {
+            fs::create_directories( archive_dir, ec );
+            if ( !ec ) fs::rename( p, archive_dir / name, ec );
+        }
+        else {
+            fs::remove( p, ec );
+        }
+        if ( ec ) {
+            log.failf( "[PRUNE] %s -> %s", name.c_str(), ec.message().c_str() );
+            continue;
+        }
+        // A kept .bz2 of the map goes too; it is the same map.
+        fs::remove( fs::path( p ) += ".bz2", ec );
+        {
+            std::lock_guard lk( run.manifest_mtx );
+            run.manifest.erase( name );
+            run.manifest_dirty = true;
         }
+        run.rs.existing_files.erase( name );
+        pruned++;
+        log.pushf( "[PRUNE] %s %s", name.c_str(), archive ? "moved to download/maps_pruned" : "deleted" );
     }
-    log.push( "[i] Existing map files found: " + std::to_string( rs.existing_files.size() ) );
+    if ( pruned ) {
+        log.pushf( "[i] Pruned %zu map(s) no source lists any more.", pruned );
+        refresh_inventory_dir( run.dl_dir, run.data, log );
+    }
+    return true;
 }
 
-static size_t curl_file_write_cb( void *ptr, size_t size, size_t nmemb, void *stream ) {
-    auto *f = ( FILE * ) stream;
-    return fwrite( ptr, size, nmemb, f );
+// scan -> index -> plan [-> prune], then (full runs only) fetch -> decompress -> cleanup.
+static std::vector<PipelineStage> make_stages( const Settings &s, bool index_only ) {
+    std::vector<PipelineStage> stages;
+    stages.push_back( { "scan", nullptr, stage_scan } );
+    stages.push_back( { "index", open_index, stage_index } );
+    stages.push_back( { "plan", nullptr, stage_plan } );
+    if ( s.prune != PruneMode::Off ) stages.push_back( { "prune", nullptr, stage_prune } );
+    if ( index_only ) return stages;
+
+    if ( s.probe_sizes || s.fetch_order != FetchOrder::Name ) stages.push_back( { "probe", nullptr, stage_probe } );
+    stages.push_back( { "fetch", nullptr, stage_fetch } );
+    if ( s.decompress ) stages.push_back( { "decompress", open_decompress, stage_decompress } );
+    stages.push_back( { "cleanup", nullptr, stage_cleanup } );
+    return stages;
 }
 
-bool download_file( const std::string &url, const fs::path &out_file, int timeout_ms, int retries,
-    std::atomic<bool> &cancel, LiveLog &log ) {
-    fs::create_directories( out_file.parent_path() );
+// Stops the profile of a run, writes it as logs/trace_<timestamp>.json and puts the per-span
+// summary in the log (and so the session log).
+static void finish_trace( LiveLog &log ) {
+    auto &p = profiler();
+    p.stop();
+    ensure_logs_dir( log );
+    auto path = timestamped_log_path( "trace", ".json" );
+    if ( p.write_chrome_trace( path ) ) log.push( "[i] Trace written to " + path.string() );
+    else log.push( "[!] Failed to write " + path.string() );
+    for ( auto &line : p.summary() ) log.push( line );
+}
 
-    auto tmp = out_file;
-    tmp += ".part";
+// Runs the stages in order. A stage's open() happens before its predecessor runs, and it is
+// still run (to drain) if the predecessor ends the pipeline. Times span open() to run().
+static bool run_stages( PipelineRun &run, const std::vector<PipelineStage> &stages ) {
+    using clock = std::chrono::steady_clock;
+    std::vector<clock::time_point> began( stages.size() );
+    std::vector<bool> opened( stages.size(), false );
+    std::string timings;
+
+    if ( run.s.trace ) {
+        profiler().start();
+        profiler().name_thread( "pipeline" );
+    }
 
-    for ( int attempt = 1; attempt <= retries && !cancel.load(); ++attempt ) {
-        if ( fs::exists( tmp ) ) { std::error_code ec; fs::remove( tmp, ec ); }
+    auto finish = [ & ]( size_t i ) {
+        if ( !opened[ i ] ) began[ i ] = clock::now();
+        run.rs.stage.store( stages[ i ].name );
+        bool ok = stages[ i ].run( run );
+        auto ended = clock::now();
+        // Stages overlap their predecessor from open() on, so they are async spans.
+        profiler().async( stages[ i ].name, profiler().next_id(), began[ i ], ended );
+        auto ms = std::chrono::duration_cast< std::chrono::milliseconds >( ended - began[ i ] ).count();
+        timings += std::string( timings.empty() ? "" : ", " ) + stages[ i ].name + " " + std::to_string( ms ) + "ms";
+        return ok;
+        };
 
-        FILE *fp = nullptr;
-#ifdef _WIN32
-        fp = _wfopen( tmp.wstring().c_str(), L"wb" );
-#else
-        fp = fopen( tmp.string().c_str(), "wb" );
-#endif
-        if ( !fp ) {
-            log.fail( "[DL] Failed to open for writing: " + tmp.string() );
+    for ( size_t i = 0; i < stages.size(); ++i ) {
+        if ( run.rs.cancel.load() ) {
+            if ( opened[ i ] ) finish( i );
+            break;
+        }
+        if ( i + 1 < stages.size() && stages[ i + 1 ].open ) {
+            began[ i + 1 ] = clock::now();
+            stages[ i + 1 ].open( run );
+            opened[ i + 1 ] = true;
+        }
+        if ( !finish( i ) ) {
+            if ( i + 1 < stages.size() && opened[ i + 1 ] ) finish( i + 1 );
+            break;
+        }
+    }
+
+    run.rs.stage.store( "" );
+    // Maps written before a cancel are in place, so their digests are kept either way.
+    if ( run.manifest_dirty ) save_manifest( run.data, run.manifest, run.log );
+    bool cancelled = run.rs.cancel.load();
+    if ( run.refetch_dirty ) save_index_cache( run.data, run.cache, run.refetch, run.log );
+    if ( cancelled ) run.log.push( "[i] Cancelled." );
+    if ( !timings.empty() ) run.log.push( "[i] Stage times: " + timings );
+    if ( run.s.trace ) finish_trace( run.log );
+    return !cancelled;
+}
+
+// "HH:MM-HH:MM=KiB/s" entries separated by commas or semicolons; entries that do not parse
+// are returned in bad and left out.
+static std::vector<RateWindow> parse_rate_schedule( const std::string &text, std::vector<std::string> &bad ) {
+    std::vector<RateWindow> out;
+    size_t i = 0;
+    while ( i <= text.size() ) {
+        size_t end = text.find_first_of( ",;", i );
+        if ( end == std::string::npos ) end = text.size();
+        auto item = std::string( trim_view( std::string_view( text ).substr( i, end - i ) ) );
+        i = end + 1;
+        if ( item.empty() ) continue;
+        int h1, m1, h2, m2;
+        long long kbps;
+        char tail;
+        if ( std::sscanf( item.c_str(), "%d:%d-%d:%d=%lld%c", &h1, &m1, &h2, &m2, &kbps, &tail ) != 5 ||
+            h1 < 0 || h1 > 24 || h2 < 0 || h2 > 24 || m1 < 0 || m1 > 59 || m2 < 0 || m2 > 59 || kbps < 0 ) {
+            bad.push_back( item );
+            continue;
+        }
+        out.push_back( RateWindow{ ( h1 * 60 + m1 ) % 1440, ( h2 * 60 + m2 ) % 1440, kbps * 1024 } );
+    }
+    return out;
+}
+
+static RateLimits rate_limits( const Settings &s, LiveLog &log ) {
+    RateLimits l;
+    l.global = ( long long ) std::max( 0, s.rate_limit_kbps ) * 1024;
+    l.per_group = ( long long ) std::max( 0, s.source_rate_limit_kbps ) * 1024;
+    std::vector<std::string> bad;
+    l.windows = parse_rate_schedule( s.rate_schedule, bad );
+    for ( auto &b : bad ) log.pushf( "[!] Ignoring rate schedule entry \"%s\" (want HH:MM-HH:MM=KiB/s).", b.c_str() );
+    if ( l.any() ) {
+        auto kib = []( long long bps ) { return bps > 0 ? std::to_string( bps / 1024 ) + " KiB/s" : std::string( "none" ); };
+        log.push( "[i] Bandwidth cap: " + kib( l.global ) + ", per mirror " + kib( l.per_group ) + ", " +
+            std::to_string( l.windows.size() ) + " peak window(s), now " + kib( l.global_at( local_minute_of_day() ) ) );
+    }
+    return l;
+}
+
+// Checks shared by both entry points and sets up the engine the stages talk through.
+static bool prepare_run( PipelineRun &run, std::vector<SourceEntry> &sources ) {
+    run.rs.cancel.store( false );
+    reset_phases( run.rs );
+
+    if ( run.s.hl2mp_path.empty() || !fs::exists( run.s.hl2mp_path ) ) {
+        run.log.fail( "[!] HL2MP path invalid." );
+        return false;
+    }
+
+    if ( !run.index_only ) {
+        run.dl_dir = run.s.hl2mp_path / "download" / "maps";
+        std::error_code ec;
+        fs::create_directories( run.dl_dir, ec );
+        if ( ec ) {
+            run.log.fail( "[!] Failed to create download/maps: " + ec.message() );
             return false;
         }
+    }
 
-        CURL *c = curl_easy();
-        curl_easy_setopt( c, CURLOPT_URL, url.c_str() );
-        curl_easy_setopt( c, CURLOPT_TIMEOUT_MS, ( long ) timeout_ms );
-        curl_easy_setopt( c, CURLOPT_WRITEFUNCTION, curl_file_write_cb );
-        curl_easy_setopt( c, CURLOPT_WRITEDATA, fp );
+    for ( auto &src : sources ) if ( src.enabled ) run.enabled.push_back( &src );
+    if ( run.enabled.empty() ) {
+        run.log.fail( "[!] No enabled sources." );
+        return false;
+    }
+    run.maps.reset( run.enabled.size() );
+
+    {
+        std::lock_guard lk( run.rs.traffic_mtx );
+        run.rs.traffic.clear();
+        for ( auto *src : run.enabled ) {
+            auto &t = run.rs.traffic.emplace_back( std::make_unique<SourceTraffic>() );
+            t->url = src->url;
+            run.traffic[ src ] = &t->bytes;
+        }
+    }
 
-        auto code = curl_easy_perform( c );
-        fclose( fp );
+    run.threads = std::max( 1, run.s.threads );
+    run.engine = std::make_unique<TransferEngine>( run.threads, &run.rs.cancel );
+    run.engine->set_rate_limits( rate_limits( run.s, run.log ) );
+    run.engine_hook = std::make_unique<ScopedCancelHook>( run.rs, [ &run ] { run.engine->wake(); } );
+    return true;
+}
 
-        long status = 0;
-        curl_easy_getinfo( c, CURLINFO_RESPONSE_CODE, &status );
-        curl_easy_cleanup( c );
+// Both return false if the run could not start (bad path, no sources) and true otherwise;
+// per-file failures and cancellation show up in the log and RunState respectively.
+static bool run_index_only( Settings s, std::vector<SourceEntry> &sources, RunState &rs, LiveLog &log ) {
+    PipelineRun run( s, rs, log );
+    run.index_only = true;
+    if ( !prepare_run( run, sources ) ) return false;
+    run_stages( run, make_stages( run.s, true ) );
+    return true;
+}
 
-        if ( cancel.load() ) return false;
+static bool run_pipeline( Settings s, std::vector<SourceEntry> &sources, RunState &rs, LiveLog &log ) {
+    PipelineRun run( s, rs, log );
+    if ( !prepare_run( run, sources ) ) return false;
+    run_stages( run, make_stages( run.s, false ) );
+    return true;
+}
 
-        if ( code == CURLE_OK && status >= 200 && status < 300 ) {
-            std::error_code ec;
-            fs::rename( tmp, out_file, ec );
-            if ( ec ) {
-                fs::copy_file( tmp, out_file, fs::copy_options::overwrite_existing, ec );
-                fs::remove( tmp, ec );
-            }
-            return true;
+// Measures every enabled source without indexing it: a few rounds of HEAD requests on the
+// source URL, all sources at once within a round. Later rounds usually reuse the connection,
+// so the samples span a cold and a warm TTFB. Results go into the persisted SourceStats.
+static bool run_source_probe( Settings s, std::vector<SourceEntry> &sources, RunState &rs, LiveLog &log ) {
+    constexpr int kRounds = 3;
+    rs.cancel.store( false );
+    reset_phases( rs );
+
+    std::vector<SourceEntry *> enabled;
+    for ( auto &src : sources ) if ( src.enabled ) enabled.push_back( &src );
+    if ( enabled.empty() ) {
+        log.fail( "[!] No enabled sources." );
+        return false;
+    }
+
+    TransferEngine engine( ( int ) enabled.size(), &rs.cancel );
+    ScopedCancelHook wake( rs, [ &engine ] { engine.wake(); } );
+    rs.stage.store( "latency" );
+    rs.indexing.total.store( ( int ) enabled.size() * kRounds );
+    rs.indexing.running.store( ( int ) enabled.size() );
+
+    std::vector<int> answered( enabled.size(), 0 );
+    for ( int round = 0; round < kRounds && !rs.cancel.load(); ++round ) {
+        std::vector<std::future<HttpResult>> heads;
+        for ( auto *src : enabled ) heads.push_back( http_head( engine, src->url, s.head_timeout_ms ) );
+        for ( size_t i = 0; i < enabled.size(); ++i ) {
+            auto r = heads[ i ].get();
+            rs.indexing.done.fetch_add( 1 );
+            if ( !r.err.empty() || r.status < 200 || r.status >= 400 || r.ttfb_ms < 0 ) continue;
+            enabled[ i ]->stats.add_ttfb( r.ttfb_ms );
+            answered[ i ]++;
         }
+    }
+    rs.indexing.running.store( 0 );
+    rs.stage.store( "" );
+    if ( rs.cancel.load() ) {
+        log.push( "[!] Probe cancelled." );
+        return true;
+    }
 
-        std::error_code ec;
-        fs::remove( tmp, ec );
+    for ( size_t i = 0; i < enabled.size(); ++i ) {
+        auto *src = enabled[ i ];
+        src->last_ok = answered[ i ] > 0;
+        if ( !src->last_ok ) {
+            log.failf( "[IDX] %s did not answer the probe", src->url.c_str() );
+            continue;
+        }
+        src->last_latency_ms = src->stats.ttfb_ms.back();
+        char rate[ 48 ] = "";
+        if ( src->stats.bps_ewma > 0 ) std::snprintf( rate, sizeof( rate ), ", %.2f MB/s per transfer", src->stats.bps_ewma / 1048576.0 );
+        log.pushf( "[i] %s: TTFB p50 %dms, p90 %dms over %zu sample(s)%s", src->url.c_str(),
+            src->stats.ttfb_percentile( 0.5 ), src->stats.ttfb_percentile( 0.9 ), src->stats.ttfb_ms.size(), rate );
+    }
+    return true;
+}
+
+// Previous std::regex based extractor, kept as the reference for the listing bench.
+static std::vector<std::string> extract_map_links_regex( const std::string &base_url, const std::string &html ) {
+    std::vector<std::string> out;
+    std::regex href_re( R"(href\s*=\s*["']([^"']+)["'])", std::regex::icase );
+    for ( std::sregex_iterator it( html.begin(), html.end(), href_re ), end; it != end; ++it ) {
+        auto href = ( *it )[ 1 ].str();
+        href = trim( href );
+        if ( href.empty() ) continue;
+        if ( href.back() == '/' ) continue;
+        auto low = lower_copy( href );
+        if ( !( low.ends_with( ".bsp" ) || low.ends_with( ".bz2" ) ) ) continue;
+        out.push_back( url_join( base_url, href ) );
+    }
+    out.erase( std::unique( out.begin(), out.end() ), out.end() );
+    return out;
+}
 
-        if ( attempt < retries ) {
-            log.push( "[Retry " + std::to_string( attempt ) + "/" + std::to_string( retries ) + "] " +
-                out_file.filename().string() );
-            std::this_thread::sleep_for( std::chrono::milliseconds( 250 ) );
+// Apache-style autoindex page with parent/sort links, a few subdirectories and a mix of
+// .bsp, .bsp.bz2 and unrelated files, roughly what large FastDL mirrors serve.
+static std::string synthetic_listing( int entries ) {
+    std::string html;
+    html.reserve( ( size_t ) entries * 190 + 512 );
+    html += "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 3.2 Final//EN\">\n<html><head><title>Index of /hl2mp/maps</title>"
+        "</head><body><h1>Index of /hl2mp/maps</h1><table>\n"
+        "<tr><th><a href=\"?C=N;O=D\">Name</a></th><th><a href=\"?C=M;O=A\">Last modified</a></th>"
+        "<th><a href=\"?C=S;O=A\">Size</a></th></tr>\n"
+        "<tr><td><a href=\"/hl2mp/\">Parent Directory</a></td></tr>\n";
+    char row[ 256 ];
+    for ( int i = 0; i < entries; ++i ) {
+        const char *ext = ( i % 3 == 0 ) ? ".bsp" : ( i % 17 == 0 ? ".nav" : ".bsp.bz2" );
+        const char *q = ( i % 5 == 0 ) ? "'" : "\"";
+        if ( i % 97 == 0 ) {
+            std::snprintf( row, sizeof( row ), "<tr><td><a href=\"sub%05d/\">sub%05d/</a></td></tr>\n", i, i );
+            html += row;
         }
-        else {
-            log.fail( "[DL] Failed: " + out_file.filename().string() + " (" + url + ")" );
+        std::snprintf( row, sizeof( row ),
+            "<tr><td valign=\"top\"><img src=\"/icons/unknown.gif\" alt=\"[   ]\"></td><td><A HREF = %sdm_map%06d%s%s>"
+            "dm_map%06d%s</a></td><td align=\"right\">2019-05-01 12:00  </td><td align=\"right\">4.2M</td></tr>\n",
+            q, i, ext, q, i, ext );
+        html += row;
+    }
+    html += "</table>\n<address>Apache/2.4.41 (Ubuntu) Server at fastdl.example.com Port 443</address>\n</body></html>\n";
+    return html;
+}
+
+// Feeds html to a ListingParser in chunk-sized pieces, the way the write callback does.
+static ListingParser parse_listing_chunked( const std::string &base_url, const std::string &html, size_t chunk, bool subdirs ) {
+    ListingParser parser( base_url, subdirs );
+    for ( size_t at = 0; at < html.size(); at += chunk ) parser.feed( std::string_view( html ).substr( at, chunk ) );
+    parser.finish();
+    return parser;
+}
+
+#ifdef _WIN32
+using sock_t = SOCKET;
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+static void close_socket( sock_t s ) { closesocket( s ); }
+static void shutdown_socket( sock_t s ) { shutdown( s, SD_BOTH ); }
+#else
+using sock_t = int;
+static void close_socket( sock_t s ) { ::close( s ); }
+static void shutdown_socket( sock_t s ) { shutdown( s, SHUT_RDWR ); }
+#endif
+
+static bool send_all( sock_t s, const char *p, size_t n ) {
+    while ( n > 0 ) {
+        int chunk = ( int ) std::min<size_t>( n, 1 << 20 );
+        int sent = ( int ) send( s, p, chunk, MSG_NOSIGNAL );
+        if ( sent <= 0 ) return false;
+        p += sent;
+        n -= ( size_t ) sent;
+    }
+    return true;
+}
+
+MiniHttpServer::~MiniHttpServer() {
+    stop();
+}
+
+void MiniHttpServer::mount( std::string url_prefix, fs::path dir, std::unordered_map<std::string, fs::path> aliases ) {
+    mount_prefix_ = std::move( url_prefix );
+    mount_dir_ = std::move( dir );
+    mount_aliases_ = std::move( aliases );
+}
+
+static bool is_map_file_name( std::string_view name ) {
+    auto low = lower_copy( std::string( name ) );
+    return low.ends_with( ".bsp" ) || low.ends_with( ".bsp.bz2" );
+}
+
+fs::path MiniHttpServer::mounted_file( std::string_view rel ) const {
+    if ( mount_prefix_.empty() ) return {};
+    if ( auto it = mount_aliases_.find( std::string( rel ) ); it != mount_aliases_.end() ) return it->second;
+    // Only plain names directly in the directory; in-progress .part files are not maps.
+    if ( rel.empty() || rel.front() == '.' || rel.find_first_of( "/\\:" ) != std::string_view::npos || !is_map_file_name( rel ) ) return {};
+    std::error_code ec;
+    auto p = mount_dir_ / fs::path( std::string( rel ) );
+    if ( !fs::is_regular_file( p, ec ) ) return {};
+    return p;
+}
+
+std::string MiniHttpServer::mounted_listing() const {
+    std::vector<std::string> names;
+    std::error_code ec;
+    for ( fs::directory_iterator it( mount_dir_, ec ), end; !ec && it != end; it.increment( ec ) ) {
+        auto name = it->path().filename().string();
+        if ( is_map_file_name( name ) && it->is_regular_file( ec ) ) names.push_back( std::move( name ) );
+    }
+    std::sort( names.begin(), names.end() );
+
+    std::string html = "<html><head><title>Index of " + mount_prefix_ + "</title></head><body><h1>Index of " + mount_prefix_ + "</h1>\n";
+    for ( auto &n : names ) html += "<a href=\"" + n + "\">" + n + "</a><br>\n";
+    html += "</body></html>\n";
+    return html;
+}
+
+// On Windows this relies on curl_global_init() having started Winsock.
+bool MiniHttpServer::start( std::string &err, int port, bool lan ) {
+    sock_t s = socket( AF_INET, SOCK_STREAM, 0 );
+    if ( s == ( sock_t ) -1 ) {
+        err = "socket() failed";
+        return false;
+    }
+    int one = 1;
+    setsockopt( s, SOL_SOCKET, SO_REUSEADDR, ( const char * ) &one, sizeof( one ) );
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( lan ? INADDR_ANY : INADDR_LOOPBACK );
+    addr.sin_port = htons( ( uint16_t ) port );
+    socklen_t len = sizeof( addr );
+    if ( bind( s, ( sockaddr * ) &addr, sizeof( addr ) ) != 0 || listen( s, 64 ) != 0 ||
+        getsockname( s, ( sockaddr * ) &addr, &len ) != 0 ) {
+        close_socket( s );
+        err = std::string( "bind/listen on " ) + ( lan ? "0.0.0.0:" : "127.0.0.1:" ) + std::to_string( port ) + " failed";
+        return false;
+    }
+
+    listen_ = ( intptr_t ) s;
+    port_ = ntohs( addr.sin_port );
+    stop_.store( false );
+    accept_ = std::thread( [ this ] { accept_loop(); } );
+    return true;
+}
+
+void MiniHttpServer::stop() {
+    if ( listen_ == -1 || stop_.exchange( true ) ) return;
+    if ( accept_.joinable() ) accept_.join();
+    close_socket( ( sock_t ) listen_ );
+    listen_ = -1;
+
+    std::unordered_map<std::thread::id, std::thread> conns;
+    {
+        std::lock_guard lk( conns_mtx_ );
+        for ( auto s : open_ ) shutdown_socket( ( sock_t ) s );
+        conns.swap( conns_ );
+        ended_.clear();
+    }
+    for ( auto &[ id, t ] : conns ) t.join();
+}
+
+void MiniHttpServer::reap() {
+    std::vector<std::thread> done;
+    {
+        std::lock_guard lk( conns_mtx_ );
+        for ( auto id : ended_ ) {
+            auto it = conns_.find( id );
+            if ( it == conns_.end() ) continue;
+            done.push_back( std::move( it->second ) );
+            conns_.erase( it );
         }
+        ended_.clear();
     }
-    return false;
+    // They have left serve(), so these joins return at once.
+    for ( auto &t : done ) t.join();
 }
 
-bool decompress_bz2_to_file( const fs::path &bz2_file, const fs::path &out_file, int retries,
-    std::atomic<bool> &cancel, LiveLog &log ) {
-    for ( int attempt = 1; attempt <= retries && !cancel.load(); ++attempt ) {
-        FILE *in = nullptr;
-        FILE *out = nullptr;
+// Bounds a socket's blocking recv and send, so a silent peer cannot hold its thread forever.
+static void set_socket_timeouts( sock_t c, int seconds ) {
 #ifdef _WIN32
-        in = _wfopen( bz2_file.wstring().c_str(), L"rb" );
-        out = _wfopen( out_file.wstring().c_str(), L"wb" );
+    DWORD ms = ( DWORD ) seconds * 1000;
+    setsockopt( c, SOL_SOCKET, SO_RCVTIMEO, ( const char * ) &ms, sizeof( ms ) );
+    setsockopt( c, SOL_SOCKET, SO_SNDTIMEO, ( const char * ) &ms, sizeof( ms ) );
 #else
-        in = fopen( bz2_file.string().c_str(), "rb" );
-        out = fopen( out_file.string().c_str(), "wb" );
+    timeval tv{ seconds, 0 };
+    setsockopt( c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) );
+    setsockopt( c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) );
 #endif
-        if ( !in || !out ) {
-            if ( in ) fclose( in );
-            if ( out ) fclose( out );
-            log.fail( "[BZ2] Open failed: " + bz2_file.filename().string() );
-            return false;
+}
+
+void MiniHttpServer::accept_loop() {
+    sock_t ls = ( sock_t ) listen_;
+    while ( !stop_.load() ) {
+        reap();
+        // Poll so stop() does not depend on closing a socket another thread is blocked on.
+        fd_set rd;
+        FD_ZERO( &rd );
+        FD_SET( ls, &rd );
+        timeval tv{ 0, 100 * 1000 };
+        if ( select( ( int ) ls + 1, &rd, nullptr, nullptr, &tv ) <= 0 ) continue;
+
+        sock_t c = accept( ls, nullptr, nullptr );
+        if ( c == ( sock_t ) -1 ) continue;
+        int one = 1;
+        setsockopt( c, IPPROTO_TCP, TCP_NODELAY, ( const char * ) &one, sizeof( one ) );
+        set_socket_timeouts( c, kIdleSeconds );
+
+        std::lock_guard lk( conns_mtx_ );
+        if ( ( int ) open_.size() >= kMaxConnections ) {
+            static constexpr char busy[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            send_all( c, busy, sizeof( busy ) - 1 );
+            close_socket( c );
+            continue;
         }
+        open_.insert( ( intptr_t ) c );
+        std::thread t( [ this, c ] { serve( ( intptr_t ) c ); } );
+        auto id = t.get_id();
+        conns_.emplace( id, std::move( t ) );
+    }
+}
 
-        int bzerr = BZ_OK;
-        BZFILE *bz = BZ2_bzReadOpen( &bzerr, in, 0, 0, nullptr, 0 );
-        if ( !bz || bzerr != BZ_OK ) {
-            fclose( in );
-            fclose( out );
-            log.fail( "[BZ2] ReadOpen failed: " + bz2_file.filename().string() );
-            return false;
+// The Range header of a request: "bytes=first-last", "bytes=first-" or "bytes=-suffix".
+// Only a single range is supported; anything else is malformed.
+struct ByteRange {
+    long long first = -1;   // -1 for a suffix range
+    long long last = -1;    // -1 = to the end
+    long long suffix = -1;  // length of a suffix range
+};
+
+static std::optional<ByteRange> parse_byte_range( std::string_view spec ) {
+    auto digits = []( std::string_view v, long long &out ) {
+        if ( v.empty() || v.size() > 18 ) return false;
+        out = 0;
+        for ( char c : v ) {
+            if ( c < '0' || c > '9' ) return false;
+            out = out * 10 + ( c - '0' );
         }
+        return true;
+        };
+    spec = trim_view( spec );
+    auto dash = spec.find( '-' );
+    if ( dash == std::string_view::npos ) return std::nullopt;
+    ByteRange r;
+    auto a = trim_view( spec.substr( 0, dash ) ), b = trim_view( spec.substr( dash + 1 ) );
+    if ( a.empty() ) {
+        if ( !digits( b, r.suffix ) ) return std::nullopt;
+        return r;
+    }
+    if ( !digits( a, r.first ) ) return std::nullopt;
+    if ( !b.empty() && ( !digits( b, r.last ) || r.last < r.first ) ) return std::nullopt;
+    return r;
+}
 
-        char buf[ 1 << 16 ];
-        while ( !cancel.load() ) {
-            int n = BZ2_bzRead( &bzerr, bz, buf, ( int ) sizeof( buf ) );
-            if ( bzerr == BZ_OK || bzerr == BZ_STREAM_END ) {
-                if ( n > 0 ) fwrite( buf, 1, ( size_t ) n, out );
-                if ( bzerr == BZ_STREAM_END ) break;
+void MiniHttpServer::serve( intptr_t sock ) {
+    sock_t c = ( sock_t ) sock;
+    std::string buf;
+    char tmp[ 8192 ];
+
+    for ( ;; ) {
+        size_t end;
+        while ( ( end = buf.find( "\r\n\r\n" ) ) == std::string::npos ) {
+            int n = ( int ) recv( c, tmp, ( int ) sizeof( tmp ), 0 );
+            if ( n <= 0 || buf.size() > 65536 ) goto done;
+            buf.append( tmp, ( size_t ) n );
+        }
+
+        {
+            std::string head = lower_copy( buf.substr( 0, end ) );
+            // Copied out: the erase below reuses buf's storage for what follows this request.
+            std::string request = buf.substr( 0, buf.find( "\r\n" ) );
+            buf.erase( 0, end + 4 );
+
+            auto sp1 = request.find( ' ' );
+            auto sp2 = request.find( ' ', sp1 == std::string::npos ? sp1 : sp1 + 1 );
+            if ( sp1 == std::string::npos || sp2 == std::string::npos ) break;
+            std::string method( request.substr( 0, sp1 ) );
+            std::string path( request.substr( sp1 + 1, sp2 - sp1 - 1 ) );
+            path = path.substr( 0, path.find( '?' ) );
+            bool keep = request.substr( sp2 + 1 ) == "HTTP/1.1" && head.find( "\r\nconnection: close" ) == std::string::npos;
+
+            std::optional<ByteRange> range;
+            bool bad_range = false;
+            if ( auto r = head.find( "\r\nrange:" ); r != std::string::npos ) {
+                auto v = trim_view( std::string_view( head ).substr( r + 8, head.find( "\r\n", r + 8 ) - ( r + 8 ) ) );
+                if ( v.starts_with( "bytes=" ) ) range = parse_byte_range( v.substr( 6 ) );
+                bad_range = !range;
             }
-            else {
-                break;
+
+            int status = 404;
+            const char *reason = "Not Found";
+            std::string_view body = "not found";
+            std::string extra, listing;
+            std::ifstream disk;
+            long long size = -1;
+            auto it = files_.find( path );
+            if ( it != files_.end() ) {
+                body = it->second;
+                size = ( long long ) body.size();
+            }
+            else if ( !mount_prefix_.empty() && path == mount_prefix_ ) {
+                listing = mounted_listing();
+                body = listing;
+                size = ( long long ) body.size();
+            }
+            else if ( !mount_prefix_.empty() && path.starts_with( mount_prefix_ ) ) {
+                std::error_code ec;
+                auto p = mounted_file( std::string_view( path ).substr( mount_prefix_.size() ) );
+                auto n = p.empty() ? 0 : fs::file_size( p, ec );
+                if ( !p.empty() && !ec ) disk.open( p, std::ios::binary );
+                if ( disk.is_open() ) size = ( long long ) n;
+            }
+            // The bytes [from, from + length) of the resource are sent.
+            long long from = 0, length = 0;
+            if ( size >= 0 && bad_range ) {
+                status = 400;
+                reason = "Bad Request";
+                body = "bad range";
+                disk.close();
+            }
+            else if ( size >= 0 && range ) {
+                long long first = range->first, last = size - 1;
+                if ( range->suffix >= 0 ) first = size - std::min( range->suffix, size );
+                else if ( range->last >= 0 ) last = std::min( range->last, size - 1 );
+                // An empty resource or a zero-length suffix cannot satisfy any range.
+                if ( first >= size || ( range->suffix >= 0 && range->suffix == 0 ) || size == 0 ) {
+                    status = 416;
+                    reason = "Range Not Satisfiable";
+                    extra = "Content-Range: bytes */" + std::to_string( size ) + "\r\n";
+                    body = {};
+                    disk.close();
+                }
+                else {
+                    status = 206;
+                    reason = "Partial Content";
+                    extra = "Content-Range: bytes " + std::to_string( first ) + "-" + std::to_string( last ) + "/" +
+                        std::to_string( size ) + "\r\n";
+                    from = first;
+                    length = last - first + 1;
+                }
+            }
+            else if ( size >= 0 ) {
+                status = 200;
+                reason = "OK";
+                length = size;
+            }
+            if ( !disk.is_open() ) {
+                if ( status == 200 || status == 206 ) body = body.substr( ( size_t ) from, ( size_t ) length );
+                length = ( long long ) body.size();
+            }
+
+            char hdr[ 512 ];
+            int hn = std::snprintf( hdr, sizeof( hdr ),
+                "HTTP/1.1 %d %s\r\nContent-Length: %lld\r\nAccept-Ranges: bytes\r\n%sConnection: %s\r\n\r\n",
+                status, reason, length, extra.c_str(), keep ? "keep-alive" : "close" );
+            if ( !send_all( c, hdr, ( size_t ) hn ) ) break;
+            if ( method != "HEAD" && disk.is_open() ) {
+                // Maps can be hundreds of MB, so they are sent in slices rather than loaded.
+                std::vector<char> slice( 256 * 1024 );
+                disk.seekg( from );
+                long long left = length;
+                while ( left > 0 && disk.read( slice.data(), ( std::streamsize ) std::min<long long>( left, ( long long ) slice.size() ) ) ) {
+                    if ( !send_all( c, slice.data(), ( size_t ) disk.gcount() ) ) goto done;
+                    left -= disk.gcount();
+                }
+                if ( left > 0 ) break;
             }
+            else if ( method != "HEAD" && !send_all( c, body.data(), body.size() ) ) break;
+            if ( !keep ) break;
         }
+    }
 
-        BZ2_bzReadClose( &bzerr, bz );
-        fclose( in );
-        fclose( out );
+done:
+    std::lock_guard lk( conns_mtx_ );
+    open_.erase( sock );
+    close_socket( c );
+    ended_.push_back( std::this_thread::get_id() );
+}
 
-        if ( cancel.load() ) return false;
+struct BenchOptions {
+    bool quick = false;
+    // Directory of real .bz2 maps for the extraction case; synthetic maps when empty.
+    fs::path corpus;
+};
 
-        if ( bzerr == BZ_STREAM_END || bzerr == BZ_OK ) return true;
+// Calls fn at least min_iters times and until min_ms have passed, then reports the spread.
+template <typename F>
+static json bench_time( int min_iters, double min_ms, F &&fn ) {
+    std::vector<double> ms;
+    double total = 0;
+    while ( ( int ) ms.size() < min_iters || ( total < min_ms && ms.size() < 1000 ) ) {
+        auto t0 = std::chrono::steady_clock::now();
+        fn();
+        double dt = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - t0 ).count();
+        ms.push_back( dt );
+        total += dt;
+    }
+    std::sort( ms.begin(), ms.end() );
+    return { { "iterations", ms.size() }, { "min_ms", ms.front() }, { "median_ms", ms[ ms.size() / 2 ] }, { "total_ms", total } };
+}
 
-        std::error_code ec;
-        fs::remove( out_file, ec );
+static double mb_per_s( double bytes, const json &timing ) {
+    double ms = timing[ "median_ms" ].get<double>();
+    return ms > 0 ? bytes / ( 1024.0 * 1024.0 ) / ( ms / 1000.0 ) : 0.0;
+}
 
-        if ( attempt == retries ) {
-            log.fail( "[BZ2] Failed: " + bz2_file.filename().string() );
-            return false;
+// Deterministic stand-in for a .bsp: an entity lump of keyvalue text followed by vertex and
+// plane data, which bzip2 shrinks by a few times over, in the range real maps show.
+static std::string synthetic_bsp( size_t size, uint32_t seed ) {
+    std::string out;
+    out.reserve( size + 256 );
+    out.append( "VBSP", 4 );
+    uint32_t x = seed * 2654435761u + 1;
+    auto next = [ &x ] {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return x;
+        };
+
+    char line[ 160 ];
+    while ( out.size() < size / 4 ) {
+        static const char *classes[] = { "info_player_deathmatch", "prop_physics", "light", "weapon_shotgun", "item_healthkit" };
+        int n = std::snprintf( line, sizeof( line ), "{\n\"classname\" \"%s\"\n\"origin\" \"%d %d %d\"\n\"angles\" \"0 %u 0\"\n}\n",
+            classes[ next() % 5 ], ( int ) ( next() % 8192 ) - 4096, ( int ) ( next() % 8192 ) - 4096,
+            ( int ) ( next() % 1024 ), next() % 360 );
+        out.append( line, ( size_t ) n );
+    }
+    while ( out.size() < size ) {
+        float v = ( float ) ( next() % 4096 ) / 8.0f;
+        out.append( reinterpret_cast<const char *>( &v ), sizeof( v ) );
+        int32_t flags = ( int32_t ) ( next() % 4 );
+        out.append( reinterpret_cast<const char *>( &flags ), sizeof( flags ) );
+    }
+    out.resize( size );
+    return out;
+}
+
+static std::string bz2_compress( const std::string &in ) {
+    unsigned int cap = ( unsigned int ) ( in.size() + in.size() / 100 + 601 );
+    std::string out( cap, '\0' );
+    if ( BZ2_bzBuffToBuffCompress( out.data(), &cap, const_cast<char *>( in.data() ), ( unsigned int ) in.size(), 9, 0, 30 ) != BZ_OK )
+        return {};
+    out.resize( cap );
+    return out;
+}
+
+static bool write_whole_file( const fs::path &p, const std::string &data ) {
+    std::ofstream f( p, std::ios::binary | std::ios::trunc );
+    f.write( data.data(), ( std::streamsize ) data.size() );
+    return ( bool ) f;
+}
+
+static json bench_links( const BenchOptions &o, bool &ok ) {
+    const std::string base = "https://fastdl.example.com/hl2mp/maps/";
+    json out = json::array();
+    std::vector<int> sizes = o.quick ? std::vector<int>{ 1000, 10000 } : std::vector<int>{ 1000, 10000, 100000 };
+    for ( int entries : sizes ) {
+        auto html = synthetic_listing( entries );
+        std::vector<std::string> links;
+        auto t = bench_time( 3, o.quick ? 50 : 300, [ & ] { links = extract_map_links_from_index_html( base, html ); } );
+        json j = { { "entries", entries }, { "bytes", html.size() }, { "links", links.size() }, { "scanner", t },
+            { "mb_per_s", mb_per_s( ( double ) html.size(), t ) } };
+        std::vector<std::string> chunked;
+        j[ "chunked" ] = bench_time( 3, o.quick ? 50 : 300, [ & ] { chunked = parse_listing_chunked( base, html, 16 * 1024, true ).links; } );
+        j[ "matches_chunked" ] = chunked == links;
+        ok = ok && chunked == links;
+        // The regex reference takes seconds at 100k; compare on the smaller listings only.
+        if ( entries <= 10000 ) {
+            std::vector<std::string> ref;
+            j[ "regex" ] = bench_time( 1, 0, [ & ] { ref = extract_map_links_regex( base, html ); } );
+            j[ "matches_regex" ] = ref == links;
+            ok = ok && ref == links;
+            // Odd-sized chunks split hrefs at every possible offset, directories included.
+            auto odd = parse_listing_chunked( base, html, 7, true );
+            bool odd_ok = odd.links == links && odd.dirs == extract_subdirs_from_index_html( base, html );
+            j[ "matches_odd_chunks" ] = odd_ok;
+            ok = ok && odd_ok;
+            // Row fingerprints must not depend on how the body was chunked, nor take in the footer.
+            auto whole = parse_listing_chunked( base, html, html.size(), true );
+            auto footer = html;
+            footer.replace( footer.find( "Apache/2.4.41" ), 13, "Apache/2.4.62" );
+            bool sigs = whole.sigs.size() == links.size() && odd.sigs == whole.sigs &&
+                parse_listing_chunked( base, footer, footer.size(), true ).sigs == whole.sigs;
+            j[ "matches_sigs" ] = sigs;
+            ok = ok && sigs;
         }
+        out.push_back( j );
     }
-    return false;
+    return out;
 }
 
 struct SourceIndex {
@@ -542,24 +5665,7 @@ struct SourceIndex {
     std::vector<std::string> links;
 };
 
-static void reset_phases( RunState &rs ) {
-    rs.indexing.running.store( false );
-    rs.indexing.done.store( 0 );
-    rs.indexing.total.store( 0 );
-
-    rs.downloading.running.store( false );
-    rs.downloading.done.store( 0 );
-    rs.downloading.total.store( 0 );
-
-    rs.decompressing.running.store( false );
-    rs.decompressing.done.store( 0 );
-    rs.decompressing.total.store( 0 );
-
-    rs.deleting.running.store( false );
-    rs.deleting.done.store( 0 );
-    rs.deleting.total.store( 0 );
-}
-
+// The std::map based index MapIndex replaced, kept as the reference for --bench.
 static std::map<std::string, std::vector<SourceEntry *>> build_availability(
     const std::vector<SourceIndex> &indexed ) {
     std::map<std::string, std::vector<SourceEntry *>> availability;
@@ -567,373 +5673,877 @@ static std::map<std::string, std::vector<SourceEntry *>> build_availability(
         if ( !si.src || !si.src->enabled || !si.src->last_ok ) continue;
         for ( auto &u : si.links ) {
             auto name = fs::path( u ).filename().string();
-            availability[ name ].push_back( si.src );
+            auto &srcs = availability[ std::string( map_key( name ) ) ];
+            if ( std::find( srcs.begin(), srcs.end(), si.src ) == srcs.end() ) srcs.push_back( si.src );
         }
     }
     return availability;
 }
 
-static SourceEntry *pick_best_source( const std::vector<SourceEntry *> &srcs ) {
-    SourceEntry *best = nullptr;
-    for ( auto *ssrc : srcs ) {
-        if ( !best ) best = ssrc;
-        else {
-            int a = ssrc->last_latency_ms >= 0 ? ssrc->last_latency_ms : 1'000'000;
-            int b = best->last_latency_ms >= 0 ? best->last_latency_ms : 1'000'000;
-            if ( a < b ) best = ssrc;
+static json bench_availability( const BenchOptions &o, bool &ok ) {
+    const int maps = o.quick ? 2000 : 10000;
+    json out = json::array();
+    for ( int nsrc : { 4, 16, 64 } ) {
+        std::vector<SourceEntry> sources( ( size_t ) nsrc );
+        std::vector<SourceIndex> indexed( ( size_t ) nsrc );
+        for ( int k = 0; k < nsrc; ++k ) {
+            sources[ k ].url = "https://fastdl" + std::to_string( k ) + ".example.com/hl2mp/maps/";
+            sources[ k ].last_ok = true;
+            indexed[ k ].src = &sources[ k ];
+            // Each mirror carries about 70% of the maps, offset so the overlap varies; every
+            // fifth mirror lists plain .bsp files instead of .bz2.
+            const char *ext = k % 5 == 4 ? ".bsp" : ".bsp.bz2";
+            for ( int i = 0; i < maps; ++i )
+                if ( ( i + k ) % 10 < 7 ) indexed[ k ].links.push_back( sources[ k ].url + "dm_map" + std::to_string( i ) + ext );
         }
+        // One add per listing on the pool, as index_one does, then the freeze stage_plan does.
+        MapIndex index;
+        auto t = bench_time( 3, o.quick ? 50 : 300, [ & ] {
+            index.reset( ( size_t ) nsrc );
+            std::vector<std::future<void>> adds;
+            for ( int k = 0; k < nsrc; ++k ) adds.push_back( shared_pool().submit( [ &, k ] { index.add( k, indexed[ k ].links ); }, &adds ) );
+            for ( auto &f : adds ) shared_pool().wait_helping( f, &adds );
+            index.finalize();
+            } );
+        std::map<std::string, std::vector<SourceEntry *>> ref;
+        auto tr = bench_time( 1, 0, [ & ] { ref = build_availability( indexed ); } );
+
+        bool same = ref.size() == index.size();
+        for ( auto &[name, srcs] : ref ) {
+            auto id = index.find( name );
+            if ( !same || !id ) { same = false; break; }
+            std::vector<SourceEntry *> got;
+            for ( auto v : { MapVariant::Bz2, MapVariant::Plain } )
+                index.for_each_source( *id, v, [ & ]( int k ) { got.push_back( &sources[ k ] ); } );
+            std::sort( got.begin(), got.end() );
+            auto want = srcs;
+            std::sort( want.begin(), want.end() );
+            same = got == want;
+        }
+        ok = ok && same;
+        out.push_back( { { "sources", nsrc }, { "links_per_source", indexed[ 0 ].links.size() }, { "unique", index.size() },
+            { "timing", t }, { "map_reference", tr }, { "matches_reference", same } } );
     }
-    return best;
+    return out;
 }
 
-static void run_index_only( Settings s, std::vector<SourceEntry> &sources, RunState &rs, LiveLog &log ) {
-    rs.cancel.store( false );
-    reset_phases( rs );
-
-    if ( s.hl2mp_path.empty() || !fs::exists( s.hl2mp_path ) ) {
-        log.fail( "[!] HL2MP path invalid." );
-        return;
-    }
-
-    scan_existing_maps( s.hl2mp_path, rs, log );
-
-    std::vector<SourceEntry *> enabled;
-    for ( auto &src : sources ) if ( src.enabled ) enabled.push_back( &src );
-    if ( enabled.empty() ) {
-        log.fail( "[!] No enabled sources." );
-        return;
-    }
-
-    auto includes = split_csv_terms( s.include_filters );
-    auto excludes = split_csv_terms( s.exclude_filters );
-
-    rs.indexing.running.store( true );
-    rs.indexing.done.store( 0 );
-    rs.indexing.total.store( ( int ) enabled.size() );
-    log.push( "[i] Indexing sources..." );
-
-    std::mutex idx_mtx;
-    std::vector<SourceIndex> indexed;
-
-    auto worker_index = [ & ]( SourceEntry *src ) {
-        auto t0 = std::chrono::steady_clock::now();
-        auto r = http_get_text( src->url, s.index_timeout_ms );
-        auto t1 = std::chrono::steady_clock::now();
-        int ms = ( int ) std::chrono::duration_cast< std::chrono::milliseconds >( t1 - t0 ).count();
+// The pre-FilterSet matcher (lower-case copy, linear find per term), kept as the reference.
+static bool passes_filters_naive( const std::string &filename, const std::vector<std::string> &includes,
+    const std::vector<std::string> &excludes ) {
+    auto name = lower_copy( filename );
+    bool any = includes.empty();
+    for ( auto &t : includes ) if ( name.find( t ) != std::string::npos ) { any = true; break; }
+    if ( !any ) return false;
+    for ( auto &t : excludes ) if ( name.find( t ) != std::string::npos ) return false;
+    return true;
+}
 
-        src->last_latency_ms = ms;
-        src->last_ok = ( r.err.empty() && r.status >= 200 && r.status < 400 );
+static json bench_filters( const BenchOptions &o, bool &ok ) {
+    const int names = o.quick ? 20000 : 100000;
+    std::vector<std::string> files;
+    files.reserve( ( size_t ) names );
+    static const char *prefixes[] = { "dm_", "DM_", "ctf_", "jb_", "surf_", "mg_" };
+    for ( int i = 0; i < names; ++i ) files.push_back( std::string( prefixes[ i % 6 ] ) + "Map" + std::to_string( i ) + ".bsp.bz2" );
+
+    json out = json::array();
+    for ( int terms : { 0, 10, 100, 1000 } ) {
+        // Includes almost never match, so every name walks the whole list: the worst case.
+        std::vector<std::string> includes, excludes;
+        for ( int k = 0; k < terms / 2; ++k ) includes.push_back( "zz" + std::to_string( k ) );
+        for ( int k = 0; k < terms - terms / 2; ++k ) excludes.push_back( "yy" + std::to_string( k ) );
+        if ( terms ) includes.push_back( "dm_" );
+        auto csv = []( const std::vector<std::string> &v ) {
+            std::string s;
+            for ( auto &t : v ) s += ( s.empty() ? "" : "," ) + t;
+            return s;
+            };
 
-        SourceIndex si;
-        si.src = src;
-        if ( src->last_ok ) {
-            si.links = extract_map_links_from_index_html( src->url, r.body );
-            log.push( "[+] " + src->url + " -> " + std::to_string( si.links.size() ) + " file(s) (" +
-                std::to_string( ms ) + "ms)" );
-        }
-        else {
-            log.fail( "[IDX] " + src->url + " failed (" +
-                ( r.err.empty() ? ( "HTTP " + std::to_string( r.status ) ) : r.err ) + ")" );
-        }
+        std::optional<FilterSet> filters;
+        auto tc = bench_time( 3, 0, [ & ] { filters.emplace( csv( includes ), csv( excludes ) ); } );
+        size_t kept = 0, ref_kept = 0;
+        auto t = bench_time( 3, o.quick ? 50 : 300, [ & ] {
+            kept = 0;
+            for ( auto &f : files ) kept += filters->pass( f );
+            } );
+        auto tr = bench_time( 1, 0, [ & ] {
+            ref_kept = 0;
+            for ( auto &f : files ) ref_kept += passes_filters_naive( f, includes, excludes );
+            } );
+        ok = ok && kept == ref_kept;
+        out.push_back( { { "terms", terms }, { "names", names }, { "kept", kept }, { "compile", tc }, { "timing", t },
+            { "naive", tr }, { "matches_naive", kept == ref_kept } } );
+    }
 
-        {
-            std::lock_guard lk( idx_mtx );
-            indexed.push_back( std::move( si ) );
-        }
-        rs.indexing.done.fetch_add( 1 );
+    // Anchored and glob patterns, which the substring automaton does not cover.
+    FilterSet mixed( "dm_*, ctf_*, *map1?.bsp.bz2, re:^surf_map[0-9]+\\.bsp", "!*7.bsp.bz2, *_test.bsp" );
+    size_t kept = 0;
+    auto t = bench_time( 3, o.quick ? 50 : 300, [ & ] {
+        kept = 0;
+        for ( auto &f : files ) kept += mixed.pass( f );
+        } );
+    out.push_back( { { "terms", "mixed" }, { "names", names }, { "kept", kept }, { "timing", t } } );
+
+    // A regex that does not compile is matched as literal text, case-insensitively like the rest.
+    FilterSet broken( "re:DM_[", "" );
+    bool literal = broken.pass( "dm_[old].bsp" ) && broken.pass( "DM_[OLD].bsp" ) && !broken.pass( "dm_old.bsp" );
+    ok = ok && literal;
+    out.push_back( { { "terms", "invalid_regex" }, { "matches_literal", literal } } );
+
+    // The plan filters maps by their listed names, not the .bsp key alone: a .bz2 pattern still
+    // tells compressed listings apart from plain ones.
+    MapIndex index;
+    index.reset( 2 );
+    index.add( 0, { "http://a/dm_zip.bsp.bz2", "http://a/dm_both.bsp.bz2", "http://a/dm_flat.bsp" } );
+    index.add( 1, { "http://b/dm_both.bsp" } );
+    index.finalize();
+    auto kept_by = [ & ]( const char *inc, const char *exc ) {
+        FilterSet f( inc, exc );
+        std::string names, scratch;
+        for ( uint32_t id = 0; id < ( uint32_t ) index.size(); ++id )
+            if ( map_passes( f, index, id, scratch ) ) names += std::string( names.empty() ? "" : "," ) + std::string( index.name( id ) );
+        return names;
         };
+    bool listed = kept_by( "*.bsp.bz2", "" ) == "dm_both.bsp,dm_zip.bsp" && kept_by( "re:\\.bz2$", "" ) == "dm_both.bsp,dm_zip.bsp" &&
+        kept_by( "", ".bz2" ) == "dm_both.bsp,dm_flat.bsp" && kept_by( "*.bsp", "" ) == "dm_both.bsp,dm_flat.bsp";
+    ok = ok && listed;
+    out.push_back( { { "terms", "listed_names" }, { "matches_listed", listed } } );
+    return out;
+}
 
-    std::vector<std::future<void>> futs;
-    int threads = std::max( 1, s.threads );
-    std::atomic<int> in_flight{ 0 };
-
-    for ( auto *src : enabled ) {
-        while ( !rs.cancel.load() ) {
-            if ( in_flight.load() < threads ) break;
-            std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+static json bench_decompress( const BenchOptions &o, const fs::path &work, bool &ok ) {
+    std::vector<fs::path> corpus;
+    std::error_code ec;
+    if ( !o.corpus.empty() ) {
+        for ( auto &e : fs::directory_iterator( o.corpus, ec ) )
+            if ( e.is_regular_file() && lower_copy( e.path().extension().string() ) == ".bz2" ) corpus.push_back( e.path() );
+    }
+    else {
+        int files = o.quick ? 2 : 6;
+        size_t size = o.quick ? ( 2u << 20 ) : ( 8u << 20 );
+        for ( int i = 0; i < files; ++i ) {
+            auto p = work / ( "synthetic" + std::to_string( i ) + ".bsp.bz2" );
+            if ( write_whole_file( p, bz2_compress( synthetic_bsp( size, ( uint32_t ) i + 1 ) ) ) ) corpus.push_back( p );
         }
-        if ( rs.cancel.load() ) break;
-
-        in_flight.fetch_add( 1 );
-        futs.push_back( std::async( std::launch::async, [ &, src ] {
-            worker_index( src );
-            in_flight.fetch_sub( 1 );
-            } ) );
     }
-    for ( auto &f : futs ) f.wait();
 
-    rs.indexing.running.store( false );
+    long long in_bytes = 0;
+    for ( auto &p : corpus ) in_bytes += ( long long ) fs::file_size( p, ec );
 
-    auto availability = build_availability( indexed );
+    LiveLog log;
+    std::atomic<bool> cancel{ false };
+    PhaseProgress progress;
+    bool all_ok = true;
+    auto out_file = work / "decompress.out";
+    auto t = bench_time( o.quick ? 1 : 3, 0, [ & ] {
+        progress.bytes_out.store( 0 );
+        for ( auto &p : corpus ) all_ok = decompress_bz2_to_file( p, out_file, 1, cancel, log, &progress ) && all_ok;
+        } );
+    fs::remove( out_file, ec );
+    ok = ok && all_ok;
 
-    int remote_unique = ( int ) availability.size();
-    int remote_after_filters = 0;
-    int already_have = 0;
-    int to_download = 0;
+    long long out_bytes = progress.bytes_out.load();
+    return { { "corpus", o.corpus.empty() ? "synthetic" : o.corpus.string() }, { "files", corpus.size() },
+        { "bytes_in", in_bytes }, { "bytes_out", out_bytes }, { "ok", all_ok }, { "timing", t },
+        { "mb_per_s_out", mb_per_s( ( double ) out_bytes, t ) } };
+}
 
-    for ( auto &[name, srcs] : availability ) {
-        if ( !passes_filters( name, includes, excludes ) ) continue;
-        remote_after_filters++;
+static std::string read_whole_file( const fs::path &p ) {
+    std::ifstream f( p, std::ios::binary );
+    return std::string( std::istreambuf_iterator<char>( f ), {} );
+}
 
-        if ( rs.existing_files.contains( name ) ) already_have++;
-        else to_download++;
+// One large file through both decoders; the block-parallel one must produce identical bytes.
+static json bench_decompress_parallel( const BenchOptions &o, const fs::path &work, bool &ok ) {
+    fs::path src;
+    std::error_code ec;
+    if ( !o.corpus.empty() ) {
+        uintmax_t best = 0;
+        for ( auto &e : fs::directory_iterator( o.corpus, ec ) ) {
+            if ( !e.is_regular_file() || lower_copy( e.path().extension().string() ) != ".bz2" ) continue;
+            if ( e.file_size( ec ) > best ) best = e.file_size( ec ), src = e.path();
+        }
+    }
+    if ( src.empty() ) {
+        src = work / "large.bsp.bz2";
+        write_whole_file( src, bz2_compress( synthetic_bsp( o.quick ? ( 8u << 20 ) : ( 48u << 20 ), 99 ) ) );
     }
 
-    rs.last_remote_unique.store( remote_unique );
-    rs.last_remote_after_filters.store( remote_after_filters );
-    rs.last_already_have.store( already_have );
-    rs.last_to_download.store( to_download );
-
-    log.push( "[i] Index complete." );
-    log.push( "[i] Remote unique files: " + std::to_string( remote_unique ) );
-    log.push( "[i] After filters: " + std::to_string( remote_after_filters ) );
-    log.push( "[i] Already present locally: " + std::to_string( already_have ) );
-    log.push( "[i] Would download: " + std::to_string( to_download ) );
+    LiveLog log;
+    std::atomic<bool> cancel{ false };
+    auto serial_out = work / "serial.out", parallel_out = work / "parallel.out";
+    bool serial_ok = false;
+    int parallel_rc = 0;
+    auto ts = bench_time( 1, 0, [ & ] { serial_ok = decompress_bz2_serial( src, serial_out, 1, cancel, log, nullptr, {} ); } );
+    auto tp = bench_time( 1, 0, [ & ] { parallel_rc = decompress_bz2_parallel( src, parallel_out, cancel, nullptr, {} ); } );
+    bool same = serial_ok && parallel_rc == 1 && read_whole_file( serial_out ) == read_whole_file( parallel_out );
+    ok = ok && same;
+
+    auto out_bytes = ( double ) fs::file_size( serial_out, ec );
+    fs::remove( serial_out, ec );
+    fs::remove( parallel_out, ec );
+    return { { "file", src.filename().string() }, { "bytes_in", fs::file_size( src, ec ) }, { "bytes_out", out_bytes },
+        { "pool_threads", shared_pool().size() }, { "identical", same }, { "serial", ts }, { "parallel", tp },
+        { "serial_mb_per_s_out", mb_per_s( out_bytes, ts ) }, { "parallel_mb_per_s_out", mb_per_s( out_bytes, tp ) } };
 }
 
-static void run_pipeline( Settings s, std::vector<SourceEntry> &sources, RunState &rs, LiveLog &log ) {
-    rs.cancel.store( false );
-    reset_phases( rs );
+// Each write path against stdio (today's path) with the chunk sizes the two writers see:
+// curl hands over ~16 KiB per callback, the decoders 64 KiB.
+static json bench_output( const BenchOptions &o, const fs::path &work ) {
+    const size_t total = o.quick ? ( 64u << 20 ) : ( 256u << 20 );
+    std::string chunk_src = synthetic_bsp( 64u << 10, 3 );
+    auto target = work / "output.bin";
+    json out = json::array();
+
+    for ( size_t chunk : { ( size_t ) 16 << 10, ( size_t ) 64 << 10 } ) {
+        double stdio_ms = 0;
+        for ( auto mode : { WriteMode::Stdio, WriteMode::Buffered, WriteMode::Direct, WriteMode::Mmap } ) {
+            for ( auto policy : { FsyncPolicy::Never, FsyncPolicy::File } ) {
+                OutputOptions opt;
+                opt.mode = mode;
+                opt.fsync = policy;
+                WriteMode used = mode;
+                bool ok = true;
+                auto t = bench_time( o.quick ? 1 : 3, 0, [ & ] {
+                    OutputFile f;
+                    ok = f.open( target, false, opt, ( long long ) total );
+                    used = f.mode();
+                    for ( size_t done = 0; ok && done < total; done += chunk ) ok = f.write( chunk_src.data(), chunk );
+                    ok = f.close() && ok;
+                    } );
+                std::error_code ec;
+                fs::remove( target, ec );
+                if ( mode == WriteMode::Stdio && policy == FsyncPolicy::Never ) stdio_ms = t[ "median_ms" ].get<double>();
+                double ms = t[ "median_ms" ].get<double>();
+                out.push_back( { { "mode", write_mode_name( mode ) }, { "effective_mode", write_mode_name( used ) },
+                    { "fsync", fsync_policy_name( policy ) }, { "chunk", chunk }, { "bytes", total }, { "ok", ok },
+                    { "timing", t }, { "mb_per_s", mb_per_s( ( double ) total, t ) },
+                    { "vs_stdio", ms > 0 && stdio_ms > 0 ? stdio_ms / ms : 0.0 } } );
+            }
+        }
+    }
 
-    if ( s.hl2mp_path.empty() || !fs::exists( s.hl2mp_path ) ) {
-        log.fail( "[!] HL2MP path invalid." );
-        return;
+#ifndef _WIN32
+    // A transfer that stops well short of its size hint must not keep the blocks reserved for
+    // the rest: both the failed (released) and the closed file end up about their data's size.
+    for ( bool closed : { false, true } ) {
+        OutputOptions opt;
+        bool ok;
+        {
+            OutputFile f;
+            ok = f.open( target, false, opt, 64ll << 20 ) && f.write( chunk_src.data(), chunk_src.size() );
+            if ( closed ) ok = f.close() && ok;
+        }
+        struct stat st{};
+        long long held = stat( target.string().c_str(), &st ) == 0 ? ( long long ) st.st_blocks * 512 : -1;
+        ok = ok && held >= 0 && held < ( 1ll << 20 );
+        std::error_code ec;
+        fs::remove( target, ec );
+        out.push_back( { { "mode", "short_write" }, { "closed", closed }, { "bytes_on_disk", held }, { "ok", ok } } );
     }
+#endif
+    return out;
+}
 
-    auto dl_dir = s.hl2mp_path / "download" / "maps";
-    std::error_code ec;
-    fs::create_directories( dl_dir, ec );
-    if ( ec ) {
-        log.fail( "[!] Failed to create download/maps: " + ec.message() );
-        return;
+// Sends req on a fresh loopback connection and returns everything received until the server
+// closes it (or 5 s pass without data).
+static std::string raw_http_exchange( int port, const std::string &req ) {
+    std::string got;
+    sock_t s = socket( AF_INET, SOCK_STREAM, 0 );
+    if ( s == ( sock_t ) -1 ) return got;
+#ifdef _WIN32
+    DWORD tv = 5000;
+#else
+    timeval tv{ 5, 0 };
+#endif
+    setsockopt( s, SOL_SOCKET, SO_RCVTIMEO, ( const char * ) &tv, sizeof( tv ) );
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    addr.sin_port = htons( ( uint16_t ) port );
+    if ( connect( s, ( sockaddr * ) &addr, sizeof( addr ) ) == 0 && send_all( s, req.data(), req.size() ) ) {
+        char tmp[ 8192 ];
+        int n;
+        while ( ( n = ( int ) recv( s, tmp, ( int ) sizeof( tmp ), 0 ) ) > 0 ) got.append( tmp, ( size_t ) n );
     }
+    close_socket( s );
+    return got;
+}
 
-    scan_existing_maps( s.hl2mp_path, rs, log );
+// Range and HEAD requests against the loopback mirror's listing (a generated, in-memory body): the
+// status and bytes of each, and that the server still answers afterwards.
+static json bench_server_ranges( int port, const std::string &listing, bool &ok ) {
+    struct Case {
+        const char *range;
+        long status;
+        std::string body;
+    };
+    std::vector<Case> cases = {
+        { "bytes=0-9", 206, listing.substr( 0, 10 ) },
+        { "bytes=10-", 206, listing.substr( 10 ) },
+        { "bytes=-1", 206, listing.substr( listing.size() - 1 ) },
+        { "bytes=-999999999", 206, listing },
+        { "bytes=5-999999999", 206, listing.substr( 5 ) },
+        { "bytes=999999999-", 416, "" },
+        { "bytes=-0", 416, "" },
+        { "bytes=--1", 400, "bad range" },
+        { "bytes=9-5", 400, "bad range" },
+        { "bytes=abc", 400, "bad range" },
+        { "items=0-1", 400, "bad range" },
+    };
+    auto url = "http://127.0.0.1:" + std::to_string( port ) + "/hl2mp/maps/";
+    TransferEngine eng( 4 );
+    json out = json::array();
+    bool all = true;
+    for ( auto &c : cases ) {
+        auto r = http_get_text( eng, url, 5000, { std::string( "Range: " ) + c.range } ).get();
+        bool pass = r.err.empty() && r.status == c.status && r.body == c.body;
+        all = all && pass;
+        out.push_back( { { "range", c.range }, { "status", r.status }, { "ok", pass } } );
+    }
+    // HEAD answers with the size and no body, alone and pipelined ahead of a GET on one
+    // connection. curl drops a connection that sent a HEAD body, so these go over raw sockets.
+    auto head = http_head( eng, url, 5000 ).get();
+    std::string path = "/hl2mp/maps/";
+    std::string lone = raw_http_exchange( port, "HEAD " + path + " HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n" );
+    std::string piped = raw_http_exchange( port, "HEAD " + path + " HTTP/1.1\r\nHost: x\r\n\r\n"
+        "GET " + path + " HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n" );
+    auto head_end = piped.find( "\r\n\r\n" );
+    bool head_ok = head.err.empty() && head.status == 200 && head.content_length == ( long long ) listing.size() &&
+        lone.starts_with( "HTTP/1.1 200" ) && lone.ends_with( "\r\n\r\n" ) && lone.find( "\r\n\r\n" ) + 4 == lone.size() &&
+        head_end != std::string::npos && piped.compare( head_end + 4, 12, "HTTP/1.1 200" ) == 0 && piped.ends_with( "\r\n\r\n" + listing );
+    all = all && head_ok;
+    // A crash on any of the above would leave nothing listening.
+    auto after = http_get_text( eng, url, 5000 ).get();
+    all = all && after.status == 200 && after.body == listing;
+    ok = ok && all;
+    return { { "ok", all }, { "head_ok", head_ok }, { "cases", out } };
+}
 
-    std::vector<SourceEntry *> enabled;
-    for ( auto &src : sources ) if ( src.enabled ) enabled.push_back( &src );
-    if ( enabled.empty() ) {
-        log.fail( "[!] No enabled sources." );
-        return;
+// Full index/plan/fetch/extract runs against a loopback mirror: a cold sync, a warm one with
+// everything already present, and a cold one with streaming extraction.
+static json bench_end_to_end( const BenchOptions &o, const fs::path &work, bool &ok ) {
+    const int maps = o.quick ? 20 : 100;
+    const size_t map_size = o.quick ? ( 256u << 10 ) : ( 1u << 20 );
+
+    MiniHttpServer::Files files;
+    std::string listing = "<html><body><h1>Index of /hl2mp/maps</h1>\n";
+    long long tree_bytes = 0;
+    std::string body = bz2_compress( synthetic_bsp( map_size, 7 ) );
+    for ( int i = 0; i < maps; ++i ) {
+        char name[ 64 ];
+        std::snprintf( name, sizeof( name ), "dm_bench%04d.bsp.bz2", i );
+        listing += "<a href=\"" + std::string( name ) + "\">" + name + "</a>\n";
+        files[ "/hl2mp/maps/" + std::string( name ) ] = body;
+        tree_bytes += ( long long ) body.size();
     }
+    listing += "</body></html>\n";
+    files[ "/hl2mp/maps/" ] = listing;
+
+    MiniHttpServer server( std::move( files ) );
+    std::string err;
+    if ( !server.start( err ) ) {
+        ok = false;
+        return { { "error", err } };
+    }
+    json ranges = bench_server_ranges( server.port(), listing, ok );
 
-    auto includes = split_csv_terms( s.include_filters );
-    auto excludes = split_csv_terms( s.exclude_filters );
+    std::error_code ec;
+    std::vector<SourceEntry> sources{ SourceEntry{ "http://127.0.0.1:" + std::to_string( server.port() ) + "/hl2mp/maps/", true, -1, false, {} } };
+    auto one_run = [ & ]( const char *label, bool stream, bool fresh ) {
+        Settings s;
+        s.hl2mp_path = work / "hl2mp";
+        // Caches go to the scratch directory, not next to the binary.
+        s.data_dir = work;
+        s.threads = 8;
+        s.decompress = true;
+        s.stream_decompress = stream;
+        if ( fresh ) {
+            fs::remove_all( s.hl2mp_path, ec );
+            fs::remove( inventory_path( work ), ec );
+            fs::remove( index_cache_path( work ), ec );
+        }
+        fs::create_directories( s.hl2mp_path, ec );
 
-    rs.indexing.running.store( true );
-    rs.indexing.done.store( 0 );
-    rs.indexing.total.store( ( int ) enabled.size() );
-    log.push( "[i] Indexing sources..." );
+        RunState rs;
+        LiveLog log;
+        auto t0 = std::chrono::steady_clock::now();
+        bool started = run_pipeline( s, sources, rs, log );
+        double ms = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - t0 ).count();
+        long long failures = ( long long ) log.failures.pushed();
+        ok = ok && started && failures == 0;
+        long long bytes = rs.downloading.bytes.load();
+        return json{ { "case", label }, { "ms", ms }, { "downloaded", rs.downloading.done.load() },
+            { "bytes", bytes }, { "extracted_bytes", rs.decompressing.bytes_out.load() }, { "failures", failures },
+            { "mb_per_s", ms > 0 ? ( double ) bytes / ( 1024.0 * 1024.0 ) / ( ms / 1000.0 ) : 0.0 } };
+        };
 
-    std::mutex idx_mtx;
-    std::vector<SourceIndex> indexed;
+    json runs = json::array();
+    runs.push_back( one_run( "cold", false, true ) );
+    runs.push_back( one_run( "warm", false, false ) );
+    runs.push_back( one_run( "cold_stream", true, true ) );
 
-    auto worker_index = [ & ]( SourceEntry *src ) {
-        auto t0 = std::chrono::steady_clock::now();
-        auto r = http_get_text( src->url, s.index_timeout_ms );
-        auto t1 = std::chrono::steady_clock::now();
-        int ms = ( int ) std::chrono::duration_cast< std::chrono::milliseconds >( t1 - t0 ).count();
+    server.stop();
+    return { { "maps", maps }, { "tree_bytes", tree_bytes }, { "ranges", ranges }, { "runs", runs } };
+}
 
-        src->last_latency_ms = ms;
-        src->last_ok = ( r.err.empty() && r.status >= 200 && r.status < 400 );
+// --bench: every case above as one JSON document on stdout; exit 1 if a correctness check
+// (scanner vs regex, extraction, end-to-end failures) did not hold.
+static int run_bench( const BenchOptions &o ) {
+    curl_global_init( CURL_GLOBAL_DEFAULT );
+    std::error_code ec;
+    auto work = fs::temp_directory_path( ec ) /
+        ( "hl2dl-bench-" + std::to_string( std::chrono::steady_clock::now().time_since_epoch().count() ) );
+    fs::create_directories( work, ec );
+    if ( ec ) {
+        std::fprintf( stderr, "bench: cannot create %s: %s\n", work.string().c_str(), ec.message().c_str() );
+        curl_global_cleanup();
+        return 2;
+    }
 
-        SourceIndex si;
-        si.src = src;
-        if ( src->last_ok ) {
-            si.links = extract_map_links_from_index_html( src->url, r.body );
-            log.push( "[+] " + src->url + " -> " + std::to_string( si.links.size() ) + " file(s) (" +
-                std::to_string( ms ) + "ms)" );
-        }
-        else {
-            log.fail( "[IDX] " + src->url + " failed (" +
-                ( r.err.empty() ? ( "HTTP " + std::to_string( r.status ) ) : r.err ) + ")" );
-        }
+    bool ok = true;
+    json j;
+    j[ "type" ] = "bench";
+    j[ "quick" ] = o.quick;
+    j[ "hardware_threads" ] = std::thread::hardware_concurrency();
+    j[ "links" ] = bench_links( o, ok );
+    j[ "availability" ] = bench_availability( o, ok );
+    j[ "filters" ] = bench_filters( o, ok );
+    j[ "decompress" ] = bench_decompress( o, work, ok );
+    j[ "decompress_parallel" ] = bench_decompress_parallel( o, work, ok );
+    j[ "output" ] = bench_output( o, work );
+    j[ "end_to_end" ] = bench_end_to_end( o, work, ok );
+    j[ "ok" ] = ok;
+    std::fprintf( stdout, "%s\n", j.dump( 2 ).c_str() );
+
+    fs::remove_all( work, ec );
+    curl_global_cleanup();
+    return ok ? 0 : 1;
+}
 
-        {
-            std::lock_guard lk( idx_mtx );
-            indexed.push_back( std::move( si ) );
+// Reader-side rate over a byte counter that only grows during a run. Readings closer than
+// 200 ms are folded into the next one so a fast redraw does not look like a stall.
+struct RateMeter {
+    long long last = -1;
+    std::chrono::steady_clock::time_point at{};
+    double bps = 0;
+
+    double sample( long long bytes, std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now() ) {
+        if ( last < 0 || bytes < last ) {
+            last = bytes;
+            at = now;
+            bps = 0;
+            return bps;
         }
-        rs.indexing.done.fetch_add( 1 );
-        };
+        double dt = std::chrono::duration<double>( now - at ).count();
+        if ( dt < 0.2 ) return bps;
+        double inst = ( double ) ( bytes - last ) / dt;
+        bps = bps > 0 ? bps * 0.7 + inst * 0.3 : inst;
+        last = bytes;
+        at = now;
+        return bps;
+    }
+};
 
-    std::vector<std::future<void>> futs;
-    int threads = std::max( 1, s.threads );
-    std::atomic<int> in_flight{ 0 };
+// Meters for one viewer (the Run panel or the headless ticker); keyed by source URL.
+struct RunRates {
+    RateMeter download;
+    RateMeter decode;
+    std::map<std::string, RateMeter> sources;
+};
 
-    for ( auto *src : enabled ) {
-        while ( !rs.cancel.load() ) {
-            if ( in_flight.load() < threads ) break;
-            std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
-        }
-        if ( rs.cancel.load() ) break;
+// Plain copy of a PhaseProgress, read once so one frame or report works from one set of numbers.
+struct PhaseSnapshot {
+    bool running = false;
+    int done = 0;
+    int total = 0;
+    int sized = 0;
+    long long bytes = 0;
+    long long bytes_total = 0;
+    long long bytes_out = 0;
+
+    bool operator==( const PhaseSnapshot & ) const = default;
+};
 
-        in_flight.fetch_add( 1 );
-        futs.push_back( std::async( std::launch::async, [ &, src ] {
-            worker_index( src );
-            in_flight.fetch_sub( 1 );
-            } ) );
+static PhaseSnapshot snapshot_of( const PhaseProgress &p ) {
+    PhaseSnapshot s;
+    s.running = p.running.load();
+    s.done = p.done.load();
+    s.total = p.total.load();
+    s.sized = p.sized.load( std::memory_order_relaxed );
+    s.bytes = p.bytes.load( std::memory_order_relaxed );
+    s.bytes_total = p.bytes_total.load( std::memory_order_relaxed );
+    s.bytes_out = p.bytes_out.load( std::memory_order_relaxed );
+    return s;
+}
+
+// Bytes still to go at `bps`, or -1 when unknown. Files without an announced size are
+// assumed to be as large as the average of those that had one.
+static double phase_eta_seconds( const PhaseSnapshot &p, double bps ) {
+    if ( !p.running || bps <= 0 || p.sized <= 0 ) return -1;
+    int unsized = std::max( 0, p.total - p.sized );
+    double expected = ( double ) p.bytes_total + ( double ) unsized * ( ( double ) p.bytes_total / p.sized );
+    double left = expected - ( double ) p.bytes;
+    return left > 0 ? left / bps : 0;
+}
+
+static std::string format_bytes( double b ) {
+    static const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+    int u = 0;
+    while ( b >= 1024.0 && u < 4 ) {
+        b /= 1024.0;
+        ++u;
     }
-    for ( auto &f : futs ) f.wait();
+    char buf[ 32 ];
+    std::snprintf( buf, sizeof( buf ), u ? "%.1f %s" : "%.0f %s", b, units[ u ] );
+    return buf;
+}
 
-    rs.indexing.running.store( false );
+static std::string format_eta( double seconds ) {
+    if ( seconds < 0 ) return "--:--";
+    long long s = ( long long ) ( seconds + 0.5 );
+    char buf[ 32 ];
+    if ( s >= 3600 ) std::snprintf( buf, sizeof( buf ), "%lld:%02lld:%02lld", s / 3600, s / 60 % 60, s % 60 );
+    else std::snprintf( buf, sizeof( buf ), "%lld:%02lld", s / 60, s % 60 );
+    return buf;
+}
 
-    auto availability = build_availability( indexed );
+// Headless mode (--sync / --index / --watch) for cron and service hosts: no terminal UI,
+// the same settings.json and sources.json, and an exit status instead of a screen.
+enum HeadlessExit {
+    EXIT_HEADLESS_OK = 0,
+    EXIT_HEADLESS_FAILURES = 1,
+    EXIT_HEADLESS_SETUP = 2,
+    EXIT_HEADLESS_INTERRUPTED = 130,
+};
 
-    int remote_unique = ( int ) availability.size();
-    int remote_after_filters = 0;
-    int already_have = 0;
-    int to_download = 0;
+struct HeadlessOptions {
+    bool index_only = false;
+    bool probe_only = false;
+    // --serve: share download/maps on this port; serve_only when no run was asked for as well.
+    int serve_port = 0;
+    bool serve_only = false;
+    bool json_progress = false;
+    int watch_minutes = 0;
+    int tick_ms = 1000;
+    bool verify = false;
+    bool trace = false;
+    bool help = false;
+};
 
-    std::vector<std::string> to_get;
-    to_get.reserve( availability.size() );
+static volatile std::sig_atomic_t g_stop_requested = 0;
 
-    for ( auto &[name, srcs] : availability ) {
-        if ( !passes_filters( name, includes, excludes ) ) continue;
-        remote_after_filters++;
+static void on_stop_signal( int ) {
+    g_stop_requested = 1;
+}
 
-        if ( rs.existing_files.contains( name ) ) already_have++;
-        else {
-            to_download++;
-            to_get.push_back( name );
-        }
-    }
+static void print_headless_usage() {
+    std::fprintf( stderr,
+        "usage: hl2mp-maps-downloader [--sync | --index | --probe] [--watch <minutes>] [--serve <port>] [--verify] [--trace] [--json-progress] [--tick-ms <ms>]\n"
+        "  --sync            index all enabled sources and download missing maps\n"
+        "  --index           index only; report what a sync would download\n"
+        "  --probe           measure each enabled source's TTFB and save it to sources.json\n"
+        "  --serve <port>    share download/maps and manifest.json with LAN peers at :<port>/maps/,\n"
+        "                    alone or alongside --sync/--watch; add it on clients as a peer source\n"
+        "  --watch <min>     repeat the sync every <min> minutes until interrupted\n"
+        "  --verify          re-hash every downloaded map against manifest.json first\n"
+        "                    (--verify, --trace and --tick-ms need one of the modes above)\n"
+        "  --trace           profile each run: logs/trace_<time>.json (chrome://tracing, Perfetto)\n"
+        "                    and a per-span summary in the session log\n"
+        "  --json-progress   one JSON object per tick on stdout instead of plain log lines\n"
+        "  --tick-ms <ms>    progress/log flush interval (default 1000)\n"
+        "  --bench [--quick] [--corpus <dir>]  stage benchmarks as JSON on stdout\n"
+        "exit: 0 ok, 1 some files failed, 2 could not start, 130 interrupted\n" );
+}
 
-    rs.last_remote_unique.store( remote_unique );
-    rs.last_remote_after_filters.store( remote_after_filters );
-    rs.last_already_have.store( already_have );
-    rs.last_to_download.store( to_download );
+static json phase_json( const PhaseProgress &p ) {
+    return { { "running", p.running.load() }, { "done", p.done.load() }, { "total", p.total.load() } };
+}
 
-    log.push( "[i] Remote unique files: " + std::to_string( remote_unique ) );
-    log.push( "[i] After filters: " + std::to_string( remote_after_filters ) );
-    log.push( "[i] Already present locally: " + std::to_string( already_have ) );
-    log.push( "[i] Unique maps to download: " + std::to_string( to_download ) );
+static json phase_json( const PhaseProgress &p, RateMeter &m ) {
+    json j = phase_json( p );
+    double bps = m.sample( p.bytes.load( std::memory_order_relaxed ) );
+    j[ "bytes" ] = p.bytes.load( std::memory_order_relaxed );
+    j[ "bytes_total" ] = p.bytes_total.load( std::memory_order_relaxed );
+    j[ "bytes_out" ] = p.bytes_out.load( std::memory_order_relaxed );
+    j[ "sized" ] = p.sized.load( std::memory_order_relaxed );
+    j[ "bytes_per_sec" ] = ( long long ) bps;
+    double eta = phase_eta_seconds( snapshot_of( p ), bps );
+    j[ "eta_s" ] = eta < 0 ? json() : json( ( long long ) ( eta + 0.5 ) );
+    return j;
+}
 
-    rs.downloading.running.store( true );
-    rs.downloading.done.store( 0 );
-    rs.downloading.total.store( ( int ) to_get.size() );
-
-    std::atomic<int> dl_inflight{ 0 };
-    std::vector<std::future<void>> dl_futs;
-
-    for ( auto &name : to_get ) {
-        while ( !rs.cancel.load() ) {
-            if ( dl_inflight.load() < threads ) break;
-            std::this_thread::sleep_for( std::chrono::milliseconds( 5 ) );
-        }
-        if ( rs.cancel.load() ) break;
-
-        dl_inflight.fetch_add( 1 );
-        dl_futs.push_back( std::async( std::launch::async, [ &, name ] {
-            auto &srcs = availability[ name ];
-            auto *best = pick_best_source( srcs );
-            if ( !best ) {
-                log.fail( "[DL] No source for: " + name );
-                rs.downloading.done.fetch_add( 1 );
-                dl_inflight.fetch_sub( 1 );
-                return;
-            }
-            auto url = url_join( best->url, name );
-            auto out = dl_dir / name;
-            if ( !download_file( url, out, s.dl_timeout_ms, s.retries, rs.cancel, log ) ) {
-                rs.downloading.done.fetch_add( 1 );
-                dl_inflight.fetch_sub( 1 );
-                return;
-            }
-            rs.downloading.done.fetch_add( 1 );
-            dl_inflight.fetch_sub( 1 );
-            } ) );
+static json traffic_json( RunState &rs, RunRates &rates ) {
+    json arr = json::array();
+    std::lock_guard lk( rs.traffic_mtx );
+    for ( auto &t : rs.traffic ) {
+        long long b = t->bytes.load( std::memory_order_relaxed );
+        arr.push_back( { { "url", t->url }, { "bytes", b }, { "bytes_per_sec", ( long long ) rates.sources[ t->url ].sample( b ) } } );
     }
-    for ( auto &f : dl_futs ) f.wait();
-    rs.downloading.running.store( false );
+    return arr;
+}
 
-    if ( rs.cancel.load() ) {
-        log.push( "[i] Cancelled." );
+// Emits everything new since the previous call. Called from the ticker only, so output
+// volume depends on the tick rate rather than on how many events a run produces.
+static void headless_report( const HeadlessOptions &o, RunState &rs, LiveLog &log, RunRates &rates,
+    uint64_t &seen_lines, uint64_t &seen_fail ) {
+    std::vector<std::string> lines, fails;
+    seen_lines = log.lines.read_since( seen_lines, lines );
+    seen_fail = log.failures.read_since( seen_fail, fails );
+
+    if ( !o.json_progress ) {
+        for ( auto &l : lines ) std::fprintf( stdout, "%s\n", l.c_str() );
+        for ( auto &l : fails ) std::fprintf( stderr, "%s\n", l.c_str() );
+        std::fflush( stdout );
         return;
     }
 
-    if ( s.decompress ) {
-        std::vector<fs::path> bz2s;
-        for ( auto &e : fs::directory_iterator( dl_dir ) ) {
-            if ( !e.is_regular_file() ) continue;
-            auto ext = lower_copy( e.path().extension().string() );
-            if ( ext == ".bz2" ) bz2s.push_back( e.path() );
-        }
+    json j;
+    j[ "type" ] = "progress";
+    j[ "stage" ] = rs.stage.load();
+    j[ "indexing" ] = phase_json( rs.indexing );
+    j[ "downloading" ] = phase_json( rs.downloading, rates.download );
+    j[ "decompressing" ] = phase_json( rs.decompressing, rates.decode );
+    j[ "deleting" ] = phase_json( rs.deleting );
+    j[ "sources" ] = traffic_json( rs, rates );
+    j[ "log" ] = lines;
+    j[ "failures" ] = fails;
+    std::fprintf( stdout, "%s\n", j.dump().c_str() );
+    std::fflush( stdout );
+}
 
-        rs.decompressing.running.store( true );
-        rs.decompressing.done.store( 0 );
-        rs.decompressing.total.store( ( int ) bz2s.size() );
-        log.push( "[i] Decompressing .bz2: " + std::to_string( bz2s.size() ) );
+static int run_headless( const HeadlessOptions &o ) {
+    curl_global_init( CURL_GLOBAL_DEFAULT );
+    std::signal( SIGINT, on_stop_signal );
+    std::signal( SIGTERM, on_stop_signal );
 
-        std::atomic<int> bz_inflight{ 0 };
-        std::vector<std::future<void>> bz_futs;
+    LiveLog log;
+    ensure_logs_dir( log );
+    log.begin_session( session_log_path() );
+    auto sources = load_sources( log );
+    auto settings = load_settings( log );
+    {
+        auto found = resolve_hl2mp_dir( settings.hl2mp_path, settings.steam );
+        if ( found.path ) settings.hl2mp_path = *found.path;
+        // Keep a fresh search for the next start; nothing else headless changes is saved.
+        if ( !( found.steam == settings.steam ) ) {
+            settings.steam = found.steam;
+            save_settings( settings, log );
+        }
+    }
+    settings.verify_local = o.verify;
+    settings.trace = o.trace;
+
+    // The share stays up for the whole session: between watch passes, and while this
+    // instance is syncing the very maps it serves (only finished files are listed).
+    std::unique_ptr<MiniHttpServer> share;
+    if ( o.serve_port > 0 ) {
+        auto dir = settings.hl2mp_path / "download" / "maps";
+        share = std::make_unique<MiniHttpServer>( MiniHttpServer::Files{} );
+        share->mount( "/maps/", dir, { { "manifest.json", manifest_path( app_dir() ) } } );
+        std::string err = "HL2MP path invalid";
+        if ( settings.hl2mp_path.empty() || !share->start( err, o.serve_port, true ) ) {
+            std::fprintf( stderr, "[!] --serve: %s\n", err.c_str() );
+            log.end_session();
+            curl_global_cleanup();
+            return EXIT_HEADLESS_SETUP;
+        }
+        log.pushf( "[i] Serving %s to LAN peers at http://<this host>:%d/maps/", dir.string().c_str(), share->port() );
+    }
 
-        for ( auto &bz2 : bz2s ) {
-            while ( !rs.cancel.load() ) {
-                if ( bz_inflight.load() < threads ) break;
-                std::this_thread::sleep_for( std::chrono::milliseconds( 5 ) );
+    RunState rs;
+    RunRates rates;
+    uint64_t seen_lines = 0, seen_fail = 0;
+    std::mutex tick_mtx;
+    std::condition_variable tick_cv;
+    bool finished = false;
+
+    // The ticker owns all output and turns a signal into a cancel; a handler may not lock.
+    std::thread ticker( [ & ] {
+        std::unique_lock lk( tick_mtx );
+        while ( !finished ) {
+            tick_cv.wait_for( lk, std::chrono::milliseconds( o.tick_ms ) );
+            if ( g_stop_requested && !rs.cancel.load() ) {
+                rs.request_cancel();
+                tick_cv.notify_all();
             }
-            if ( rs.cancel.load() ) break;
+            headless_report( o, rs, log, rates, seen_lines, seen_fail );
+        }
+        } );
 
-            bz_inflight.fetch_add( 1 );
-            bz_futs.push_back( std::async( std::launch::async, [ &, bz2 ] {
-                auto out = bz2;
-                out.replace_extension( "" );
-                if ( !decompress_bz2_to_file( bz2, out, s.retries, rs.cancel, log ) ) {
-                    rs.decompressing.done.fetch_add( 1 );
-                    bz_inflight.fetch_sub( 1 );
-                    return;
-                }
-                rs.decompressing.done.fetch_add( 1 );
-                bz_inflight.fetch_sub( 1 );
-                } ) );
-        }
-        for ( auto &f : bz_futs ) f.wait();
-        rs.decompressing.running.store( false );
-
-        if ( s.delete_bz2 && !rs.cancel.load() ) {
-            rs.deleting.running.store( true );
-            rs.deleting.done.store( 0 );
-            rs.deleting.total.store( ( int ) bz2s.size() );
-            log.push( "[i] Deleting .bz2 files..." );
-
-            for ( auto &bz2 : bz2s ) {
-                if ( rs.cancel.load() ) break;
-                std::error_code dec;
-                fs::remove( bz2, dec );
-                if ( dec ) log.fail( "[DEL] " + bz2.filename().string() + " -> " + dec.message() );
-                rs.deleting.done.fetch_add( 1 );
-            }
-            rs.deleting.running.store( false );
+    int code = EXIT_HEADLESS_OK;
+    if ( o.serve_only ) {
+        std::unique_lock lk( tick_mtx );
+        tick_cv.wait( lk, [ & ] { return g_stop_requested != 0; } );
+    }
+    while ( !o.serve_only ) {
+        uint64_t failed_before = log.failures.pushed();
+        bool started = o.probe_only ? run_source_probe( settings, sources, rs, log )
+            : o.index_only ? run_index_only( settings, sources, rs, log ) : run_pipeline( settings, sources, rs, log );
+        save_sources( sources, log );
+        // Later watch passes only re-hash maps whose size or mtime moved.
+        settings.verify_local = false;
+
+        if ( !started ) code = EXIT_HEADLESS_SETUP;
+        else if ( g_stop_requested || rs.cancel.load() ) code = EXIT_HEADLESS_INTERRUPTED;
+        else code = log.failures.pushed() > failed_before ? EXIT_HEADLESS_FAILURES : EXIT_HEADLESS_OK;
+
+        if ( o.watch_minutes <= 0 || code == EXIT_HEADLESS_SETUP || code == EXIT_HEADLESS_INTERRUPTED ) break;
+
+        // Later passes hit the listing cache (304s) and the inventory, so they only fetch new maps.
+        log.push( "[i] Next sync in " + std::to_string( o.watch_minutes ) + " min." );
+        auto next = std::chrono::steady_clock::now() + std::chrono::minutes( o.watch_minutes );
+        std::unique_lock lk( tick_mtx );
+        tick_cv.wait_until( lk, next, [ & ] { return g_stop_requested != 0; } );
+        if ( g_stop_requested ) {
+            code = EXIT_HEADLESS_INTERRUPTED;
+            break;
         }
     }
 
-    log.push( "[i] Done." );
+    {
+        std::lock_guard lk( tick_mtx );
+        finished = true;
+    }
+    tick_cv.notify_all();
+    ticker.join();
+    headless_report( o, rs, log, rates, seen_lines, seen_fail );
+    if ( o.json_progress ) {
+        json j;
+        j[ "type" ] = "result";
+        j[ "exit" ] = code;
+        j[ "remote_unique" ] = rs.last_remote_unique.load();
+        j[ "after_filters" ] = rs.last_remote_after_filters.load();
+        j[ "already_have" ] = rs.last_already_have.load();
+        j[ "to_download" ] = rs.last_to_download.load();
+        j[ "failures" ] = log.failures.pushed();
+        std::fprintf( stdout, "%s\n", j.dump().c_str() );
+    }
+
+    log.end_session();
+    curl_global_cleanup();
+    return code;
+}
+
+// Returns true and fills o if argv asks for headless mode; bad arguments set bad_args.
+static bool parse_headless_args( int argc, char **argv, HeadlessOptions &o, bool &bad_args ) {
+    // modifier: --verify, --trace, --tick-ms; they only change how a headless run behaves.
+    bool headless = false, run = false, modifier = false;
+    bad_args = false;
+    for ( int i = 1; i < argc; ++i ) {
+        std::string_view a = argv[ i ];
+        auto int_arg = [ & ]( int lo ) {
+            if ( i + 1 >= argc ) { bad_args = true; return lo; }
+            return std::max( lo, std::atoi( argv[ ++i ] ) );
+            };
+        if ( a == "--sync" ) run = true;
+        else if ( a == "--index" ) { run = true; o.index_only = true; }
+        else if ( a == "--probe" ) { run = true; o.probe_only = true; }
+        else if ( a == "--watch" ) { run = true; o.watch_minutes = int_arg( 1 ); }
+        else if ( a == "--serve" ) { headless = true; o.serve_port = std::min( int_arg( 1 ), 65535 ); }
+        else if ( a == "--json-progress" ) { headless = true; o.json_progress = true; }
+        else if ( a == "--tick-ms" ) { modifier = true; o.tick_ms = int_arg( 50 ); }
+        else if ( a == "--verify" ) { modifier = true; o.verify = true; }
+        else if ( a == "--trace" ) { modifier = true; o.trace = true; }
+        else if ( a == "--help" || a == "-h" ) o.help = true;
+        else bad_args = true;
+    }
+    // Alone they would open the TUI and be ignored; that is a usage error.
+    if ( modifier && !run && !headless ) bad_args = true;
+    o.serve_only = o.serve_port > 0 && !run;
+    return headless || run || bad_args || o.help;
 }
 
-static float progress01( const PhaseProgress &p ) {
-    int t = p.total.load();
-    int d = p.done.load();
-    if ( t <= 0 ) return 0.f;
-    float v = ( float ) d / ( float ) t;
+static float progress01( const PhaseSnapshot &p ) {
+    if ( p.total <= 0 ) return 0.f;
+    float v = ( float ) p.done / ( float ) p.total;
     if ( v < 0.f ) v = 0.f;
     if ( v > 1.f ) v = 1.f;
     return v;
 }
 
-int main() {
+// What the Run and Logs tabs draw, copied off the workers' state by the refresh ticker. The
+// UI thread renders from this only, so it never walks the log rings or the traffic list.
+struct UiSnapshot {
+    std::chrono::steady_clock::time_point taken{};
+    bool running = false;
+    PhaseSnapshot indexing, downloading, decompressing, deleting;
+    std::vector<std::pair<std::string, long long>> traffic;
+    int remote_unique = 0;
+    int after_filters = 0;
+    int already_have = 0;
+    int to_download = 0;
+    uint64_t lines_pushed = 0;
+    uint64_t failures_pushed = 0;
+    std::vector<std::string> lines;
+    std::vector<std::string> failures;
+
+    // Same picture: equal counters and no new log lines; taken and the text are not compared.
+    bool same_frame( const UiSnapshot &o ) const {
+        return running == o.running && indexing == o.indexing && downloading == o.downloading &&
+            decompressing == o.decompressing && deleting == o.deleting && traffic == o.traffic &&
+            remote_unique == o.remote_unique && after_filters == o.after_filters && already_have == o.already_have &&
+            to_download == o.to_download && lines_pushed == o.lines_pushed && failures_pushed == o.failures_pushed;
+    }
+};
+
+static UiSnapshot take_ui_snapshot( RunState &rs, const LiveLog &log, bool running ) {
+    UiSnapshot s;
+    s.taken = std::chrono::steady_clock::now();
+    s.running = running;
+    s.indexing = snapshot_of( rs.indexing );
+    s.downloading = snapshot_of( rs.downloading );
+    s.decompressing = snapshot_of( rs.decompressing );
+    s.deleting = snapshot_of( rs.deleting );
+    {
+        std::lock_guard lk( rs.traffic_mtx );
+        for ( auto &t : rs.traffic ) s.traffic.emplace_back( t->url, t->bytes.load( std::memory_order_relaxed ) );
+    }
+    s.remote_unique = rs.last_remote_unique.load();
+    s.after_filters = rs.last_remote_after_filters.load();
+    s.already_have = rs.last_already_have.load();
+    s.to_download = rs.last_to_download.load();
+    // Counts first: a line pushed in between shows up in the next frame rather than never.
+    s.lines_pushed = log.lines.pushed();
+    s.failures_pushed = log.failures.pushed();
+    s.lines = log.lines.newest( 20 );
+    s.failures = log.failures.newest( 30 );
+    return s;
+}
+
+int main( int argc, char **argv ) {
+    if ( argc >= 2 && std::string_view( argv[ 1 ] ) == "--bench" ) {
+        BenchOptions bench;
+        for ( int i = 2; i < argc; ++i ) {
+            std::string_view a = argv[ i ];
+            if ( a == "--quick" ) bench.quick = true;
+            else if ( a == "--corpus" && i + 1 < argc ) bench.corpus = argv[ ++i ];
+            else {
+                std::fprintf( stderr, "usage: hl2dl --bench [--quick] [--corpus <dir of .bz2 maps>]\n" );
+                return EXIT_HEADLESS_SETUP;
+            }
+        }
+        return run_bench( bench );
+    }
+
+    HeadlessOptions headless;
+    bool bad_args = false;
+    if ( parse_headless_args( argc, argv, headless, bad_args ) ) {
+        if ( bad_args || headless.help ) {
+            print_headless_usage();
+            return headless.help && !bad_args ? EXIT_HEADLESS_OK : EXIT_HEADLESS_SETUP;
+        }
+        return run_headless( headless );
+    }
+
     curl_global_init( CURL_GLOBAL_DEFAULT );
 
     LiveLog log;
     ensure_logs_dir( log );
+    log.begin_session( session_log_path() );
 
     auto sources = load_sources( log );
     auto settings = load_settings( log );
 
-    if ( settings.hl2mp_path.empty() || !fs::exists( settings.hl2mp_path ) ) {
-        auto found = find_hl2mp_dir();
-        if ( found ) settings.hl2mp_path = *found;
-    }
-
     RunState rs;
 
     using namespace ftxui;
@@ -943,31 +6553,90 @@ int main() {
 
     std::string hl2mp_path_str = settings.hl2mp_path.string();
     std::string threads_str = std::to_string( settings.threads > 0 ? settings.threads : default_threads() );
+    std::string per_src_str = std::to_string( settings.per_source_connections );
+    std::string bz_threads_str = std::to_string( settings.decompress_threads );
     std::string idx_to_str = std::to_string( settings.index_timeout_ms );
     std::string dl_to_str = std::to_string( settings.dl_timeout_ms );
     std::string head_to_str = std::to_string( settings.head_timeout_ms );
     std::string retries_str = std::to_string( settings.retries );
+    std::string crawl_depth_str = std::to_string( settings.crawl_depth );
+    std::string crawl_max_str = std::to_string( settings.crawl_max_requests );
+    std::string rate_str = std::to_string( settings.rate_limit_kbps );
+    std::string src_rate_str = std::to_string( settings.source_rate_limit_kbps );
+    std::string rate_schedule_str = settings.rate_schedule;
+    std::string ui_hz_str = std::to_string( settings.ui_refresh_hz );
+    std::string write_buf_str = std::to_string( settings.write_buffer_kb );
+    std::vector<std::string> write_modes = { "stdio", "buffered", "direct", "mmap" };
+    int write_mode_idx = ( int ) settings.write_mode;
+    std::vector<std::string> fsync_policies = { "never", "file", "file+dir" };
+    int fsync_idx = ( int ) settings.fsync_policy;
+    std::vector<std::string> fetch_orders = { "name", "largest first", "smallest first" };
+    int fetch_order_idx = ( int ) settings.fetch_order;
+    std::vector<std::string> prune_modes = { "keep", "delete", "archive" };
+    int prune_idx = ( int ) settings.prune;
 
     std::string include_filters_str = settings.include_filters;
     std::string exclude_filters_str = settings.exclude_filters;
 
+    auto apply_ui_to_settings = [ & ] {
+        settings.hl2mp_path = fs::path( trim( hl2mp_path_str ) );
+        settings.threads = std::max( 1, std::atoi( trim( threads_str ).c_str() ) );
+        settings.per_source_connections = std::max( 1, std::atoi( trim( per_src_str ).c_str() ) );
+        settings.decompress_threads = std::max( 0, std::atoi( trim( bz_threads_str ).c_str() ) );
+
+        settings.include_filters = trim( include_filters_str );
+        settings.exclude_filters = trim( exclude_filters_str );
+
+        settings.index_timeout_ms = std::max( 1000, std::atoi( trim( idx_to_str ).c_str() ) );
+        settings.head_timeout_ms = std::max( 500, std::atoi( trim( head_to_str ).c_str() ) );
+        settings.dl_timeout_ms = std::max( 5000, std::atoi( trim( dl_to_str ).c_str() ) );
+        settings.retries = std::clamp( std::atoi( trim( retries_str ).c_str() ), 0, 20 );
+        settings.crawl_depth = std::clamp( std::atoi( trim( crawl_depth_str ).c_str() ), 0, 8 );
+        settings.crawl_max_requests = std::max( 1, std::atoi( trim( crawl_max_str ).c_str() ) );
+        settings.write_mode = ( WriteMode ) std::clamp( write_mode_idx, 0, 3 );
+        settings.write_buffer_kb = std::clamp( std::atoi( trim( write_buf_str ).c_str() ), 4, 64 * 1024 );
+        settings.fsync_policy = ( FsyncPolicy ) std::clamp( fsync_idx, 0, 2 );
+        settings.fetch_order = ( FetchOrder ) std::clamp( fetch_order_idx, 0, 2 );
+        settings.rate_limit_kbps = std::max( 0, std::atoi( trim( rate_str ).c_str() ) );
+        settings.source_rate_limit_kbps = std::max( 0, std::atoi( trim( src_rate_str ).c_str() ) );
+        settings.rate_schedule = trim( rate_schedule_str );
+        settings.ui_refresh_hz = std::clamp( std::atoi( trim( ui_hz_str ).c_str() ), 1, 60 );
+        settings.prune = ( PruneMode ) std::clamp( prune_idx, 0, 2 );
+        };
+
     auto settings_view = Container::Vertical( {
         Input( &hl2mp_path_str, "Path to hl2mp" ),
         Input( &threads_str, "Threads" ),
+        Input( &per_src_str, "Connections per mirror" ),
+        Input( &bz_threads_str, "Decompress threads (0 = auto)" ),
 
         Input( &include_filters_str, "Include filters (comma)" ),
         Input( &exclude_filters_str, "Exclude filters (comma)" ),
 
         Checkbox( "Decompress .bz2", &settings.decompress ),
         Checkbox( "Delete .bz2 after extract", &settings.delete_bz2 ),
+        Checkbox( "Decompress while downloading (streaming)", &settings.stream_decompress ),
+        Toggle( &write_modes, &write_mode_idx ),
+        Input( &write_buf_str, "Write buffer (KiB)" ),
+        Toggle( &fsync_policies, &fsync_idx ),
 
         Input( &idx_to_str, "Index timeout (ms)" ),
         Input( &head_to_str, "HEAD timeout (ms)" ),
         Input( &dl_to_str, "Download timeout (ms)" ),
         Input( &retries_str, "Retries" ),
+        Input( &crawl_depth_str, "Crawl depth" ),
+        Input( &crawl_max_str, "Listings per source" ),
+        Checkbox( "Probe sizes (HEAD) before downloading", &settings.probe_sizes ),
+        Toggle( &fetch_orders, &fetch_order_idx ),
+        Input( &rate_str, "KiB/s (0 = no cap)" ),
+        Input( &src_rate_str, "KiB/s per mirror (0 = no cap)" ),
+        Input( &rate_schedule_str, "e.g. 18:00-23:30=512" ),
+        Input( &ui_hz_str, "UI refresh (Hz)" ),
+        Checkbox( "Re-fetch maps replaced upstream", &settings.refetch_changed ),
+        Toggle( &prune_modes, &prune_idx ),
 
         Button( "Auto-detect hl2mp", [ & ] {
-            auto found = find_hl2mp_dir();
+            auto found = find_hl2mp_dir( &settings.steam );
             if ( found ) {
                 settings.hl2mp_path = *found;
                 hl2mp_path_str = settings.hl2mp_path.string();
@@ -979,17 +6648,7 @@ int main() {
         } ),
 
         Button( "Save", [ & ] {
-            settings.hl2mp_path = fs::path( trim( hl2mp_path_str ) );
-            settings.threads = std::max( 1, std::atoi( trim( threads_str ).c_str() ) );
-
-            settings.include_filters = trim( include_filters_str );
-            settings.exclude_filters = trim( exclude_filters_str );
-
-            settings.index_timeout_ms = std::max( 1000, std::atoi( trim( idx_to_str ).c_str() ) );
-            settings.head_timeout_ms = std::max( 500, std::atoi( trim( head_to_str ).c_str() ) );
-            settings.dl_timeout_ms = std::max( 5000, std::atoi( trim( dl_to_str ).c_str() ) );
-            settings.retries = std::clamp( std::atoi( trim( retries_str ).c_str() ), 0, 20 );
-
+            apply_ui_to_settings();
             save_settings( settings, log );
             log.push( "[i] Saved settings.json" );
         } ),
@@ -998,18 +6657,10 @@ int main() {
     std::atomic<bool> running{ false };
     std::thread runner;
 
-    auto apply_ui_to_settings = [ & ] {
-        settings.hl2mp_path = fs::path( trim( hl2mp_path_str ) );
-        settings.threads = std::max( 1, std::atoi( trim( threads_str ).c_str() ) );
-
-        settings.include_filters = trim( include_filters_str );
-        settings.exclude_filters = trim( exclude_filters_str );
-
-        settings.index_timeout_ms = std::max( 1000, std::atoi( trim( idx_to_str ).c_str() ) );
-        settings.head_timeout_ms = std::max( 1000, std::atoi( trim( head_to_str ).c_str() ) );
-        settings.dl_timeout_ms = std::max( 5000, std::atoi( trim( dl_to_str ).c_str() ) );
-        settings.retries = std::clamp( std::atoi( trim( retries_str ).c_str() ), 0, 20 );
-        };
+    // Replaced by the refresh ticker (through screen.Post) and read by the renderers; both on
+    // the UI thread. Frozen, the ticker stops sending frames and the last picture stays up.
+    std::shared_ptr<const UiSnapshot> ui_snap = std::make_shared<const UiSnapshot>( take_ui_snapshot( rs, log, false ) );
+    std::atomic<bool> ui_frozen{ false };
 
     auto start_btn = Button( "Start", [ & ] {
         if ( running.load() ) return;
@@ -1025,7 +6676,6 @@ int main() {
         runner = std::thread( [ & ] {
             run_pipeline( settings, sources, rs, log );
             save_sources( sources, log );
-            write_session_log( log );
             running.store( false );
             } );
         } );
@@ -1044,32 +6694,62 @@ int main() {
         runner = std::thread( [ & ] {
             run_index_only( settings, sources, rs, log );
             save_sources( sources, log );
-            write_session_log( log );
             running.store( false );
             } );
         } );
 
-    auto cancel_btn = Button( "Cancel", [ & ] { rs.cancel.store( true ); } );
+    auto probe_btn = Button( "Probe", [ & ] {
+        if ( running.load() ) return;
+
+        apply_ui_to_settings();
+        rs.cancel.store( false );
+        running.store( true );
+
+        if ( runner.joinable() ) runner.join();
+        runner = std::thread( [ & ] {
+            run_source_probe( settings, sources, rs, log );
+            save_sources( sources, log );
+            running.store( false );
+            } );
+        } );
+
+    auto cancel_btn = Button( "Cancel", [ & ] { rs.request_cancel(); } );
 
-    auto run_view = Container::Vertical( { start_btn, index_btn, cancel_btn } );
+    auto run_view = Container::Vertical( { start_btn, index_btn, probe_btn, cancel_btn } );
+
+    RunRates rates;
 
     auto run_panel = Renderer( run_view, [ & ] {
-        auto phase = [ & ]( const char *name, const PhaseProgress &p ) {
-            int d = p.done.load();
-            int t = p.total.load();
+        const UiSnapshot &snap = *ui_snap;
+        auto phase = [ & ]( const char *name, const PhaseSnapshot &p, RateMeter *meter = nullptr ) {
+            std::string detail;
+            if ( meter ) {
+                double bps = meter->sample( p.bytes, snap.taken );
+                if ( p.bytes > 0 || p.running )
+                    detail = "  " + format_bytes( ( double ) p.bytes ) + "  " + format_bytes( bps ) + "/s  ETA " +
+                        format_eta( phase_eta_seconds( p, bps ) );
+            }
             return hbox( {
                 text( std::string( name ) + " " ) | size( WIDTH, EQUAL, 16 ),
                 gauge( progress01( p ) ) | flex,
-                text( " " + std::to_string( d ) + "/" + std::to_string( t ) )
+                text( " " + std::to_string( p.done ) + "/" + std::to_string( p.total ) + detail )
                 } );
             };
 
+        Elements traffic;
+        for ( auto &[ url, b ] : snap.traffic ) {
+            if ( b <= 0 ) continue;
+            double bps = rates.sources[ url ].sample( b, snap.taken );
+            traffic.push_back( text( "  " + url_host( url ) + "  " + format_bytes( ( double ) b ) + "  " +
+                format_bytes( bps ) + "/s" ) );
+        }
+
         auto stats = vbox( {
             text( "Last Index Summary" ) | bold,
-            text( "Remote unique: " + std::to_string( rs.last_remote_unique.load() ) ),
-            text( "After filters: " + std::to_string( rs.last_remote_after_filters.load() ) ),
-            text( "Already have: " + std::to_string( rs.last_already_have.load() ) ),
-            text( "Would download: " + std::to_string( rs.last_to_download.load() ) ),
+            text( "Remote unique: " + std::to_string( snap.remote_unique ) ),
+            text( "After filters: " + std::to_string( snap.after_filters ) ),
+            text( "Already have: " + std::to_string( snap.already_have ) ),
+            text( "Would download: " + std::to_string( snap.to_download ) ),
             } ) | border;
 
         return vbox( {
@@ -1080,19 +6760,24 @@ int main() {
                 text( "  " ),
                 index_btn->Render(),
                 text( "  " ),
+                probe_btn->Render(),
+                text( "  " ),
                 cancel_btn->Render(),
-                text( running.load() ? "  (running)" : "" )
+                text( running.load() ? "  (running)" : "" ),
+                text( ui_frozen.load() ? "  [display frozen, F9 resumes]" : "" )
             } ),
             separator(),
-            phase( "Indexing", rs.indexing ),
-            phase( "Downloading", rs.downloading ),
-            phase( "Decompress", rs.decompressing ),
-            phase( "Deleting", rs.deleting ),
+            phase( "Indexing", snap.indexing ),
+            phase( "Downloading", snap.downloading, &rates.download ),
+            phase( "Decompress", snap.decompressing, &rates.decode ),
+            phase( "Deleting", snap.deleting ),
+            vbox( std::move( traffic ) ),
             separator(),
             stats,
             separator(),
             text( "Note: sources/links must be end with \"/maps/\", e.g. https://www.example.com/hl2mp/maps/." ),
             text( "Tip: Indexing will only show the number of maps that will be downloaded per your filters, if any." ),
+            text( "F9 freezes the display (e.g. while the window is minimised); the sync keeps running." ),
             } ) | border;
         } );
 
@@ -1106,39 +6791,65 @@ int main() {
             ftxui::separator(),
 
             line( "HL2DM hl2mp folder:", settings_view->ChildAt( 0 ) ),
-            line( "Threads (parallel workers):", settings_view->ChildAt( 1 ) ),
+            line( "Threads (parallel transfers):", settings_view->ChildAt( 1 ) ),
+            line( "Connections per mirror (upper bound):", settings_view->ChildAt( 2 ) ),
+            line( "Decompress threads (0 = one per CPU core):", settings_view->ChildAt( 3 ) ),
+
+            ftxui::separator(),
+            line( "Include filters (comma-separated; text, dm_*, *.bsp, re:<regex>, !term excludes):", settings_view->ChildAt( 4 ) ),
+            line( "Exclude filters (comma-separated, same syntax):", settings_view->ChildAt( 5 ) ),
+
+            ftxui::separator(),
+            settings_view->ChildAt( 6 )->Render(),
+            settings_view->ChildAt( 7 )->Render(),
+            settings_view->ChildAt( 8 )->Render(),
+
+            ftxui::separator(),
+            line( "Write path (stdio = plain fwrite; direct/mmap need POSIX):", settings_view->ChildAt( 9 ) ),
+            line( "Write buffer (KiB):", settings_view->ChildAt( 10 ) ),
+            line( "fsync finished maps:", settings_view->ChildAt( 11 ) ),
+
+            ftxui::separator(),
+            line( "Index timeout (ms):", settings_view->ChildAt( 12 ) ),
+            line( "HEAD timeout (ms):", settings_view->ChildAt( 13 ) ),
+            line( "Download timeout (ms):", settings_view->ChildAt( 14 ) ),
+            line( "Retries:", settings_view->ChildAt( 15 ) ),
+            line( "Crawl depth (subdirectory levels, 0 = off):", settings_view->ChildAt( 16 ) ),
+            line( "Max listings per source:", settings_view->ChildAt( 17 ) ),
+
+            ftxui::separator(),
+            settings_view->ChildAt( 18 )->Render(),
+            line( "Download order (not by name = sizes are probed):", settings_view->ChildAt( 19 ) ),
 
             ftxui::separator(),
-            line( "Include filters (comma-separated substrings):", settings_view->ChildAt( 2 ) ),
-            line( "Exclude filters (comma-separated substrings):", settings_view->ChildAt( 3 ) ),
+            line( "Bandwidth cap (KiB/s, 0 = none):", settings_view->ChildAt( 20 ) ),
+            line( "Per-mirror cap (KiB/s, 0 = none):", settings_view->ChildAt( 21 ) ),
+            line( "Peak hours (HH:MM-HH:MM=KiB/s, comma-separated; local time):", settings_view->ChildAt( 22 ) ),
 
             ftxui::separator(),
-            settings_view->ChildAt( 4 )->Render(),
-            settings_view->ChildAt( 5 )->Render(),
+            line( "UI refresh rate (Hz; applies on restart, frames only when something changed):", settings_view->ChildAt( 23 ) ),
 
             ftxui::separator(),
-            line( "Index timeout (ms):", settings_view->ChildAt( 6 ) ),
-            line( "HEAD timeout (ms):", settings_view->ChildAt( 7 ) ),
-            line( "Download timeout (ms):", settings_view->ChildAt( 8 ) ),
-            line( "Retries:", settings_view->ChildAt( 9 ) ),
+            settings_view->ChildAt( 24 )->Render(),
+            line( "Maps no source lists any more:", settings_view->ChildAt( 25 ) ),
 
             ftxui::separator(),
-            settings_view->ChildAt( 10 )->Render(),
-            settings_view->ChildAt( 11 )->Render(),
+            settings_view->ChildAt( 26 )->Render(),
+            settings_view->ChildAt( 27 )->Render(),
             } ) | ftxui::border;
         } );
 
     auto logs_view = Renderer( [ & ] {
-        std::lock_guard lk( log.mtx );
         Elements els;
         els.push_back( text( "Live Log" ) | bold );
         els.push_back( separator() );
-        for ( auto it = log.lines.rbegin(); it != log.lines.rend() && ( int ) els.size() < 22; ++it )
-            els.push_back( text( *it ) );
+        for ( auto &l : ui_snap->lines ) els.push_back( text( l ) );
         els.push_back( separator() );
         els.push_back( text( "Failures" ) | bold );
-        for ( auto it = log.failures.rbegin(); it != log.failures.rend() && ( int ) els.size() < 34; ++it )
-            els.push_back( text( *it ) | color( Color::RedLight ) );
+        for ( auto &l : ui_snap->failures ) {
+            if ( els.size() >= 34 ) break;
+            els.push_back( text( l ) | color( Color::RedLight ) );
+        }
         return vbox( std::move( els ) ) | border;
         } );
 
@@ -1161,7 +6872,7 @@ int main() {
             [ & ]( const SourceEntry &s ) { return s.url == u; } );
 
         if ( it == sources.end() ) {
-            sources.push_back( SourceEntry{ u, true, -1, false } );
+            sources.push_back( SourceEntry{ u, true, -1, false, {} } );
             log.push( "[i] Added source: " + u );
             save_sources( sources, log );
         }
@@ -1234,7 +6945,13 @@ int main() {
 
                 auto &s = sources[ ( size_t ) idx ];
                 std::string badge = s.last_ok ? ( " ok " + std::to_string( s.last_latency_ms ) + "ms" ) : " ? ";
+                // The runner updates the rolling stats, so they are only shown between runs.
+                if ( int p50 = running.load() ? -1 : s.stats.ttfb_percentile( 0.5 ); p50 >= 0 ) {
+                    badge += " p50 " + std::to_string( p50 ) + "/p90 " + std::to_string( s.stats.ttfb_percentile( 0.9 ) ) + "ms";
+                    if ( s.stats.bps_ewma > 0 ) badge += " " + format_bytes( s.stats.bps_ewma ) + "/s";
+                }
                 std::string box = s.enabled ? "[x] " : "[ ] ";
+                if ( s.peer ) box += "[peer] ";
                 std::string del = " [Del]";
 
                 auto line = hbox( {
@@ -1272,7 +6989,7 @@ int main() {
             save_sources_btn->Render()
             } ) );
         els.push_back( separator() );
-        els.push_back( text( "Keys: ↑/↓ select, Space toggle enabled, Ctrl+D delete selected" ) );
+        els.push_back( text( "Keys: ↑/↓ select, Space toggle enabled, P toggle LAN peer, Ctrl+D delete selected" ) );
 
         return vbox( std::move( els ) ) | border;
         } );
@@ -1364,6 +7081,14 @@ int main() {
             delete_selected();
             return true;
         }
+        if ( e == Event::Character( 'p' ) && !sources.empty() ) {
+            auto &s = sources[ ( size_t ) std::clamp( sui.selected, 0, ( int ) sources.size() - 1 ) ];
+            s.peer = !s.peer;
+            log.push( std::string( s.peer ? "[i] LAN peer (preferred): " : "[i] Public mirror: " ) + s.url );
+            save_sources( sources, log );
+            screen.PostEvent( Event::Custom );
+            return true;
+        }
 
         return false;
         } );
@@ -1387,15 +7112,76 @@ int main() {
             } );
         } );
 
+    ui = CatchEvent( ui, [ & ]( Event e ) {
+        if ( e != Event::F9 ) return false;
+        ui_frozen.store( !ui_frozen.load() );
+        return true;
+        } );
+
+    // Frames come from this ticker at a fixed rate, and only when the picture would change,
+    // so drawing costs the same however many events per second the workers produce.
+    std::mutex ui_tick_mtx;
+    std::condition_variable ui_tick_cv;
+    bool ui_done = false;
+    auto ui_period = std::chrono::milliseconds( 1000 / std::clamp( settings.ui_refresh_hz, 1, 60 ) );
+    std::thread ui_ticker( [ & ] {
+        auto shown = ui_snap;
+        std::unique_lock lk( ui_tick_mtx );
+        while ( !ui_done ) {
+            ui_tick_cv.wait_for( lk, ui_period );
+            if ( ui_done || ui_frozen.load() ) continue;
+            auto next = std::make_shared<const UiSnapshot>( take_ui_snapshot( rs, log, running.load() ) );
+            if ( next->same_frame( *shown ) ) continue;
+            shown = next;
+            screen.Post( [ &ui_snap, next ] { ui_snap = next; } );
+            screen.PostEvent( Event::Custom );
+        }
+        } );
+
+    // The game folder is looked up once the UI is up: even the configured path may sit on a
+    // sleeping drive, and a search touches every Steam library. The answer is applied on the
+    // UI thread unless the path field was edited meanwhile.
+    auto hl2mp_lookup = shared_pool().submit( [ &, configured = settings.hl2mp_path, steam = settings.steam ] {
+        auto found = resolve_hl2mp_dir( configured, steam );
+        screen.Post( [ &, found, configured ] {
+            bool steam_changed = !( found.steam == settings.steam );
+            settings.steam = found.steam;
+            bool path_changed = found.path && *found.path != configured && trim( hl2mp_path_str ) == configured.string();
+            if ( !found.path ) log.push( "[i] hl2mp folder not found; set it in Settings or use Auto-detect." );
+            else if ( path_changed ) {
+                settings.hl2mp_path = *found.path;
+                hl2mp_path_str = settings.hl2mp_path.string();
+                log.push( "[i] Detected: " + hl2mp_path_str + ( found.cached ? " (cached)" : "" ) );
+            }
+            // Saved on top of the file rather than from settings, so whatever is half edited in
+            // the Settings tab is not saved along with what the search found.
+            if ( steam_changed || path_changed ) {
+                auto saved = load_settings( log );
+                saved.steam = settings.steam;
+                if ( path_changed ) saved.hl2mp_path = settings.hl2mp_path;
+                save_settings( saved, log );
+            }
+            } );
+        screen.PostEvent( Event::Custom );
+        } );
+
     screen.TrackMouse( true );
     screen.Loop( ui );
 
-    rs.cancel.store( true );
+    {
+        std::lock_guard lk( ui_tick_mtx );
+        ui_done = true;
+    }
+    ui_tick_cv.notify_all();
+    ui_ticker.join();
+    hl2mp_lookup.wait();
+
+    rs.request_cancel();
     if ( runner.joinable() ) runner.join();
 
     save_sources( sources, log );
     save_settings( settings, log );
-    write_session_log( log );
+    log.end_session();
 
     curl_global_cleanup();
     return 0;
@@ -1,20 +1,57 @@
 #pragma once
 
+#include <array>
 #include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
 #include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 namespace fs = std::filesystem;
 
+// Rolling measurements of one mirror, kept across runs in sources.json. TTFB is the time to
+// the first response byte of a listing or probe request, so it reflects how fast the mirror
+// answers rather than how long its listing is. Throughput is per download. Both are EWMAs,
+// and the newest TTFB samples are kept for percentiles.
+struct SourceStats {
+    static constexpr size_t kTtfbSamples = 32;
+
+    double ttfb_ewma_ms = -1;
+    double bps_ewma = -1;
+    std::vector<int> ttfb_ms;  // oldest first
+
+    void add_ttfb( int ms );
+    void add_throughput( double bytes_per_sec );
+    // q in [0, 1] over the kept samples; -1 without any.
+    int ttfb_percentile( double q ) const;
+};
+
 struct SourceEntry {
     std::string url;
     bool enabled = true;
+    // TTFB of the last request to the source URL itself: the root listing of a sync or
+    // index run, or the latest sample of a source probe.
     int last_latency_ms = -1;
     bool last_ok = false;
+    SourceStats stats;
+    // Another instance's --serve on the LAN: preferred for every map it has, with the
+    // public mirrors as the fallback.
+    bool peer = false;
 };
 
 struct HttpResult {
@@ -22,50 +59,795 @@ struct HttpResult {
     int latency_ms = -1;
     std::string body;
     std::string err;
+    // Time to the first response byte as curl measured it (connection setup included), -1 if unknown.
+    int ttfb_ms = -1;
+
+    // Validators from the final response, for conditional re-requests.
+    std::string etag;
+    std::string last_modified;
+
+    // Body size as announced, and the "bytes start-end/total" of a 206; -1 when absent.
+    long long content_length = -1;
+    long long range_start = -1;
+    long long range_total = -1;
+
+    // Body bytes received and wall time of the transfer, for throughput accounting.
+    long long bytes = 0;
+    double seconds = 0;
+};
+
+// A single HTTP transfer queued on a TransferEngine. Callbacks run on the engine thread,
+// so they must stay short (write a chunk, close a file, resubmit).
+struct Transfer {
+    std::string url;
+    int timeout_ms = 0;
+    bool head_only = false;
+    std::vector<std::string> headers;
+    // Which per-group bandwidth bucket the body draws from besides the global one (the
+    // pipeline uses the mirror's host); empty = only the global cap applies.
+    std::string rate_group;
+
+    // Span name of the transfer in a profile trace (see Profiler); must be a static string.
+    const char *trace_name = "http";
+
+    // Do not start before this point; used to space out retries without blocking the loop.
+    std::chrono::steady_clock::time_point not_before{};
+
+    // Optional counters bumped (relaxed) with received body bytes from the progress callback;
+    // the engine tops them up to the exact total when the transfer ends.
+    std::atomic<long long> *rx_bytes = nullptr;
+    std::atomic<long long> *rx_source_bytes = nullptr;
+
+    // Called right before the transfer is handed to curl and may still adjust it (e.g. add a
+    // Range header); returning false fails it.
+    std::function<bool( Transfer & )> on_start;
+    // Called once with the final response's status and headers, before the first body byte.
+    std::function<bool( const HttpResult & )> on_headers;
+    // Receives the body; returning false aborts. When unset the body is kept in HttpResult::body.
+    std::function<bool( const char *, size_t )> on_data;
+    std::function<void( HttpResult )> on_done;
+};
+
+// A peak window of the bandwidth schedule: minutes after local midnight, [from, to) and
+// wrapping past midnight when to < from, with the global cap that holds inside it.
+struct RateWindow {
+    int from_min = 0;
+    int to_min = 0;
+    long long bytes_per_sec = 0;
+};
+
+// Receive-rate caps in bytes/s, 0 = none. The global cap is shared by every transfer on the
+// engine, and each rate_group gets per_group on its own; windows replace the global cap
+// while the clock is inside them.
+struct RateLimits {
+    long long global = 0;
+    long long per_group = 0;
+    std::vector<RateWindow> windows;
+
+    long long global_at( int minute_of_day ) const;
+    bool any() const { return global > 0 || per_group > 0 || !windows.empty(); }
+};
+
+// Bytes/s token bucket holding at most a quarter second of tokens. A take may overdraw, so a
+// paused transfer can always finish the chunk curl is holding for it; the debt is paid off
+// before the bucket admits anyone else. Engine thread only.
+class TokenBucket {
+public:
+    void set_rate( long long bytes_per_sec, std::chrono::steady_clock::time_point now );
+    void refill( std::chrono::steady_clock::time_point now );
+    bool has_tokens() const { return rate_ <= 0 || tokens_ > 0; }
+    void take( size_t n ) { if ( rate_ > 0 ) tokens_ -= ( double ) n; }
+    // Milliseconds until has_tokens() holds again.
+    int wait_ms() const;
+
+private:
+    long long rate_ = 0;
+    double tokens_ = 0;
+    std::chrono::steady_clock::time_point last_{};
+};
+
+// curl_multi event loop holding up to max_in_flight transfers at once. Connections are
+// reused within the engine; DNS and TLS sessions are shared by every engine.
+class TransferEngine {
+public:
+    struct Job;
+
+    explicit TransferEngine( int max_in_flight, std::atomic<bool> *cancel = nullptr );
+    ~TransferEngine();
+
+    TransferEngine( const TransferEngine & ) = delete;
+    TransferEngine &operator=( const TransferEngine & ) = delete;
+
+    void submit( Transfer t );
+    void wait_idle();
+    // Caps body bytes by pausing transfers that run out of tokens and resuming them in turn.
+    // While any limit is set, timeout_ms bounds a stall rather than the whole transfer.
+    void set_rate_limits( RateLimits limits );
+    // Interrupts the loop's socket wait, e.g. so a cancel is acted on right away.
+    void wake();
+
+private:
+    void loop();
+    Job *next_ready( std::chrono::steady_clock::time_point now, int &wait_ms );
+    void start( Job *job );
+    void finish( Job *job, HttpResult r );
+    void throttle( std::chrono::steady_clock::time_point now, int &wait_ms );
+
+    int max_in_flight_;
+    std::atomic<bool> *cancel_;
+    void *multi_ = nullptr;
+    std::vector<void *> idle_easies_;
+
+    std::mutex mtx_;
+    std::condition_variable idle_cv_;
+    std::deque<std::unique_ptr<Job>> pending_;
+    std::unordered_map<Job *, std::unique_ptr<Job>> active_;
+    bool stop_ = false;
+    std::thread loop_;
+
+    // Limits are handed over under mtx_ and copied into applied_ by the loop thread, which
+    // owns applied_ and the buckets.
+    RateLimits limits_;
+    bool limits_changed_ = false;
+    RateLimits applied_;
+    bool limiting_ = false;
+    TokenBucket global_bucket_;
+    std::unordered_map<std::string, TokenBucket> group_buckets_;
+    std::chrono::steady_clock::time_point schedule_checked_{};
+    std::vector<Job *> paused_;
+    size_t resume_turn_ = 0;
+};
+
+// Small HTTP/1.1 server serving an in-memory file tree and optionally one directory from
+// disk: GET and HEAD, keep-alive and single byte ranges ("N-", "N-M", "-N"), one thread per
+// connection up to kMaxConnections, each closed after kIdleSeconds without a request. Used by
+// --bench for a loopback FastDL mirror and by --serve to share download/maps with other
+// instances on the LAN, so it favours simplicity over throughput.
+class MiniHttpServer {
+public:
+    // URL path ("/hl2mp/maps/", "/hl2mp/maps/dm_x.bsp.bz2") to response body.
+    using Files = std::unordered_map<std::string, std::string>;
+
+    static constexpr int kMaxConnections = 32;
+    static constexpr int kIdleSeconds = 30;
+
+    explicit MiniHttpServer( Files files ) : files_( std::move( files ) ) {}
+    ~MiniHttpServer();
+
+    MiniHttpServer( const MiniHttpServer & ) = delete;
+    MiniHttpServer &operator=( const MiniHttpServer & ) = delete;
+
+    // Serves the .bsp and .bz2 files of dir below url_prefix ("/maps/"), with a generated
+    // listing at the prefix itself; files are read from disk per request. aliases adds names
+    // under the prefix backed by files elsewhere (manifest.json). Call before start().
+    void mount( std::string url_prefix, fs::path dir, std::unordered_map<std::string, fs::path> aliases = {} );
+
+    // Binds 127.0.0.1 (or every interface when lan is set) on port, 0 for an ephemeral one,
+    // and starts accepting; false with err set on failure.
+    bool start( std::string &err, int port = 0, bool lan = false );
+    void stop();
+    int port() const { return port_; }
+
+private:
+    void accept_loop();
+    void serve( intptr_t sock );
+    // Joins the threads of connections that have ended.
+    void reap();
+    // Resolves a request below the mount to a file on disk; empty if it is not one.
+    fs::path mounted_file( std::string_view rel ) const;
+    std::string mounted_listing() const;
+
+    Files files_;
+    std::string mount_prefix_;
+    fs::path mount_dir_;
+    std::unordered_map<std::string, fs::path> mount_aliases_;
+    intptr_t listen_ = -1;
+    int port_ = 0;
+    std::atomic<bool> stop_{ false };
+    std::thread accept_;
+    std::mutex conns_mtx_;
+    std::unordered_map<std::thread::id, std::thread> conns_;
+    // Connections whose serve() has returned, for reap().
+    std::vector<std::thread::id> ended_;
+    std::unordered_set<intptr_t> open_;
 };
 
 struct PhaseProgress {
     std::atomic<bool> running{ false };
     std::atomic<int> done{ 0 };
     std::atomic<int> total{ 0 };
+
+    // Byte counters, all updated with relaxed atomics. Downloads: bytes received and the sum
+    // of announced sizes over the `sized` files that had one. Extraction: .bz2 bytes read
+    // (bytes), bytes written (bytes_out) and the size of the `sized` queued .bz2s (bytes_total).
+    std::atomic<long long> bytes{ 0 };
+    std::atomic<long long> bytes_total{ 0 };
+    std::atomic<long long> bytes_out{ 0 };
+    std::atomic<int> sized{ 0 };
+};
+
+// Bytes received from one source during the current run.
+struct SourceTraffic {
+    std::string url;
+    std::atomic<long long> bytes{ 0 };
+};
+
+// Lets sets keyed by std::string be probed with a string_view without building a string.
+struct StringHash {
+    using is_transparent = void;
+    size_t operator()( std::string_view s ) const { return std::hash<std::string_view>{}( s ); }
+};
+
+using StringSet = std::unordered_set<std::string, StringHash, std::equal_to<>>;
+
+// Which form of a map a source lists: the compressed "x.bsp.bz2" or the plain "x.bsp".
+enum class MapVariant : uint8_t { Bz2 = 0, Plain = 1 };
+
+// Remote maps and which sources carry them. Maps are keyed by their .bsp name, so a .bz2
+// and a plain listing of the same map are one entry with a source bitset per variant.
+// Names are interned into per-shard arenas as each listing is parsed (add() is safe to call
+// from several threads at once), then finalize() freezes everything into name-sorted flat
+// arrays: one arena, one entry per map, the bitsets and an open-addressing table for find().
+class MapIndex {
+public:
+    // Clears the index for a run over `sources` sources, numbered 0..sources-1.
+    void reset( size_t sources );
+    // Adds the file names of links (full URLs) as available from `source`. Links below base
+    // (the source URL) that sit in a subdirectory of it keep that subdirectory, see dir().
+    void add( int source, const std::vector<std::string> &links, std::string_view base = {} );
+    void finalize();
+
+    // Valid after finalize(); ids run 0..size()-1 in name order.
+    size_t size() const { return entries_.size(); }
+    std::string_view name( uint32_t id ) const { return { names_.data() + entries_[ id ].off, entries_[ id ].len }; }
+    std::optional<uint32_t> find( std::string_view name ) const;
+    // Where `source` keeps this variant of map id, relative to its URL: "" or e.g. "a/".
+    std::string_view dir( uint32_t id, int source, MapVariant v ) const;
+
+    template <typename F>
+    void for_each_source( uint32_t id, MapVariant v, F &&f ) const {
+        const uint64_t *w = bits_.data() + ( size_t ) id * stride() + ( size_t ) v * words_;
+        for ( size_t i = 0; i < words_; ++i )
+            for ( uint64_t b = w[ i ]; b; b &= b - 1 ) f( ( int ) ( i * 64 + ( size_t ) std::countr_zero( b ) ) );
+    }
+
+private:
+    struct Entry {
+        uint32_t off;
+        uint32_t len;
+        uint64_t hash;
+    };
+
+    // A map a source lists below its URL rather than directly in it; the path is in the arena.
+    struct Placed {
+        uint32_t entry;
+        uint32_t slot;  // source * 2 + variant
+        uint32_t off;
+        uint32_t len;
+    };
+
+    struct Shard {
+        std::mutex mtx;
+        std::string arena;
+        std::vector<Entry> entries;
+        std::vector<uint64_t> bits;
+        std::vector<uint32_t> slots;  // entry index + 1, 0 = empty
+        std::vector<Placed> placed;
+    };
+
+    static constexpr int SHARDS = 16;
+
+    // Words per entry: one bitset for Bz2, then one for Plain.
+    size_t stride() const { return 2 * words_; }
+
+    // Returns the index of name in entries, adding it (and growing the table) if new.
+    static uint32_t intern( std::string &arena, std::vector<Entry> &entries, std::vector<uint32_t> &slots,
+        std::vector<uint64_t> &bits, size_t words, std::string_view name, uint64_t hash );
+
+    size_t words_ = 1;
+    std::array<Shard, SHARDS> shards_;
+
+    std::string names_;
+    std::vector<Entry> entries_;
+    std::vector<uint64_t> bits_;
+    std::vector<uint32_t> slots_;
+    // (id << 32 | slot) -> offset and length of the subdirectory in names_. Sharded mirrors
+    // are the exception, so this stays small next to the flat arrays.
+    std::unordered_map<uint64_t, std::pair<uint32_t, uint32_t>> dirs_;
 };
 
 struct RunState {
     std::atomic<bool> cancel{ false };
-    std::unordered_set<std::string> existing_files;
+    // Name of the pipeline stage currently running ("" between runs).
+    std::atomic<const char *> stage{ "" };
+
+    // Stages that block on something other than the flag (a condition variable, a queue, the
+    // curl socket wait) register a hook; request_cancel() sets the flag and runs them all.
+    int add_cancel_hook( std::function<void()> f );
+    void remove_cancel_hook( int id );
+    void request_cancel();
+    StringSet existing_files;
 
     PhaseProgress indexing;
     PhaseProgress downloading;
     PhaseProgress decompressing;
     PhaseProgress deleting;
 
+    // Rebuilt by each run (one entry per enabled source); hold traffic_mtx to walk the list.
+    std::mutex traffic_mtx;
+    std::vector<std::unique_ptr<SourceTraffic>> traffic;
+
     std::atomic<int> last_remote_unique{ 0 };
     std::atomic<int> last_remote_after_filters{ 0 };
     std::atomic<int> last_already_have{ 0 };
     std::atomic<int> last_to_download{ 0 };
+
+private:
+    std::mutex hooks_mtx_;
+    int next_hook_ = 0;
+    std::vector<std::pair<int, std::function<void()>>> hooks_;
+};
+
+// How map files reach the disk. Stdio is plain fwrite with the default buffer; Buffered
+// writes from one large aligned buffer and preallocates when the size is known; Direct adds
+// O_DIRECT on top of that; Mmap copies into a growing shared mapping. Direct and Mmap are
+// POSIX-only and fall back to Buffered elsewhere or when the file system refuses them.
+enum class WriteMode { Stdio, Buffered, Direct, Mmap };
+
+// The order the fetch starts maps in. Name is the listing order. The other two need sizes, so
+// they turn on the HEAD probe: largest first keeps a big map from starting last and stretching
+// the run, smallest first gets the most maps in place early.
+enum class FetchOrder { Name, LargestFirst, SmallestFirst };
+
+// What happens to a map this tool downloaded once it has been dropped from a source's listing
+// and no source lists it any more: nothing, deleted, or moved to download/maps_pruned/.
+enum class PruneMode { Off, Delete, Archive };
+
+// When a finished file is flushed: never (the OS decides), the file before it is renamed
+// into place, or the file and then its directory so the rename itself survives a crash.
+enum class FsyncPolicy { Never, File, FileAndDir };
+
+// What the last Steam library search found: the hl2mp folder and each libraryfolders.vdf it
+// read with its mtime (0 = not there). While those files are unchanged the library list is
+// too, so a start-up reuses the folder instead of probing every library again.
+struct SteamDiscovery {
+    fs::path hl2mp;
+    std::vector<std::pair<fs::path, std::int64_t>> vdfs;
+
+    bool operator==( const SteamDiscovery & ) const = default;
 };
 
 struct Settings {
     fs::path hl2mp_path;
     int threads = 4;
+    // CPU workers for .bz2 extraction, independent of the network concurrency above; 0 = auto.
+    int decompress_threads = 0;
 
     bool decompress = false;
     bool delete_bz2 = false;
+    // Decode .bz2 inside the download write callback instead of in a separate pass.
+    bool stream_decompress = false;
 
     int index_timeout_ms = 8000;
     int head_timeout_ms = 5000;
     int dl_timeout_ms = 30000;
     int retries = 3;
+    // Upper bound on concurrent downloads from one mirror host; the scheduler may run fewer.
+    int per_source_connections = 4;
+    // Subdirectory levels followed below a source's listing (0 = that listing only; crawling
+    // is opt-in), and the most listings fetched from one source per run.
+    int crawl_depth = 0;
+    int crawl_max_requests = 64;
+    // Bandwidth caps in KiB/s, 0 = none: for the whole run and for each mirror. The schedule
+    // lists peak windows with their own overall cap, e.g. "18:00-23:30=512, 12:00-14:00=2048".
+    int rate_limit_kbps = 0;
+    int source_rate_limit_kbps = 0;
+    std::string rate_schedule;
+
+    // Terminal UI frames per second at most; a frame is only drawn when something changed.
+    int ui_refresh_hz = 15;
+
+    SteamDiscovery steam;
+    // HEAD every planned map before the fetch so the ETA knows the whole run's size; orders
+    // other than Name probe regardless.
+    bool probe_sizes = false;
+    FetchOrder fetch_order = FetchOrder::Name;
+    // Download a map again when its listing row (date and size columns) changed since the
+    // previous run, i.e. it was replaced upstream under the same name.
+    bool refetch_changed = true;
+    PruneMode prune = PruneMode::Off;
+
+    WriteMode write_mode = WriteMode::Buffered;
+    int write_buffer_kb = 1024;
+    FsyncPolicy fsync_policy = FsyncPolicy::Never;
 
     std::string include_filters;
     std::string exclude_filters;
+
+    // Re-hash every map recorded in the manifest during the scan, not only changed ones.
+    // Set per run (--verify); not saved.
+    bool verify_local = false;
+    // Record a profile of each run and write it to logs/ as a Chrome trace (--trace); not saved.
+    bool trace = false;
+    // Where a run keeps its inventory, index cache and manifest; empty = app_dir(). Not saved
+    // (the bench points it at its scratch directory).
+    fs::path data_dir;
+};
+
+struct OutputOptions {
+    WriteMode mode = WriteMode::Buffered;
+    size_t buffer_bytes = 1 << 20;
+    FsyncPolicy fsync = FsyncPolicy::Never;
+};
+
+OutputOptions output_options( const Settings &s );
+
+// What a map's content must look like: its size, the IEEE CRC32 and the SHA-256 (lower-case
+// hex). Digests read from an upstream manifest may leave out any of the three.
+struct MapDigest {
+    long long size = -1;
+    std::optional<uint32_t> crc32;
+    std::string sha256;
+};
+
+// CRC32 and SHA-256 of a byte stream, fed in order. An OutputFile with a hasher attached
+// feeds it from write(), so files are hashed as they are produced rather than re-read.
+class ContentHasher {
+public:
+    ContentHasher() { reset(); }
+    void reset();
+    void update( const void *data, size_t n );
+    // Digest of everything fed since reset(); the hasher must be reset before reuse.
+    MapDigest finish();
+
+private:
+    void compress( const unsigned char *block );
+
+    uint32_t crc_ = 0;
+    std::array<uint32_t, 8> state_{};
+    unsigned char block_[ 64 ]{};
+    size_t block_len_ = 0;
+    uint64_t total_ = 0;
+};
+
+// Sequential writer for downloaded and extracted files, see WriteMode.
+class OutputFile {
+public:
+    OutputFile() = default;
+    // Closes without syncing; callers that care about the result call close() themselves.
+    ~OutputFile();
+
+    OutputFile( const OutputFile & ) = delete;
+    OutputFile &operator=( const OutputFile & ) = delete;
+
+    // append continues an existing file; size_hint is how much this open will write, or -1.
+    bool open( const fs::path &p, bool append, const OutputOptions &o, long long size_hint = -1 );
+    bool write( const void *data, size_t n );
+    // Flushes, trims any preallocation, applies the fsync policy and closes; false on any
+    // I/O error since open().
+    bool close();
+
+    bool is_open() const { return open_; }
+    // The mode actually in use after fallbacks.
+    WriteMode mode() const { return mode_; }
+    // Bytes of the file that hold data so far. In Mmap mode the file on disk is longer (the
+    // mapped reserve, zero-filled) until close() trims it.
+    long long size() const { return pos_; }
+    // Every byte written from now on is also fed to h (may be null); survives open().
+    void set_hasher( ContentHasher *h ) { hasher_ = h; }
+
+private:
+    bool flush_buffer( bool final );
+    bool grow_map( size_t need );
+    bool drop_map();
+    void trim_reserve();
+    void release();
+
+    OutputOptions opt_;
+    WriteMode mode_ = WriteMode::Buffered;
+    bool open_ = false;
+    bool failed_ = false;
+    FILE *fp_ = nullptr;
+    int fd_ = -1;
+    char *buf_ = nullptr;
+    size_t buf_len_ = 0;
+    size_t buf_cap_ = 0;
+    char *map_ = nullptr;
+    size_t map_cap_ = 0;
+    long long pos_ = 0;
+    // End of the blocks fallocate reserved past EOF for a non-mapped write, 0 = none.
+    long long reserved_end_ = 0;
+    ContentHasher *hasher_ = nullptr;
+};
+
+// Fixed-capacity MPMC hand-off between pipeline stages. push() blocks while full, which is
+// how a slow consumer pushes back on its producer; close() wakes everyone up.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue( size_t capacity ) : cap_( capacity ? capacity : 1 ) {}
+
+    bool push( T v ) {
+        std::unique_lock lk( mtx_ );
+        not_full_.wait( lk, [ this ] { return closed_ || q_.size() < cap_; } );
+        if ( closed_ ) return false;
+        q_.push_back( std::move( v ) );
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Never blocks: false if the queue is full or closed (tell them apart with closed()), in
+    // which case v is left as it was.
+    bool try_push( T &v ) {
+        std::lock_guard lk( mtx_ );
+        if ( closed_ || q_.size() >= cap_ ) return false;
+        q_.push_back( std::move( v ) );
+        not_empty_.notify_one();
+        return true;
+    }
+
+    bool closed() {
+        std::lock_guard lk( mtx_ );
+        return closed_;
+    }
+
+    // Blocks until an item is available; nullopt once closed and drained.
+    std::optional<T> pop() {
+        std::unique_lock lk( mtx_ );
+        not_empty_.wait( lk, [ this ] { return closed_ || !q_.empty(); } );
+        if ( q_.empty() ) return std::nullopt;
+        T v = std::move( q_.front() );
+        q_.pop_front();
+        not_full_.notify_one();
+        return v;
+    }
+
+    void close() {
+        std::lock_guard lk( mtx_ );
+        closed_ = true;
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+private:
+    size_t cap_;
+    std::mutex mtx_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+    std::deque<T> q_;
+    bool closed_ = false;
+};
+
+// Long-lived worker threads shared by every run and stage, so per-item work is a queue push
+// rather than a thread start. submit() returns a future for the callable's result.
+class WorkerPool {
+public:
+    explicit WorkerPool( int threads );
+    ~WorkerPool();
+
+    WorkerPool( const WorkerPool & ) = delete;
+    WorkerPool &operator=( const WorkerPool & ) = delete;
+
+    // batch tags tasks that are waited for together with wait_helping; any address that
+    // outlives them will do, usually the caller's container of futures.
+    template <typename F>
+    auto submit( F &&f, const void *batch = nullptr ) -> std::future<std::invoke_result_t<std::decay_t<F> &>> {
+        using R = std::invoke_result_t<std::decay_t<F> &>;
+        auto task = std::make_shared<std::packaged_task<R()>>( std::forward<F>( f ) );
+        auto fut = task->get_future();
+        {
+            std::lock_guard lk( mtx_ );
+            q_.push_back( { batch, [ task ] { ( *task )(); } } );
+        }
+        cv_.notify_one();
+        return fut;
+    }
+
+    // Grows the pool to at least n threads. Stages that park a worker for their whole
+    // lifetime (the decompress drains) reserve their own so short tasks still get through.
+    void reserve( int n );
+    int size();
+
+    // Waits for f, a task of batch, running the batch's queued tasks on the calling thread
+    // meanwhile, so a task can wait on work it submitted itself without an idle worker. Other
+    // work is never picked up here (it may be a drain that runs for the whole stage). Once
+    // nothing of the batch is queued, f's task is running elsewhere and this just blocks.
+    template <typename T>
+    void wait_helping( std::future<T> &f, const void *batch ) {
+        while ( f.wait_for( std::chrono::seconds( 0 ) ) != std::future_status::ready ) {
+            if ( !run_one( batch ) ) {
+                f.wait();
+                return;
+            }
+        }
+    }
+
+private:
+    struct Task {
+        const void *batch;
+        std::function<void()> fn;
+    };
+
+    void run();
+    bool run_one( const void *batch );
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<Task> q_;
+    std::vector<std::thread> threads_;
+    bool stop_ = false;
 };
 
+WorkerPool &shared_pool();
+
+// Optional run profile. Threads record spans into tracks of their own (one per thread, so
+// recording never contends), and the run exports them as Chrome trace-event JSON for
+// chrome://tracing or Perfetto plus a per-name summary. While stopped, a span costs one
+// relaxed load.
+class Profiler {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // Shown with a span: a free-form detail (a URL, a file name) and named numbers.
+    struct Args {
+        std::string detail;
+        std::vector<std::pair<const char *, long long>> values;
+    };
+
+    // Drops everything recorded so far and starts recording.
+    void start();
+    void stop();
+    bool enabled() const { return on_.load( std::memory_order_relaxed ); }
+
+    // Names the calling thread's track; may be called before start().
+    void name_thread( std::string name );
+
+    // Names must be static strings. complete() is a span of the calling thread, so spans of
+    // one thread must nest; async() spans may overlap (transfers on the engine thread) and
+    // nest by sharing an id from next_id(). sample() only counts towards the summary.
+    void complete( const char *name, clock::time_point begin, clock::time_point end, Args args = {} );
+    void async( const char *name, uint64_t id, clock::time_point begin, clock::time_point end, Args args = {} );
+    void sample( const char *name, clock::duration d );
+    uint64_t next_id() { return ids_.fetch_add( 1, std::memory_order_relaxed ) + 1; }
+
+    bool write_chrome_trace( const fs::path &p ) const;
+    // One line per span name: count, total, p50/p90/max and a histogram of durations.
+    std::vector<std::string> summary() const;
+
+private:
+    enum class Kind : uint8_t { Complete, Async, Sample };
+
+    struct Event {
+        const char *name;
+        Kind kind;
+        uint64_t id;
+        clock::time_point begin;
+        clock::duration dur;
+        Args args;
+    };
+
+    struct Track {
+        uint32_t tid = 0;
+        std::string name;
+        mutable std::mutex mtx;
+        std::vector<Event> events;
+    };
+
+    void record( Event e );
+
+    std::atomic<bool> on_{ false };
+    // Bumped by start(); a thread whose track is from an older generation registers a new one.
+    std::atomic<uint64_t> gen_{ 0 };
+    std::atomic<uint32_t> next_tid_{ 0 };
+    std::atomic<uint64_t> ids_{ 0 };
+    clock::time_point epoch_{};
+    mutable std::mutex mtx_;
+    std::vector<std::shared_ptr<Track>> tracks_;
+};
+
+Profiler &profiler();
+
+// Times its scope as a Profiler::complete() span when the profiler is recording.
+class TraceScope {
+public:
+    explicit TraceScope( const char *name ) : name_( profiler().enabled() ? name : nullptr ) {
+        if ( name_ ) begin_ = Profiler::clock::now();
+    }
+    ~TraceScope() {
+        if ( name_ ) profiler().complete( name_, begin_, Profiler::clock::now(), std::move( args_ ) );
+    }
+
+    TraceScope( const TraceScope & ) = delete;
+    TraceScope &operator=( const TraceScope & ) = delete;
+
+    // Check before building args, so an idle profiler costs nothing more.
+    bool active() const { return name_ != nullptr; }
+    Profiler::Args &args() { return args_; }
+
+private:
+    const char *name_;
+    Profiler::clock::time_point begin_{};
+    Profiler::Args args_;
+};
+
+// Fixed-capacity ring of log lines for many writers and a few readers. A writer claims the
+// next sequence number with one fetch_add and copies into that slot's fixed buffer, so
+// writers only meet when the ring wraps onto a slot mid-copy. Each slot is a seqlock:
+// readers copy the text out and retry if a writer got in meanwhile, so a writer never waits
+// on a reader. Entries are cut at kMaxText bytes, the size pushf() formats into anyway.
+class LogRing {
+public:
+    explicit LogRing( size_t capacity );
+
+    // Returns the entry's sequence number.
+    uint64_t push( std::string_view s );
+
+    // Total ever pushed; the ring holds at most capacity() of the newest.
+    uint64_t pushed() const { return head_.load( std::memory_order_acquire ); }
+    size_t capacity() const { return mask_ + 1; }
+
+    // Appends the entries from sequence `from` on that are still held, oldest first, and
+    // returns where to resume. Stops early at a slot whose writer has not finished yet.
+    uint64_t read_since( uint64_t from, std::vector<std::string> &out ) const;
+
+    // Up to n of the newest entries, newest first.
+    std::vector<std::string> newest( size_t n ) const;
+
+private:
+    static constexpr size_t kMaxText = 511;
+
+    struct Slot {
+        // Odd while a writer is copying in.
+        std::atomic<uint64_t> version{ 0 };
+        std::atomic<uint64_t> seq{ UINT64_MAX };
+        std::atomic<uint32_t> len{ 0 };
+        char text[ kMaxText ];
+    };
+
+    // 0 = copied, 1 = not written yet, 2 = already overwritten.
+    int copy_slot( uint64_t seq, std::string &out ) const;
+
+    std::unique_ptr<Slot[]> slots_;
+    size_t mask_;
+    std::atomic<uint64_t> head_{ 0 };
+};
+
+#if defined( __GNUC__ )
+#define LIVELOG_PRINTF( fmt_idx, args_idx ) __attribute__( ( format( printf, fmt_idx, args_idx ) ) )
+#else
+#define LIVELOG_PRINTF( fmt_idx, args_idx )
+#endif
+
 struct LiveLog {
-    std::mutex mtx;
-    std::vector<std::string> lines;
-    std::vector<std::string> failures;
+    LiveLog() = default;
+    ~LiveLog();
+
+    LiveLog( const LiveLog & ) = delete;
+    LiveLog &operator=( const LiveLog & ) = delete;
+
+    LogRing lines{ 1024 };
+    LogRing failures{ 256 };
+
+    void push( std::string_view s );
+    void fail( std::string_view s );
+    // printf-style variants that format into a stack buffer, for per-file messages.
+    void pushf( const char *fmt, ... ) LIVELOG_PRINTF( 2, 3 );
+    void failf( const char *fmt, ... ) LIVELOG_PRINTF( 2, 3 );
+
+    // Appends every line (and failure, tagged "[FAIL]") to path from a background thread as
+    // they arrive, until end_session() drains the rest and closes the file.
+    bool begin_session( const fs::path &path );
+    void end_session();
+
+private:
+    void session_loop();
+    void session_drain();
 
-    void push( std::string s );
-    void fail( std::string s );
+    std::mutex session_mtx_;
+    std::condition_variable session_cv_;
+    std::thread session_thread_;
+    FILE *session_file_ = nullptr;
+    bool session_stop_ = false;
+    uint64_t line_cursor_ = 0;
+    uint64_t fail_cursor_ = 0;
 };